@@ -0,0 +1,123 @@
+// Copyright (c) 2019-2020 The BITWIN24 developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilemapping.h"
+
+#include "clientversion.h"
+#include "crypto/common.h"
+#include "main.h"
+#include "primitives/block.h"
+#include "primitives/transaction.h"
+#include "streams.h"
+#include "util.h"
+
+#include <boost/interprocess/file_mapping.hpp>
+
+CBlockFileMappings::RegionPtr CBlockFileMappings::Map(int nFile, uint64_t nMinSize)
+{
+    LOCK(cs);
+    for (std::list<std::pair<int, RegionPtr> >::iterator it = listMappings.begin(); it != listMappings.end(); ++it) {
+        if (it->first != nFile)
+            continue;
+        if (it->second->get_size() >= nMinSize) {
+            listMappings.splice(listMappings.begin(), listMappings, it);
+            return it->second;
+        }
+        // the file grew since it was mapped
+        listMappings.erase(it);
+        break;
+    }
+    if (nMaxMappings == 0)
+        return RegionPtr();
+
+    boost::filesystem::path path = GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk");
+    RegionPtr region;
+    try {
+        boost::interprocess::file_mapping mapping(path.string().c_str(), boost::interprocess::read_only);
+        region.reset(new boost::interprocess::mapped_region(mapping, boost::interprocess::read_only));
+    } catch (const std::exception& e) {
+        LogPrint("db", "%s : Failed to map file %s - %s\n", __func__, path.string(), e.what());
+        return RegionPtr();
+    }
+    if (region->get_size() < nMinSize)
+        return RegionPtr();
+
+    listMappings.push_front(std::make_pair(nFile, region));
+    if (listMappings.size() > nMaxMappings)
+        listMappings.pop_back();
+    return region;
+}
+
+bool CBlockFileMappings::GetBlockData(const CDiskBlockPos& pos, RegionPtr& region, const char*& pbegin, const char*& pend)
+{
+    // blocks are stored behind the network magic and their size
+    if (pos.IsNull() || pos.nPos < MESSAGE_START_SIZE + sizeof(unsigned int))
+        return false;
+    region = Map(pos.nFile, pos.nPos);
+    if (!region)
+        return false;
+
+    const char* pfile = static_cast<const char*>(region->get_address());
+    uint32_t nSize = ReadLE32((const unsigned char*)pfile + pos.nPos - sizeof(unsigned int));
+    if (nSize > MAX_BLOCK_SIZE_CURRENT)
+        return false;
+    if ((uint64_t)pos.nPos + nSize > region->get_size()) {
+        region = Map(pos.nFile, (uint64_t)pos.nPos + nSize);
+        if (!region)
+            return false;
+        pfile = static_cast<const char*>(region->get_address());
+    }
+
+    // Never read past the block: the file may have been truncated behind it since it was mapped
+    pbegin = pfile + pos.nPos;
+    pend = pbegin + nSize;
+    return true;
+}
+
+bool CBlockFileMappings::ReadBlock(const CDiskBlockPos& pos, CBlock& block)
+{
+    RegionPtr region;
+    const char* pbegin;
+    const char* pend;
+    if (!GetBlockData(pos, region, pbegin, pend))
+        return false;
+
+    CMemoryReader ss(pbegin, pend, SER_DISK, CLIENT_VERSION);
+    ss >> block;
+    return true;
+}
+
+bool CBlockFileMappings::ReadTransaction(const CDiskBlockPos& pos, unsigned int nTxOffset, CBlockHeader& header, CTransaction& tx)
+{
+    RegionPtr region;
+    const char* pbegin;
+    const char* pend;
+    if (!GetBlockData(pos, region, pbegin, pend))
+        return false;
+
+    CMemoryReader ss(pbegin, pend, SER_DISK, CLIENT_VERSION);
+    ss >> header;
+    if (nTxOffset > ss.size())
+        throw std::ios_base::failure("CBlockFileMappings::ReadTransaction() : transaction offset out of range");
+    CMemoryReader sstx(ss.begin() + nTxOffset, pend, SER_DISK, CLIENT_VERSION);
+    sstx >> tx;
+    return true;
+}
+
+void CBlockFileMappings::Invalidate(int nFile)
+{
+    LOCK(cs);
+    for (std::list<std::pair<int, RegionPtr> >::iterator it = listMappings.begin(); it != listMappings.end(); ++it) {
+        if (it->first == nFile) {
+            listMappings.erase(it);
+            return;
+        }
+    }
+}
+
+void CBlockFileMappings::Clear()
+{
+    LOCK(cs);
+    listMappings.clear();
+}
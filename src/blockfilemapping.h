@@ -0,0 +1,61 @@
+// Copyright (c) 2019-2020 The BITWIN24 developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITWIN24_BLOCKFILEMAPPING_H
+#define BITWIN24_BLOCKFILEMAPPING_H
+
+#include "chain.h"
+#include "sync.h"
+
+#include <list>
+#include <memory>
+#include <utility>
+
+#include <boost/interprocess/mapped_region.hpp>
+
+class CBlock;
+class CBlockHeader;
+class CTransaction;
+
+/** Number of block files kept mapped; mapping them would exhaust the address space of 32 bit systems */
+static const unsigned int MAX_BLOCKFILE_MAPPINGS = sizeof(void*) >= 8 ? 8 : 0;
+
+/**
+ * Read-only mappings of the most recently read block files (blk?????.dat),
+ * which blocks and transactions are deserialized from directly.
+ *
+ * A file is mapped again once it has grown past its mapping. The read
+ * functions return false if the data cannot be mapped, leaving it to the
+ * caller to read the file instead, and throw if deserialization fails.
+ */
+class CBlockFileMappings
+{
+private:
+    typedef std::shared_ptr<const boost::interprocess::mapped_region> RegionPtr;
+
+    CCriticalSection cs;
+    //! most recently used first
+    std::list<std::pair<int, RegionPtr> > listMappings;
+    unsigned int nMaxMappings;
+
+    //! A mapping of the whole file, at least nMinSize bytes large
+    RegionPtr Map(int nFile, uint64_t nMinSize);
+    //! The serialized block at pos, within region which is kept mapped meanwhile
+    bool GetBlockData(const CDiskBlockPos& pos, RegionPtr& region, const char*& pbegin, const char*& pend);
+
+public:
+    CBlockFileMappings(unsigned int nMaxMappingsIn) : nMaxMappings(nMaxMappingsIn) {}
+
+    bool ReadBlock(const CDiskBlockPos& pos, CBlock& block);
+
+    //! Read the header of the block at pos, and the transaction nTxOffset bytes behind it
+    bool ReadTransaction(const CDiskBlockPos& pos, unsigned int nTxOffset, CBlockHeader& header, CTransaction& tx);
+
+    //! Drop the mapping of a block file, e.g. before it is truncated
+    void Invalidate(int nFile);
+
+    void Clear();
+};
+
+#endif // BITWIN24_BLOCKFILEMAPPING_H
@@ -0,0 +1,153 @@
+// Copyright (c) 2019-2020 The BITWIN24 developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockimport.h"
+
+#include "checkqueue.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "util.h"
+
+#include <boost/bind.hpp>
+
+static CCheckQueue<CBlockHashCheck> blockhashqueue(16);
+
+void ThreadBlockHash()
+{
+    RenameThread("bitwin24-blkhash");
+    blockhashqueue.Thread();
+}
+
+bool CBlockHashCheck::operator()()
+{
+    pimported->hash = pimported->block.GetHash();
+    return true;
+}
+
+CBlockFileReader::CBlockFileReader(FILE* fileIn, int nFileIn) : blkdat(fileIn, 2 * MAX_BLOCK_SIZE_CURRENT, MAX_BLOCK_SIZE_CURRENT + 8, SER_DISK, CLIENT_VERSION),
+                                                                nFile(nFileIn), nQueuedSize(0), fDone(false), fStop(false)
+{
+    thread = boost::thread(boost::bind(&CBlockFileReader::ThreadRead, this));
+}
+
+CBlockFileReader::~CBlockFileReader()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+        condReader.notify_all();
+    }
+    thread.join();
+}
+
+void CBlockFileReader::HashBatch(std::vector<CImportedBlock>& vBatch)
+{
+    std::vector<CBlockHashCheck> vChecks;
+    vChecks.reserve(vBatch.size());
+    for (CImportedBlock& imported : vBatch)
+        vChecks.push_back(CBlockHashCheck(&imported));
+    CCheckQueueControl<CBlockHashCheck> control(&blockhashqueue);
+    control.Add(vChecks);
+    control.Wait();
+}
+
+bool CBlockFileReader::PushBatch(std::vector<CImportedBlock>& vBatch)
+{
+    HashBatch(vBatch);
+
+    size_t nBatchSize = 0;
+    for (const CImportedBlock& imported : vBatch)
+        nBatchSize += imported.nSize;
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (!fStop && !queue.empty() && nQueuedSize + nBatchSize > MAX_IMPORT_QUEUE_SIZE)
+        condReader.wait(lock);
+    if (fStop) {
+        vBatch.clear();
+        return false;
+    }
+    for (CImportedBlock& imported : vBatch)
+        queue.push_back(std::move(imported));
+    nQueuedSize += nBatchSize;
+    vBatch.clear();
+    condConsumer.notify_one();
+    return true;
+}
+
+void CBlockFileReader::ThreadRead()
+{
+    RenameThread("bitwin24-blkread");
+
+    std::vector<CImportedBlock> vBatch;
+    vBatch.reserve(IMPORT_HASH_BATCH);
+    size_t nBatchSize = 0;
+    try {
+        uint64_t nRewind = blkdat.GetPos();
+        while (!blkdat.eof()) {
+            blkdat.SetPos(nRewind);
+            nRewind++;         // start one byte further next time, in case of failure
+            blkdat.SetLimit(); // remove former limit
+            unsigned int nSize = 0;
+            try {
+                // locate a header
+                unsigned char buf[MESSAGE_START_SIZE];
+                blkdat.FindByte(Params().MessageStart()[0]);
+                nRewind = blkdat.GetPos() + 1;
+                blkdat >> FLATDATA(buf);
+                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+                    continue;
+                // read size
+                blkdat >> nSize;
+                if (nSize < 80 || nSize > MAX_BLOCK_SIZE_CURRENT)
+                    continue;
+            } catch (const std::exception&) {
+                // no valid block header found; don't complain
+                break;
+            }
+            try {
+                // read block
+                uint64_t nBlockPos = blkdat.GetPos();
+                blkdat.SetLimit(nBlockPos + nSize);
+                blkdat.SetPos(nBlockPos);
+                CImportedBlock imported;
+                blkdat >> imported.block;
+                nRewind = blkdat.GetPos();
+                imported.pos = CDiskBlockPos(nFile, nBlockPos);
+                imported.nSize = nSize;
+                vBatch.push_back(std::move(imported));
+                nBatchSize += nSize;
+            } catch (const std::exception& e) {
+                LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
+            }
+
+            if (vBatch.size() >= IMPORT_HASH_BATCH || nBatchSize >= MAX_IMPORT_QUEUE_SIZE / 4) {
+                if (!PushBatch(vBatch))
+                    break;
+                nBatchSize = 0;
+            }
+        }
+        if (!vBatch.empty())
+            PushBatch(vBatch);
+    } catch (const std::exception& e) {
+        LogPrintf("%s : %s\n", __func__, e.what());
+    }
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    fDone = true;
+    condConsumer.notify_all();
+}
+
+bool CBlockFileReader::Next(CImportedBlock& imported)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (queue.empty() && !fDone)
+        condConsumer.wait(lock);
+    if (queue.empty())
+        return false;
+    imported = std::move(queue.front());
+    queue.pop_front();
+    nQueuedSize -= imported.nSize;
+    condReader.notify_one();
+    return true;
+}
@@ -0,0 +1,99 @@
+// Copyright (c) 2019-2020 The BITWIN24 developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITWIN24_BLOCKIMPORT_H
+#define BITWIN24_BLOCKIMPORT_H
+
+#include "chain.h"
+#include "primitives/block.h"
+#include "streams.h"
+#include "uint256.h"
+
+#include <stdio.h>
+
+#include <deque>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+/** Maximum size of the blocks read ahead of the one being processed */
+static const unsigned int MAX_IMPORT_QUEUE_SIZE = 16 * MAX_BLOCK_SIZE_CURRENT;
+/** Number of blocks read before they are handed to the block hash threads */
+static const unsigned int IMPORT_HASH_BATCH = 64;
+
+/** A block read from a block file */
+struct CImportedBlock {
+    CBlock block;
+    uint256 hash;
+    //! position of the block data, its nFile taken from the file being read
+    CDiskBlockPos pos;
+    unsigned int nSize;
+
+    CImportedBlock() : nSize(0) {}
+};
+
+/** Computes the hash of an imported block */
+class CBlockHashCheck
+{
+private:
+    CImportedBlock* pimported;
+
+public:
+    CBlockHashCheck() : pimported(NULL) {}
+    CBlockHashCheck(CImportedBlock* pimportedIn) : pimported(pimportedIn) {}
+
+    bool operator()();
+
+    void swap(CBlockHashCheck& check)
+    {
+        std::swap(pimported, check.pimported);
+    }
+};
+
+/**
+ * Reads the blocks of a block file on its own thread, and hashes them on the
+ * block hash threads, while the caller processes the blocks read before.
+ *
+ * Blocks come out in the order they are stored in the file. Data that cannot
+ * be parsed as a block is skipped the same way LoadExternalBlockFile always did.
+ */
+class CBlockFileReader
+{
+private:
+    //! Used by the reader thread only
+    CBufferedFile blkdat;
+    int nFile;
+
+    boost::mutex mutex;
+    boost::condition_variable condReader;
+    boost::condition_variable condConsumer;
+    std::deque<CImportedBlock> queue;
+    //! total size of the blocks in queue
+    size_t nQueuedSize;
+    //! the reader thread is done with the file
+    bool fDone;
+    //! the consumer is gone
+    bool fStop;
+
+    boost::thread thread;
+
+    void ThreadRead();
+    void HashBatch(std::vector<CImportedBlock>& vBatch);
+    bool PushBatch(std::vector<CImportedBlock>& vBatch);
+
+public:
+    //! Takes over fileIn and calls fclose() on it when destroyed. nFile is stored in the positions of the blocks read.
+    CBlockFileReader(FILE* fileIn, int nFileIn);
+    ~CBlockFileReader();
+
+    //! Wait for the next block. Returns false once the whole file has been read.
+    bool Next(CImportedBlock& imported);
+};
+
+/** Run an instance of the block hash thread */
+void ThreadBlockHash();
+
+#endif // BITWIN24_BLOCKIMPORT_H
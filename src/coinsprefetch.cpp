@@ -0,0 +1,144 @@
+// Copyright (c) 2019-2020 The BITWIN24 developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinsprefetch.h"
+
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <atomic>
+
+#include <boost/unordered_set.hpp>
+
+static CCheckQueue<CCoinsPrefetchCheck> coinsprefetchqueue(16);
+
+/** Whether a CCoinsPrefetcher owns coinsprefetchqueue */
+static std::atomic<bool> fPrefetching(false);
+
+/** Guarded by cs_main */
+static CCoinsPrefetchStats prefetchStats;
+
+void ThreadCoinsPrefetch()
+{
+    RenameThread("bitwin24-prefetch");
+    coinsprefetchqueue.Thread();
+}
+
+bool CCoinsPrefetchCheck::operator()()
+{
+    try {
+        if (!pview->GetCoin(outpoint, *pcoin))
+            pcoin->Clear();
+    } catch (const std::exception&) {
+        // leave it to the validation thread to run into the error again and handle it
+        pcoin->Clear();
+    }
+    return true;
+}
+
+void GetBlockPrevouts(const CBlock& block, std::vector<COutPoint>& vOutpoints)
+{
+    boost::unordered_set<uint256, BlockHasher> setTxids;
+    for (const CTransaction& tx : block.vtx)
+        setTxids.insert(tx.GetHash());
+    for (const CTransaction& tx : block.vtx) {
+        if (tx.IsCoinBase() || tx.IsZerocoinSpend())
+            continue;
+        for (const CTxIn& txin : tx.vin) {
+            if (!setTxids.count(txin.prevout.hash))
+                vOutpoints.push_back(txin.prevout);
+        }
+    }
+}
+
+CCoinsPrefetcher::~CCoinsPrefetcher()
+{
+    if (pcontrol) {
+        pcontrol.reset();
+        fPrefetching = false;
+    }
+}
+
+void CCoinsPrefetcher::Start(const CBlock& block)
+{
+    if (pcontrol || fPrefetching.exchange(true))
+        return;
+
+    {
+        LOCK(cs_main);
+        if (pcoinsdbview && pcoinsTip && chainActive.Tip() && block.hashPrevBlock == chainActive.Tip()->GetBlockHash()) {
+            std::vector<COutPoint> vPrevouts;
+            GetBlockPrevouts(block, vPrevouts);
+            for (const COutPoint& outpoint : vPrevouts) {
+                if (!pcoinsTip->HaveCoinInCache(outpoint))
+                    vOutpoints.push_back(outpoint);
+            }
+            nWriteCount = pcoinsdbview->GetWriteCount();
+        }
+    }
+    if (vOutpoints.empty()) {
+        fPrefetching = false;
+        return;
+    }
+
+    // the checks point into vCoins, which therefore must not grow from here on
+    vCoins.resize(vOutpoints.size());
+    std::vector<CCoinsPrefetchCheck> vChecks;
+    vChecks.reserve(vOutpoints.size());
+    for (unsigned int i = 0; i < vOutpoints.size(); i++)
+        vChecks.push_back(CCoinsPrefetchCheck(pcoinsdbview, vOutpoints[i], &vCoins[i]));
+    pcontrol.reset(new CCheckQueueControl<CCoinsPrefetchCheck>(&coinsprefetchqueue));
+    pcontrol->Add(vChecks);
+}
+
+void CCoinsPrefetcher::Finish()
+{
+    AssertLockHeld(cs_main);
+    if (!pcontrol)
+        return;
+
+    int64_t nTimeStart = GetTimeMicros();
+    pcontrol->Wait();
+    pcontrol.reset();
+    fPrefetching = false;
+    prefetchStats.nWaitTime += GetTimeMicros() - nTimeStart;
+
+    prefetchStats.nBlocks++;
+    prefetchStats.nRequested += vOutpoints.size();
+    // A coin read before the database was written to may have been spent
+    // and pruned from pcoinsTip since, so it could not be told apart from
+    // an unspent coin anymore.
+    bool fStale = pcoinsdbview->GetWriteCount() != nWriteCount;
+    for (unsigned int i = 0; i < vOutpoints.size(); i++) {
+        if (vCoins[i].IsSpent())
+            continue;
+        prefetchStats.nLoaded++;
+        if (fStale)
+            prefetchStats.nDiscarded++;
+        else if (pcoinsTip->WarmCoin(vOutpoints[i], std::move(vCoins[i])))
+            prefetchStats.nWarmed++;
+    }
+    vOutpoints.clear();
+    vCoins.clear();
+}
+
+void RecordCoinsCacheHits(const CBlock& block)
+{
+    AssertLockHeld(cs_main);
+    std::vector<COutPoint> vPrevouts;
+    GetBlockPrevouts(block, vPrevouts);
+    prefetchStats.nInputs += vPrevouts.size();
+    for (const COutPoint& outpoint : vPrevouts) {
+        if (pcoinsTip->HaveCoinInCache(outpoint))
+            prefetchStats.nHits++;
+    }
+}
+
+CCoinsPrefetchStats GetCoinsPrefetchStats()
+{
+    AssertLockHeld(cs_main);
+    return prefetchStats;
+}
@@ -0,0 +1,97 @@
+// Copyright (c) 2019-2020 The BITWIN24 developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITWIN24_COINSPREFETCH_H
+#define BITWIN24_COINSPREFETCH_H
+
+#include "checkqueue.h"
+#include "coins.h"
+
+#include <vector>
+
+#include <boost/scoped_ptr.hpp>
+
+class CBlock;
+
+/** Reads the coin of one outpoint from the coin database */
+class CCoinsPrefetchCheck
+{
+private:
+    const CCoinsView* pview;
+    COutPoint outpoint;
+    Coin* pcoin;
+
+public:
+    CCoinsPrefetchCheck() : pview(NULL), pcoin(NULL) {}
+    CCoinsPrefetchCheck(const CCoinsView* pviewIn, const COutPoint& outpointIn, Coin* pcoinIn) : pview(pviewIn), outpoint(outpointIn), pcoin(pcoinIn) {}
+
+    bool operator()();
+
+    void swap(CCoinsPrefetchCheck& check)
+    {
+        std::swap(pview, check.pview);
+        std::swap(outpoint, check.outpoint);
+        std::swap(pcoin, check.pcoin);
+    }
+};
+
+/** Hit rates of the coin cache for connected blocks, and what prefetching added to it */
+struct CCoinsPrefetchStats {
+    //! blocks whose inputs were prefetched
+    uint64_t nBlocks;
+    //! outpoints looked up in the coin database, found there, and added to the coin cache
+    uint64_t nRequested;
+    uint64_t nLoaded;
+    uint64_t nWarmed;
+    //! loaded coins dropped as the coin database was written meanwhile
+    uint64_t nDiscarded;
+    //! inputs of connected blocks spending outputs of earlier blocks, and how many of them were cached
+    uint64_t nInputs;
+    uint64_t nHits;
+    //! time spent waiting for prefetches to complete, in microseconds
+    int64_t nWaitTime;
+
+    CCoinsPrefetchStats() : nBlocks(0), nRequested(0), nLoaded(0), nWarmed(0), nDiscarded(0), nInputs(0), nHits(0), nWaitTime(0) {}
+};
+
+/**
+ * Loads the coins a block spends from the coin database on the prefetch
+ * threads, while the block is checked and stored, and adds them to pcoinsTip
+ * before the block is connected.
+ *
+ * Only one block is prefetched at a time; Start() does nothing while another
+ * prefetch is running, or if the block does not build on the active tip.
+ */
+class CCoinsPrefetcher
+{
+private:
+    std::vector<COutPoint> vOutpoints;
+    std::vector<Coin> vCoins;
+    uint64_t nWriteCount;
+    boost::scoped_ptr<CCheckQueueControl<CCoinsPrefetchCheck> > pcontrol;
+
+public:
+    CCoinsPrefetcher() : nWriteCount(0) {}
+    ~CCoinsPrefetcher();
+
+    //! Queue the reads of the block's inputs which are not cached yet. Takes cs_main.
+    void Start(const CBlock& block);
+
+    //! Wait for the reads and add the coins found to pcoinsTip. Requires cs_main.
+    void Finish();
+};
+
+/** Append the outpoints the block spends which are not created by the block itself */
+void GetBlockPrevouts(const CBlock& block, std::vector<COutPoint>& vOutpoints);
+
+/** Count the inputs of a block about to be connected that pcoinsTip holds already. Requires cs_main. */
+void RecordCoinsCacheHits(const CBlock& block);
+
+/** Requires cs_main */
+CCoinsPrefetchStats GetCoinsPrefetchStats();
+
+/** Run an instance of the coin prefetch thread */
+void ThreadCoinsPrefetch();
+
+#endif // BITWIN24_COINSPREFETCH_H
@@ -7,7 +7,12 @@
 
 #include <boost/assign/list_of.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
 
+#include <atomic>
+
+#include "checkqueue.h"
+#include "crypto/common.h"
 #include "db.h"
 #include "kernel.h"
 #include "script/interpreter.h"
@@ -24,6 +29,7 @@ bool fTestNet = false; //Params().NetworkID() == CBaseChainParams::TESTNET;
 // Set to 3-hour for production network and 20-minute for test network
 unsigned int nModifierInterval;
 int nStakeTargetSpacing = 60;
+int nStakeThreads = DEFAULT_STAKE_THREADS;
 unsigned int getIntervalVersion(bool fTestNet)
 {
     if (fTestNet)
@@ -243,6 +249,26 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     return true;
 }
 
+namespace
+{
+/**
+ * Kernel stake modifiers by hashBlockFrom. The result only depends on the chain between
+ * the block from and the block the modifier is taken from, so an entry stays valid as
+ * long as that block is part of the active chain.
+ */
+struct CKernelStakeModifier
+{
+    const CBlockIndex* pindexModifier;
+    uint64_t nStakeModifier;
+    int nStakeModifierHeight;
+    int64_t nStakeModifierTime;
+};
+
+CCriticalSection cs_mapKernelStakeModifiers;
+std::map<uint256, CKernelStakeModifier> mapKernelStakeModifiers;
+const unsigned int MAX_KERNEL_STAKE_MODIFIERS = 50000;
+} // anon namespace
+
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
 bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
@@ -250,6 +276,18 @@ bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int
     nStakeModifier = 0;
     if (!mapBlockIndex.count(hashBlockFrom))
         return error("GetKernelStakeModifier() : block not indexed");
+
+    {
+        LOCK(cs_mapKernelStakeModifiers);
+        std::map<uint256, CKernelStakeModifier>::const_iterator it = mapKernelStakeModifiers.find(hashBlockFrom);
+        if (it != mapKernelStakeModifiers.end() && chainActive.Contains(it->second.pindexModifier)) {
+            nStakeModifier = it->second.nStakeModifier;
+            nStakeModifierHeight = it->second.nStakeModifierHeight;
+            nStakeModifierTime = it->second.nStakeModifierTime;
+            return true;
+        }
+    }
+
     const CBlockIndex* pindexFrom = mapBlockIndex[hashBlockFrom];
     nStakeModifierHeight = pindexFrom->nHeight;
     nStakeModifierTime = pindexFrom->GetBlockTime();
@@ -272,6 +310,15 @@ bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int
         }
     }
     nStakeModifier = pindex->nStakeModifier;
+
+    LOCK(cs_mapKernelStakeModifiers);
+    if (mapKernelStakeModifiers.size() >= MAX_KERNEL_STAKE_MODIFIERS)
+        mapKernelStakeModifiers.clear();
+    CKernelStakeModifier& entry = mapKernelStakeModifiers[hashBlockFrom];
+    entry.pindexModifier = pindex;
+    entry.nStakeModifier = nStakeModifier;
+    entry.nStakeModifierHeight = nStakeModifierHeight;
+    entry.nStakeModifierTime = nStakeModifierTime;
     return true;
 }
 
@@ -344,6 +391,181 @@ bool Stake(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockF
     return fSuccess;
 }
 
+namespace
+{
+/** A stake input with its kernel prefix resolved */
+struct CStakeKernelJob
+{
+    CStakeInput* stakeInput;
+    uint64_t nStakeModifier;
+    unsigned int nTimeBlockFrom;
+};
+
+/** First kernel hit of a search, shared by the search threads */
+struct CStakeKernelResult
+{
+    boost::mutex mutex;
+    std::atomic<bool> fFound;
+    CStakeInput* stakeInput;
+    unsigned int nTimeTx;
+    uint256 hashProofOfStake;
+
+    CStakeKernelResult() : fFound(false), stakeInput(NULL), nTimeTx(0) {}
+};
+
+// Hashes every nStride-th job starting at nStart until a kernel is found by any thread
+void SearchStakeKernels(const std::vector<CStakeKernelJob>& vJobs, size_t nStart, size_t nStride, const uint256& bnTargetPerCoinDay,
+                        unsigned int nTimeTx, CStakeKernelResult& result)
+{
+    const int nHashDrift = 30;
+    std::vector<unsigned char> vchKernel;
+    for (size_t n = nStart; n < vJobs.size(); n += nStride) {
+        //another thread found a kernel, move on
+        if (result.fFound)
+            return;
+
+        const CStakeKernelJob& job = vJobs[n];
+
+        // the kernel is (modifier, block time, input, tx time), only the tx time changes between tries
+        CDataStream ss(SER_GETHASH, 0);
+        ss << job.nStakeModifier << job.nTimeBlockFrom << job.stakeInput->GetUniqueness();
+        vchKernel.assign(ss.begin(), ss.end());
+        vchKernel.resize(vchKernel.size() + sizeof(uint32_t));
+        unsigned char* pchTryTime = &vchKernel[vchKernel.size() - sizeof(uint32_t)];
+
+        //get the stake weight - weight is equal to coin amount
+        uint256 bnTarget = uint256(job.stakeInput->GetValue()) / 100 * bnTargetPerCoinDay;
+
+        for (int i = 0; i < nHashDrift; i++) {
+            unsigned int nTryTime = nTimeTx + nHashDrift - i;
+            WriteLE32(pchTryTime, nTryTime);
+            uint256 hash = HashX11(vchKernel.begin(), vchKernel.end());
+            if (hash < bnTarget) {
+                boost::lock_guard<boost::mutex> lock(result.mutex);
+                if (!result.fFound) {
+                    result.stakeInput = job.stakeInput;
+                    result.nTimeTx = nTryTime;
+                    result.hashProofOfStake = hash;
+                    result.fFound = true;
+                }
+                return;
+            }
+        }
+    }
+}
+
+/** One thread's share of a kernel search, run on stakekernelqueue */
+class CStakeKernelCheck
+{
+private:
+    const std::vector<CStakeKernelJob>* pvJobs;
+    size_t nStart;
+    size_t nStride;
+    uint256 bnTargetPerCoinDay;
+    unsigned int nTimeTx;
+    CStakeKernelResult* presult;
+
+public:
+    CStakeKernelCheck() : pvJobs(NULL), nStart(0), nStride(1), nTimeTx(0), presult(NULL) {}
+    CStakeKernelCheck(const std::vector<CStakeKernelJob>* pvJobsIn, size_t nStartIn, size_t nStrideIn, const uint256& bnTargetPerCoinDayIn,
+                      unsigned int nTimeTxIn, CStakeKernelResult* presultIn) : pvJobs(pvJobsIn), nStart(nStartIn), nStride(nStrideIn),
+                                                                               bnTargetPerCoinDay(bnTargetPerCoinDayIn), nTimeTx(nTimeTxIn), presult(presultIn) {}
+
+    // a found kernel is reported through the result, the queue always succeeds
+    bool operator()()
+    {
+        SearchStakeKernels(*pvJobs, nStart, nStride, bnTargetPerCoinDay, nTimeTx, *presult);
+        return true;
+    }
+
+    void swap(CStakeKernelCheck& check)
+    {
+        std::swap(pvJobs, check.pvJobs);
+        std::swap(nStart, check.nStart);
+        std::swap(nStride, check.nStride);
+        std::swap(bnTargetPerCoinDay, check.bnTargetPerCoinDay);
+        std::swap(nTimeTx, check.nTimeTx);
+        std::swap(presult, check.presult);
+    }
+};
+
+// each check is a whole share of the inputs, so workers take one at a time
+CCheckQueue<CStakeKernelCheck> stakekernelqueue(1);
+// only one search may use the queue at a time
+CCriticalSection cs_stakekernelqueue;
+} // anon namespace
+
+void ThreadStakeKernel()
+{
+    RenameThread("bitwin24-stakekernel");
+    stakekernelqueue.Thread();
+}
+
+bool FindStakeKernel(const std::vector<CStakeInput*>& vInputs, unsigned int nBits, int nHeight, unsigned int& nTimeTx, uint256& hashProofOfStake, CStakeInput*& pstakeKernel)
+{
+    pstakeKernel = NULL;
+
+    //grab difficulty
+    uint256 bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+
+    // Inputs from the same block share their stake modifier. zBWI and BITWIN24
+    // stakes derive it differently, so they are kept apart.
+    std::map<std::pair<CBlockIndex*, bool>, std::vector<CStakeInput*> > mapInputsByBlock;
+    for (CStakeInput* stakeInput : vInputs) {
+        CBlockIndex* pindexFrom = stakeInput->GetIndexFrom();
+        if (!pindexFrom || pindexFrom->nHeight < 1) {
+            LogPrintf("*** no pindexfrom\n");
+            continue;
+        }
+        mapInputsByBlock[std::make_pair(pindexFrom, stakeInput->IsZBWI())].push_back(stakeInput);
+    }
+
+    std::vector<CStakeKernelJob> vJobs;
+    vJobs.reserve(vInputs.size());
+    for (const auto& group : mapInputsByBlock) {
+        unsigned int nTimeBlockFrom = group.first.first->GetBlockTime();
+        if (nTimeTx < nTimeBlockFrom || nTimeBlockFrom + nStakeMinAge > nTimeTx) // Min age requirement
+            continue;
+
+        //grab stake modifier
+        uint64_t nStakeModifier = 0;
+        if (!group.second.front()->GetModifier(nStakeModifier)) {
+            LogPrintf("%s : failed to get kernel stake modifier\n", __func__);
+            continue;
+        }
+
+        for (CStakeInput* stakeInput : group.second)
+            vJobs.push_back(CStakeKernelJob{stakeInput, nStakeModifier, nTimeBlockFrom});
+    }
+
+    // Split the inputs over -stakethreads shares, this thread joins the queue's workers in searching them
+    CStakeKernelResult result;
+    size_t nThreads = std::max(1, std::min<int>(nStakeThreads, (vJobs.size() + MIN_STAKE_INPUTS_PER_THREAD - 1) / MIN_STAKE_INPUTS_PER_THREAD));
+    if (nThreads == 1) {
+        SearchStakeKernels(vJobs, 0, 1, bnTargetPerCoinDay, nTimeTx, result);
+    } else {
+        std::vector<CStakeKernelCheck> vChecks;
+        vChecks.reserve(nThreads);
+        for (size_t i = 0; i < nThreads; i++)
+            vChecks.push_back(CStakeKernelCheck(&vJobs, i, nThreads, bnTargetPerCoinDay, nTimeTx, &result));
+        LOCK(cs_stakekernelqueue);
+        CCheckQueueControl<CStakeKernelCheck> control(&stakekernelqueue);
+        control.Add(vChecks);
+        control.Wait();
+    }
+
+    if (result.fFound) {
+        hashProofOfStake = result.hashProofOfStake;
+        nTimeTx = result.nTimeTx;
+        pstakeKernel = result.stakeInput;
+    }
+
+    mapHashedBlocks.clear();
+    mapHashedBlocks[nHeight] = GetTime(); //store a time stamp of when we last hashed on this block
+    return result.fFound;
+}
+
 // Check kernel hash target and coinstake signature
 bool CheckProofOfStake(const CBlock block, uint256& hashProofOfStake, std::unique_ptr<CStakeInput>& stake)
 {
@@ -17,6 +17,14 @@ static const unsigned int MODIFIER_INTERVAL_TESTNET = 60;
 extern unsigned int nModifierInterval;
 extern unsigned int getIntervalVersion(bool fTestNet);
 
+/** -stakethreads default (number of threads searching for a stake kernel) */
+static const int DEFAULT_STAKE_THREADS = 1;
+/** Maximum number of stake kernel search threads */
+static const int MAX_STAKE_THREADS = 16;
+/** Don't start another search thread for fewer inputs than this */
+static const int MIN_STAKE_INPUTS_PER_THREAD = 64;
+extern int nStakeThreads;
+
 // MODIFIER_INTERVAL_RATIO:
 // ratio of group interval length between the last group and the first group
 static const int MODIFIER_INTERVAL_RATIO = 3;
@@ -29,6 +37,13 @@ bool CheckStake(const CDataStream& ssUniqueID, CAmount nValueIn, const uint64_t
 bool stakeTargetHit(uint256 hashProofOfStake, int64_t nValueIn, uint256 bnTargetPerCoinDay);
 bool Stake(CStakeInput* stakeInput, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int& nTimeTx, uint256& hashProofOfStake);
 
+// Search all stake inputs for a kernel hash on top of the block at nHeight, looking up the stake modifier once per block
+// the inputs come from. The inputs are split over nStakeThreads threads, the first kernel found ends the search.
+// Sets nTimeTx, hashProofOfStake and pstakeKernel on success return
+bool FindStakeKernel(const std::vector<CStakeInput*>& vInputs, unsigned int nBits, int nHeight, unsigned int& nTimeTx, uint256& hashProofOfStake, CStakeInput*& pstakeKernel);
+// Worker thread of the kernel search, nStakeThreads - 1 of them are started
+void ThreadStakeKernel();
+
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
 bool CheckProofOfStake(const CBlock block, uint256& hashProofOfStake, std::unique_ptr<CStakeInput>& stake);
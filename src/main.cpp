@@ -13,10 +13,13 @@
 #include "accumulatormap.h"
 #include "addrman.h"
 #include "alert.h"
+#include "blockfilemapping.h"
+#include "blockimport.h"
 #include "blocksignature.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "coinsprefetch.h"
 #include "init.h"
 #include "kernel.h"
 #include "masternode-budget.h"
@@ -42,6 +45,7 @@
 #include "master_node_witness_manager.h"
 #include "primitives/masternode_witness.h"
 
+#include <limits>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
@@ -80,7 +84,7 @@ bool fTxIndex = true;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
 bool fVerifyingBlocks = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
 bool fAlerts = DEFAULT_ALERTS;
 
 unsigned int nStakeMinAge = 60 * 60;
@@ -103,6 +107,18 @@ map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
 map<uint256, int64_t> mapRejectedBlocks;
 map<uint256, int64_t> mapZerocoinspends; //txid, time received
 
+/** Fresh block whose compact witness references proofs we have not seen yet */
+struct CBlockAwaitingProofs {
+    CBlock block;
+    CCompactMasterNodeWitness compactWitness;
+    NodeId nodeId;
+    int64_t nTime;
+};
+/** Seconds to wait for the requested proofs before dropping the block */
+static const int64_t BLOCK_AWAITING_PROOFS_TIMEOUT = 60;
+static const unsigned int MAX_BLOCKS_AWAITING_PROOFS = 16;
+map<uint256, CBlockAwaitingProofs> mapBlocksAwaitingProofs;
+
 
 void EraseOrphansFor(NodeId peer);
 
@@ -157,6 +173,9 @@ CCriticalSection cs_LastBlockFile;
 std::vector<CBlockFileInfo> vinfoBlockFile;
 int nLastBlockFile = 0;
 
+/** Block files blocks and transactions are read from */
+CBlockFileMappings blockFileMappings(MAX_BLOCKFILE_MAPPINGS);
+
 /**
      * Every received block is assigned a unique and increasing identifier, so we
      * know which one to give priority in case of a fork.
@@ -512,6 +531,7 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals)
     nodeSignals.SendMessages.connect(&SendMessages);
     nodeSignals.InitializeNode.connect(&InitializeNode);
     nodeSignals.FinalizeNode.connect(&FinalizeNode);
+    nodeSignals.MessagesProcessed.connect(&ProcessConsensusVoteQueue);
 }
 
 void UnregisterNodeSignals(CNodeSignals& nodeSignals)
@@ -521,6 +541,7 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals)
     nodeSignals.SendMessages.disconnect(&SendMessages);
     nodeSignals.InitializeNode.disconnect(&InitializeNode);
     nodeSignals.FinalizeNode.disconnect(&FinalizeNode);
+    nodeSignals.MessagesProcessed.disconnect(&ProcessConsensusVoteQueue);
 }
 
 CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& locator)
@@ -538,6 +559,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache* pcoinsTip = NULL;
+CCoinsViewDB* pcoinsdbview = NULL;
 CBlockTreeDB* pblocktree = NULL;
 CZerocoinDB* zerocoinDB = NULL;
 CSporkDB* pSporkDB = NULL;
@@ -829,12 +851,11 @@ int GetInputAge(CTxIn& vin)
         CCoinsViewMemPool viewMempool(pcoinsTip, mempool);
         view.SetBackend(viewMempool); // temporarily switch cache backend to db+mempool view
 
-        const CCoins* coins = view.AccessCoins(vin.prevout.hash);
+        const Coin& coin = view.AccessCoin(vin.prevout);
 
-        if (coins) {
-            if (coins->nHeight < 0) return 0;
-            return (chainActive.Tip()->nHeight + 1) - coins->nHeight;
-        } else
+        if (!coin.IsSpent())
+            return (chainActive.Tip()->nHeight + 1) - (int)coin.nHeight;
+        else
             return -1;
     }
 }
@@ -905,11 +926,21 @@ bool ContextualCheckZerocoinMint(const CTransaction& tx, const PublicCoin& coin,
     return true;
 }
 
-bool ContextualCheckZerocoinSpend(const CTransaction& tx, const CoinSpend& spend, CBlockIndex* pindex, const uint256& hashBlock)
+bool CZerocoinSpendCheck::operator()()
+{
+    if (!pspend->HasValidSignature())
+        return ::error("CZerocoinSpendCheck(): V2 zBWI spend in tx %s does not have a valid signature", txid.GetHex());
+    return true;
+}
+
+bool ContextualCheckZerocoinSpend(const CTransaction& tx, const CoinSpend& spend, CBlockIndex* pindex, const uint256& hashBlock, std::vector<CZerocoinSpendCheck>* pvChecks)
 {
     //Check to see if the zBWI is properly signed
     if (pindex->nHeight >= Params().Zerocoin_Block_V2_Start()) {
-        if (!spend.HasValidSignature())
+        // Verify the signature later if requested, checks that need the chain stay here
+        if (pvChecks)
+            pvChecks->push_back(CZerocoinSpendCheck(spend, tx.GetHash()));
+        else if (!spend.HasValidSignature())
             return error("%s: V2 zBWI spend does not have a valid signature", __func__);
 
         libzerocoin::SpendType expectedType = libzerocoin::SpendType::SPEND;
@@ -1206,12 +1237,11 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
     // ----------- swiftTX transaction scanning -----------
 
     BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                return state.DoS(0,
-                    error("AcceptToMemoryPool : conflicts with existing transaction lock: %s", reason),
-                    REJECT_INVALID, "tx-lock-conflict");
-            }
+        LockedInputMap::const_iterator itLocked = mapLockedInputs.find(in.prevout);
+        if (itLocked != mapLockedInputs.end() && itLocked->second != tx.GetHash()) {
+            return state.DoS(0,
+                error("AcceptToMemoryPool : conflicts with existing transaction lock: %s", reason),
+                REJECT_INVALID, "tx-lock-conflict");
         }
     }
 
@@ -1256,15 +1286,16 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
             CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
             view.SetBackend(viewMemPool);
 
-            // do we already have it?
-            if (view.HaveCoins(hash))
-                return false;
-
             // do all inputs exist?
-            // Note that this does not check for the presence of actual outputs (see the next check for that),
-            // only helps filling in pfMissingInputs (to determine missing vs spent).
             for (const CTxIn& txin : tx.vin) {
-                if (!view.HaveCoins(txin.prevout.hash)) {
+                if (!view.HaveCoin(txin.prevout)) {
+                    // Are inputs missing because we already have the tx?
+                    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+                        // Optimistically just do efficient check of cache for outputs
+                        if (pcoinsTip->HaveCoinInCache(COutPoint(hash, i)))
+                            return false;
+                    }
+                    // Otherwise assume this might be an orphan tx for which we just haven't seen parents yet
                     if (pfMissingInputs)
                         *pfMissingInputs = true;
                     return false;
@@ -1446,12 +1477,11 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
     // ----------- swiftTX transaction scanning -----------
 
     BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                return state.DoS(0,
-                    error("AcceptableInputs : conflicts with existing transaction lock: %s", reason),
-                    REJECT_INVALID, "tx-lock-conflict");
-            }
+        LockedInputMap::const_iterator itLocked = mapLockedInputs.find(in.prevout);
+        if (itLocked != mapLockedInputs.end() && itLocked->second != tx.GetHash()) {
+            return state.DoS(0,
+                error("AcceptableInputs : conflicts with existing transaction lock: %s", reason),
+                REJECT_INVALID, "tx-lock-conflict");
         }
     }
 
@@ -1478,15 +1508,16 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
             CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
             view.SetBackend(viewMemPool);
 
-            // do we already have it?
-            if (view.HaveCoins(hash))
-                return false;
-
             // do all inputs exist?
-            // Note that this does not check for the presence of actual outputs (see the next check for that),
-            // only helps filling in pfMissingInputs (to determine missing vs spent).
             for (const CTxIn& txin : tx.vin) {
-                if (!view.HaveCoins(txin.prevout.hash)) {
+                if (!view.HaveCoin(txin.prevout)) {
+                    // Are inputs missing because we already have the tx?
+                    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+                        // Optimistically just do efficient check of cache for outputs
+                        if (pcoinsTip->HaveCoinInCache(COutPoint(hash, i)))
+                            return false;
+                    }
+                    // Otherwise assume this might be an orphan tx for which we just haven't seen parents yet
                     if (pfMissingInputs)
                         *pfMissingInputs = true;
                     return false;
@@ -1629,14 +1660,16 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
         if (fTxIndex) {
             CDiskTxPos postx;
             if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-                if (file.IsNull())
-                    return error("%s: OpenBlockFile failed", __func__);
                 CBlockHeader header;
                 try {
-                    file >> header;
-                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                    file >> txOut;
+                    if (!blockFileMappings.ReadTransaction(postx, postx.nTxOffset, header, txOut)) {
+                        CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+                        if (file.IsNull())
+                            return error("%s: OpenBlockFile failed", __func__);
+                        file >> header;
+                        fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
+                        file >> txOut;
+                    }
                 } catch (std::exception& e) {
                     return error("%s : Deserialize or I/O error - %s", __func__, e.what());
                 }
@@ -1653,10 +1686,9 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
         if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
             int nHeight = -1;
             {
-                CCoinsViewCache& view = *pcoinsTip;
-                const CCoins* coins = view.AccessCoins(hash);
-                if (coins)
-                    nHeight = coins->nHeight;
+                const Coin& coin = AccessByTxid(*pcoinsTip, hash);
+                if (!coin.IsSpent())
+                    nHeight = coin.nHeight;
             }
             if (nHeight > 0)
                 pindexSlow = chainActive[nHeight];
@@ -1710,14 +1742,15 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk : OpenBlockFile failed");
-
     // Read block
     try {
-        filein >> block;
+        if (!blockFileMappings.ReadBlock(pos, block)) {
+            // Open history file to read
+            CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("ReadBlockFromDisk : OpenBlockFile failed");
+            filein >> block;
+        }
     } catch (std::exception& e) {
         return error("%s : Deserialize or I/O error - %s", __func__, e.what());
     }
@@ -1786,7 +1819,23 @@ int64_t GetPhaseMultiplier(int nHeight)
     return currentPhaseMultiplier;
 }
 
-int64_t GetBlockValue(int nHeight, int nMasternodeCount)
+namespace
+{
+/**
+ * Memoized GetBlockValue / GetMasterNodeCountBasedOnBlockReward results.
+ * Values for heights inside the active chain (from START_HEIGHT_REWARD_BASED_ON_MN_COUNT on)
+ * only depend on the chain up to that height and are dropped when such a block is
+ * disconnected. All other values depend on the money supply of the tip and are only
+ * kept while the tip stays the same.
+ */
+CCriticalSection cs_blockRewardCache;
+uint256 hashBlockRewardCacheTip = 0;
+std::map<std::pair<int, int>, CAmount> mapTipBlockValue;           // (height, masternode count)
+std::map<int, CAmount> mapChainBlockValue;                         // height
+std::map<std::pair<int, CAmount>, int> mapChainMasterNodeCount;    // (height, reward)
+const unsigned int MAX_BLOCK_REWARD_CACHE_SIZE = 10000;
+
+int64_t ComputeBlockValue(int nHeight, int nMasternodeCount)
 {
     int64_t nSubsidy = 0;
     if (nHeight >= 0 && nHeight <= Params().LAST_POW_BLOCK()) {
@@ -1831,6 +1880,53 @@ int64_t GetBlockValue(int nHeight, int nMasternodeCount)
     return nSubsidy;
 }
 
+int ComputeMasterNodeCountBasedOnBlockReward(int nHeight, CAmount reward)
+{
+    int64_t currentPhaseMultiplier = GetPhaseMultiplier(nHeight);
+
+    const int64_t collateral = 3000 * COIN;
+
+    return round((double) reward * Params().BlocksPerYear() * 1000 * 80 / 100 / collateral / currentPhaseMultiplier);
+}
+} // anon namespace
+
+void InvalidateBlockRewardCache(int nHeight)
+{
+    LOCK(cs_blockRewardCache);
+    mapTipBlockValue.clear();
+    mapChainBlockValue.erase(mapChainBlockValue.lower_bound(nHeight), mapChainBlockValue.end());
+    mapChainMasterNodeCount.erase(mapChainMasterNodeCount.lower_bound(std::make_pair(nHeight, std::numeric_limits<CAmount>::min())), mapChainMasterNodeCount.end());
+}
+
+int64_t GetBlockValue(int nHeight, int nMasternodeCount)
+{
+    CBlockIndex* pindexTip = chainActive.Tip();
+    if (pindexTip == NULL)
+        return ComputeBlockValue(nHeight, nMasternodeCount);
+
+    LOCK(cs_blockRewardCache);
+    if (nHeight >= START_HEIGHT_REWARD_BASED_ON_MN_COUNT && nHeight <= pindexTip->nHeight) {
+        std::map<int, CAmount>::iterator it = mapChainBlockValue.find(nHeight);
+        if (it != mapChainBlockValue.end())
+            return it->second;
+        if (mapChainBlockValue.size() >= MAX_BLOCK_REWARD_CACHE_SIZE)
+            mapChainBlockValue.clear();
+        return mapChainBlockValue[nHeight] = ComputeBlockValue(nHeight, nMasternodeCount);
+    }
+
+    if (hashBlockRewardCacheTip != pindexTip->GetBlockHash()) {
+        mapTipBlockValue.clear();
+        hashBlockRewardCacheTip = pindexTip->GetBlockHash();
+    }
+    std::pair<int, int> key(nHeight, nMasternodeCount);
+    std::map<std::pair<int, int>, CAmount>::iterator it = mapTipBlockValue.find(key);
+    if (it != mapTipBlockValue.end())
+        return it->second;
+    if (mapTipBlockValue.size() >= MAX_BLOCK_REWARD_CACHE_SIZE)
+        mapTipBlockValue.clear();
+    return mapTipBlockValue[key] = ComputeBlockValue(nHeight, nMasternodeCount);
+}
+
 /**
  *  0 if without errors
  * -1 if reward not based on block height
@@ -1857,11 +1953,14 @@ int GetMasterNodeCountBasedOnBlockReward(int nHeight, CAmount reward, int& error
         return 0;
     }
 
-    int64_t currentPhaseMultiplier = GetPhaseMultiplier(nHeight);
-
-    const int64_t collateral = 3000 * COIN;
-
-    return round((double) reward * Params().BlocksPerYear() * 1000 * 80 / 100 / collateral / currentPhaseMultiplier);
+    LOCK(cs_blockRewardCache);
+    std::pair<int, CAmount> key(nHeight, reward);
+    std::map<std::pair<int, CAmount>, int>::iterator it = mapChainMasterNodeCount.find(key);
+    if (it != mapChainMasterNodeCount.end())
+        return it->second;
+    if (mapChainMasterNodeCount.size() >= MAX_BLOCK_REWARD_CACHE_SIZE)
+        mapChainMasterNodeCount.clear();
+    return mapChainMasterNodeCount[key] = ComputeMasterNodeCountBasedOnBlockReward(nHeight, reward);
 }
 
 int GetContextualMasterNodeCountBasedOnBlockReward(CAmount reward)
@@ -2026,14 +2125,14 @@ void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCach
     if (!tx.IsCoinBase() && !tx.IsZerocoinSpend()) {
         txundo.vprevout.reserve(tx.vin.size());
         BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-            txundo.vprevout.push_back(CTxInUndo());
-            bool ret = inputs.ModifyCoins(txin.prevout.hash)->Spend(txin.prevout, txundo.vprevout.back());
+            txundo.vprevout.push_back(Coin());
+            bool ret = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
             assert(ret);
         }
     }
 
     // add outputs
-    inputs.ModifyCoins(tx.GetHash())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight);
 }
 
 bool CScriptCheck::operator()()
@@ -2105,14 +2204,10 @@ CAmount GetInvalidUTXOValue()
 {
     CAmount nValue = 0;
     for (auto out : invalid_out::setInvalidOutPoints) {
-        bool fSpent = false;
         CCoinsViewCache cache(pcoinsTip);
-        const CCoins *coins = cache.AccessCoins(out.hash);
-        if(!coins || !coins->IsAvailable(out.n))
-            fSpent = true;
-
-        if (!fSpent)
-            nValue += coins->vout[out.n].nValue;
+        const Coin& coin = cache.AccessCoin(out);
+        if (coin.IsAvailable())
+            nValue += coin.out.nValue;
     }
 
     return nValue;
@@ -2137,20 +2232,20 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
         CAmount nFees = 0;
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             const COutPoint& prevout = tx.vin[i].prevout;
-            const CCoins* coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
             // If prev is coinbase, check that it's matured
-            if (coins->IsCoinBase() || coins->IsCoinStake()) {
-                if (nSpendHeight - coins->nHeight < Params().COINBASE_MATURITY())
+            if (coin.IsCoinBase() || coin.IsCoinStake()) {
+                if (nSpendHeight - (int)coin.nHeight < Params().COINBASE_MATURITY())
                     return state.Invalid(
-                        error("CheckInputs() : tried to spend coinbase at depth %d, coinstake=%d", nSpendHeight - coins->nHeight, coins->IsCoinStake()),
+                        error("CheckInputs() : tried to spend coinbase at depth %d, coinstake=%d", nSpendHeight - (int)coin.nHeight, coin.IsCoinStake()),
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase");
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, error("CheckInputs() : txin values out of range"),
                     REJECT_INVALID, "bad-txns-inputvalues-outofrange");
         }
@@ -2181,11 +2276,11 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
         if (fScriptChecks) {
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint& prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore);
+                CScriptCheck check(coin.out.scriptPubKey, tx, i, flags, cacheStore);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -2197,7 +2292,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check(*coins, tx, i,
+                        CScriptCheck check(coin.out.scriptPubKey, tx, i,
                             flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
                         if (check())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
@@ -2218,6 +2313,30 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
     return true;
 }
 
+/**
+ * Restore the output spent by an input from its undo data. Undo data written
+ * before the per-output coin database only holds the height and coinbase
+ * flags of the last spent output of a transaction; the others take them from
+ * an output of the same transaction that is still unspent.
+ */
+static bool ApplyTxInUndo(Coin& undo, CCoinsViewCache& view, const COutPoint& out, bool& fClean)
+{
+    bool fOverwrite = view.HaveCoin(out);
+    if (fOverwrite)
+        fClean = fClean && error("DisconnectBlock() : undo data overwriting existing output");
+
+    if (undo.nHeight == 0) {
+        const Coin& alternate = AccessByTxid(view, out.hash);
+        if (alternate.IsSpent())
+            return false;
+        undo.nHeight = alternate.nHeight;
+        undo.fCoinBase = alternate.fCoinBase;
+        undo.fCoinStake = alternate.fCoinStake;
+    }
+    view.AddCoin(out, std::move(undo), fOverwrite);
+    return true;
+}
+
 bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
 {
     if (pindex->GetBlockHash() != view.GetBestBlock())
@@ -2287,53 +2406,25 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
         uint256 hash = tx.GetHash();
 
         // Check that all outputs are available and match the outputs in the block itself
-        // exactly. Note that transactions with only provably unspendable outputs won't
-        // have outputs available even in the block itself, so we handle that case
-        // specially with outsEmpty.
-        {
-            CCoins outsEmpty;
-            CCoinsModifier outs = view.ModifyCoins(hash);
-            outs->ClearUnspendable();
-
-            CCoins outsBlock(tx, pindex->nHeight);
-            // The CCoins serialization does not serialize negative numbers.
-            // No network rules currently depend on the version here, so an inconsistency is harmless
-            // but it must be corrected before txout nversion ever influences a network rule.
-            if (outsBlock.nVersion < 0)
-                outs->nVersion = outsBlock.nVersion;
-            if (*outs != outsBlock)
+        // exactly, then remove them.
+        for (unsigned int o = 0; o < tx.vout.size(); o++) {
+            if (tx.vout[o].scriptPubKey.IsUnspendable())
+                continue;
+            Coin coin;
+            bool fSpent = view.SpendCoin(COutPoint(hash, o), &coin);
+            if (!fSpent || tx.vout[o] != coin.out || (unsigned int)pindex->nHeight != coin.nHeight ||
+                tx.IsCoinBase() != coin.fCoinBase || tx.IsCoinStake() != coin.fCoinStake)
                 fClean = fClean && error("DisconnectBlock() : added transaction mismatch? database corrupted");
-
-            // remove outputs
-            outs->Clear();
         }
 
         // restore inputs
         if (!tx.IsCoinBase() && !tx.IsZerocoinSpend()) { // not coinbases or zerocoinspend because they dont have traditional inputs
-            const CTxUndo& txundo = blockUndo.vtxundo[i - 1];
+            CTxUndo& txundo = blockUndo.vtxundo[i - 1];
             if (txundo.vprevout.size() != tx.vin.size())
                 return error("DisconnectBlock() : transaction and undo data inconsistent - txundo.vprevout.siz=%d tx.vin.siz=%d", txundo.vprevout.size(), tx.vin.size());
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
-                const COutPoint& out = tx.vin[j].prevout;
-                const CTxInUndo& undo = txundo.vprevout[j];
-                CCoinsModifier coins = view.ModifyCoins(out.hash);
-                if (undo.nHeight != 0) {
-                    // undo data contains height: this is the last output of the prevout tx being spent
-                    if (!coins->IsPruned())
-                        fClean = fClean && error("DisconnectBlock() : undo data overwriting existing transaction");
-                    coins->Clear();
-                    coins->fCoinBase = undo.fCoinBase;
-                    coins->nHeight = undo.nHeight;
-                    coins->nVersion = undo.nVersion;
-                } else {
-                    if (coins->IsPruned())
-                        fClean = fClean && error("DisconnectBlock() : undo data adding output to missing transaction");
-                }
-                if (coins->IsAvailable(out.n))
-                    fClean = fClean && error("DisconnectBlock() : undo data overwriting existing output");
-                if (coins->vout.size() < out.n + 1)
-                    coins->vout.resize(out.n + 1);
-                coins->vout[out.n] = undo.txout;
+                if (!ApplyTxInUndo(txundo.vprevout[j], view, tx.vin[j].prevout, fClean))
+                    return error("DisconnectBlock() : undo data adding output to missing transaction");
             }
         }
     }
@@ -2366,8 +2457,10 @@ void static FlushBlockFile(bool fFinalize = false)
 
     FILE* fileOld = OpenBlockFile(posOld);
     if (fileOld) {
-        if (fFinalize)
+        if (fFinalize) {
+            blockFileMappings.Invalidate(nLastBlockFile);
             TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nSize);
+        }
         FileCommit(fileOld);
         fclose(fileOld);
     }
@@ -2391,6 +2484,22 @@ void ThreadScriptCheck()
     scriptcheckqueue.Thread();
 }
 
+static CCheckQueue<CZerocoinSpendCheck> zerocoinspendcheckqueue(1);
+
+void ThreadZerocoinSpendCheck()
+{
+    RenameThread("bitwin24-zspendch");
+    zerocoinspendcheckqueue.Thread();
+}
+
+static CCheckQueue<CMasterNodeProofCheck> proofcheckqueue(16);
+
+void ThreadMasterNodeProofCheck()
+{
+    RenameThread("bitwin24-proofch");
+    proofcheckqueue.Thread();
+}
+
 void RecalculateZBWIMinted()
 {
     CBlockIndex *pindex = chainActive[Params().Zerocoin_StartHeight()];
@@ -2521,6 +2630,9 @@ bool RecalculateBWISupply(int nHeightStart)
         else
             break;
     }
+
+    // block values are derived from the money supply which was just rewritten
+    InvalidateBlockRewardCache(nHeightStart);
     return true;
 }
 
@@ -2689,14 +2801,16 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                              (pindex->nHeight == 91880 && pindex->GetBlockHash() == uint256("0x00000000000743f190a18c5577a3c2d2a1f610ae9601ac046a38084ccb7cd721")));
     if (fEnforceBIP30) {
         BOOST_FOREACH (const CTransaction& tx, block.vtx) {
-            const CCoins* coins = view.AccessCoins(tx.GetHash());
-            if (coins && !coins->IsPruned())
-                return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"),
-                    REJECT_INVALID, "bad-txns-BIP30");
+            for (unsigned int o = 0; o < tx.vout.size(); o++) {
+                if (view.HaveCoin(COutPoint(tx.GetHash(), o)))
+                    return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"),
+                        REJECT_INVALID, "bad-txns-BIP30");
+            }
         }
     }
 
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    CCheckQueueControl<CZerocoinSpendCheck> zerocoinControl(nScriptCheckThreads ? &zerocoinspendcheckqueue : NULL);
 
     int64_t nTimeStart = GetTimeMicros();
     CAmount nFees = 0;
@@ -2749,8 +2863,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
                 //queue for db write after the 'justcheck' section has concluded
                 vSpends.emplace_back(make_pair(spend, tx.GetHash()));
-                if (!ContextualCheckZerocoinSpend(tx, spend, pindex, hashBlock))
+                std::vector<CZerocoinSpendCheck> vZerocoinChecks;
+                if (!ContextualCheckZerocoinSpend(tx, spend, pindex, hashBlock, nScriptCheckThreads ? &vZerocoinChecks : NULL))
                     return state.DoS(100, error("%s: failed to add block %s with invalid zerocoinspend", __func__, tx.GetHash().GetHex()), REJECT_INVALID);
+                zerocoinControl.Add(vZerocoinChecks);
             }
 
             // Check that zBWI mints are not already known
@@ -2883,7 +2999,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                     "proof-not-found");
             }
 
-            const CMasterNodeWitness &witness = pMNWitness->Get(block.GetHash());
+            CMasterNodeWitness witness = pMNWitness->Get(block.GetHash());
             bool signOfProofValid = false;
             if (block.IsProofOfStake()) {
                 CPubKey pubkey;
@@ -2908,10 +3024,17 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                 }
                 signOfProofValid = (pubkey == witness.pubKeyWitness);
             }
-            if (witness.nProofs.size() != masterNodeCount
-                || !witness.IsValid(block.nTime)
-                || !witness.SignatureValid()
-                || !signOfProofValid) {
+            std::vector<CMasterNodeProofCheck> vProofChecks;
+            bool fProofValid = witness.nProofs.size() == masterNodeCount
+                && witness.IsValid(block.nTime, nScriptCheckThreads ? &vProofChecks : NULL)
+                && witness.SignatureValid()
+                && signOfProofValid;
+            if (fProofValid && !vProofChecks.empty()) {
+                CCheckQueueControl<CMasterNodeProofCheck> proofControl(&proofcheckqueue);
+                proofControl.Add(vProofChecks);
+                fProofValid = proofControl.Wait();
+            }
+            if (!fProofValid) {
                 return state.DoS(
                     100,
                     error("ConnectBlock() : not valid proof or unexpected number of master nodes in proof: %s",
@@ -2938,6 +3061,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     if (!control.Wait())
         return state.DoS(100, false);
+    if (!zerocoinControl.Wait())
+        return state.DoS(100, error("%s: failed to add block %s with invalid zerocoinspend", __func__, block.GetHash().GetHex()), REJECT_INVALID);
     int64_t nTime2 = GetTimeMicros();
     nTimeVerify += nTime2 - nTimeStart;
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime2 - nTimeStart), nInputs <= 1 ? 0 : 0.001 * (nTime2 - nTimeStart) / (nInputs - 1), nTimeVerify * 0.000001);
@@ -3048,15 +3173,16 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
     LOCK(cs_main);
     static int64_t nLastWrite = 0;
     try {
+        bool fCacheLarge = pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage;
         if ((mode == FLUSH_STATE_ALWAYS) ||
-            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
+            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && fCacheLarge) ||
             (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
-            // Typical CCoins structures on disk are around 100 bytes in size.
+            // Typical Coin structures on disk are around 50 bytes in size.
             // Pushing a new one to the database can cause it to be written
             // twice (once in the log, and once in the tables). This is already
             // an overestimation, as most will delete an existing entry or
             // overwrite one. Still, use a conservative safety factor of 2.
-            if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
+            if (!CheckDiskSpace(50 * 2 * 2 * pcoinsTip->GetCacheSize()))
                 return state.Error("out of disk space");
             // First make sure all block and undo data is flushed to disk.
             FlushBlockFile();
@@ -3079,9 +3205,13 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
                 setDirtyBlockIndex.erase(it++);
             }
             pblocktree->Sync();
-            // Finally flush the chainstate (which may refer to block index entries).
-            if (!pcoinsTip->Flush())
+            // Finally write the modified coins (which may refer to block index entries).
+            // Unmodified ones stay cached, as blocks keep spending recently used
+            // outputs; the cache only sheds entries once it outgrew its limit.
+            if (!pcoinsTip->Sync())
                 return state.Abort("Failed to write to coin database");
+            if (fCacheLarge)
+                pcoinsTip->Trim(nCoinCacheUsage / 100 * COINS_CACHE_KEEP_PERCENT);
             // Update best block in wallet (so we can detect restored wallets).
             if (mode != FLUSH_STATE_IF_NEEDED) {
                 GetMainSignals().SetBestChain(chainActive.GetLocator());
@@ -3113,10 +3243,10 @@ void static UpdateTip(CBlockIndex* pindexNew)
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
 
-    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%u\n",
+    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utxo)\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble()) / log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-        Checkpoints::GuessVerificationProgress(chainActive.Tip()), (unsigned int)pcoinsTip->GetCacheSize());
+        Checkpoints::GuessVerificationProgress(chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1 << 20)), (unsigned int)pcoinsTip->GetCacheSize());
 
     cvBlockChange.notify_all();
 
@@ -3175,6 +3305,7 @@ bool static DisconnectTip(CValidationState& state)
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
     UpdateTip(pindexDelete->pprev);
+    InvalidateBlockRewardCache(pindexDelete->nHeight);
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
     BOOST_FOREACH (const CTransaction& tx, block.vtx) {
@@ -3210,6 +3341,7 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
             return state.Abort("Failed to read block");
         pblock = &block;
     }
+    RecordCoinsCacheHits(*pblock);
     // Apply the block atomically to the chain state.
     int64_t nTime2 = GetTimeMicros();
     nTimeReadFromDisk += nTime2 - nTime1;
@@ -3919,13 +4051,12 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
             if (!tx.IsCoinBase()) {
                 //only reject blocks when it's based on complete consensus
                 BOOST_FOREACH (const CTxIn& in, tx.vin) {
-                    if (mapLockedInputs.count(in.prevout)) {
-                        if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                            mapRejectedBlocks.insert(make_pair(block.GetHash(), GetTime()));
-                            LogPrintf("CheckBlock() : found conflicting transaction with transaction lock %s %s\n", mapLockedInputs[in.prevout].ToString(), tx.GetHash().ToString());
-                            return state.DoS(0, error("CheckBlock() : found conflicting transaction with transaction lock"),
-                                REJECT_INVALID, "conflicting-tx-ix");
-                        }
+                    LockedInputMap::const_iterator itLocked = mapLockedInputs.find(in.prevout);
+                    if (itLocked != mapLockedInputs.end() && itLocked->second != tx.GetHash()) {
+                        mapRejectedBlocks.insert(make_pair(block.GetHash(), GetTime()));
+                        LogPrintf("CheckBlock() : found conflicting transaction with transaction lock %s %s\n", itLocked->second.ToString(), tx.GetHash().ToString());
+                        return state.DoS(0, error("CheckBlock() : found conflicting transaction with transaction lock"),
+                            REJECT_INVALID, "conflicting-tx-ix");
                     }
                 }
             }
@@ -4347,6 +4478,10 @@ void CBlockIndex::BuildSkip()
 
 bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp)
 {
+    // Read the coins the block spends while it is checked and stored
+    CCoinsPrefetcher prefetcher;
+    prefetcher.Start(*pblock);
+
     // Preliminary checks
     int64_t nStartTime = GetTimeMillis();
     bool checked = CheckBlock(*pblock, state);
@@ -4397,6 +4532,7 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
         CheckBlockIndex ();
         if (!ret)
             return error ("%s : AcceptBlock FAILED", __func__);
+        prefetcher.Finish();
     }
 
     if (!ActivateBestChain(state, pblock, checked))
@@ -4692,7 +4828,7 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             bool fClean = true;
             if (!DisconnectBlock(block, state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -4731,10 +4867,12 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
 
 void UnloadBlockIndex()
 {
+    InvalidateBlockRewardCache(0);
     mapBlockIndex.clear();
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
     pindexBestInvalid = NULL;
+    blockFileMappings.Clear();
 }
 
 bool LoadBlockIndex(string& strError)
@@ -4794,45 +4932,20 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
 
     int nLoaded = 0;
     try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SIZE_CURRENT, MAX_BLOCK_SIZE_CURRENT + 8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
+        // Blocks are read and hashed on other threads while the ones read before are processed here.
+        // This takes over fileIn and calls fclose() on it in the CBlockFileReader destructor
+        CBlockFileReader reader(fileIn, dbp ? dbp->nFile : 0);
+        CImportedBlock imported;
+        while (reader.Next(imported)) {
             boost::this_thread::interruption_point();
 
-            blkdat.SetPos(nRewind);
-            nRewind++;         // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
             try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(Params().MessageStart()[0]);
-                nRewind = blkdat.GetPos() + 1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE_CURRENT)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
-                break;
-            }
-            try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
+                CBlock& block = imported.block;
                 if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
+                    *dbp = imported.pos;
 
                 // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
+                uint256 hash = imported.hash;
                 if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
                     LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
                         block.hashPrevBlock.ToString());
@@ -4875,7 +4988,7 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
                     }
                 }
             } catch (std::exception& e) {
-                LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
+                LogPrintf("%s : I/O error - %s", __func__, e.what());
             }
         }
     } catch (std::runtime_error& e) {
@@ -5093,8 +5206,10 @@ bool static AlreadyHave(const CInv& inv)
     case MSG_TX: {
         bool txInMap = false;
         txInMap = mempool.exists(inv.hash);
+        // Best effort: only try output 0 and 1
         return txInMap || mapOrphanTransactions.count(inv.hash) ||
-               pcoinsTip->HaveCoins(inv.hash);
+               pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) ||
+               pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
     }
     case MSG_DSTX:
         return mapObfuscationBroadcastTxes.count(inv.hash);
@@ -5194,7 +5309,10 @@ void static ProcessGetData(CNode* pfrom)
                         assert(!"cannot load block from disk");
                     if (inv.type == MSG_BLOCK) {
                         if (pMNWitness->Exist(block.GetHash())) {
-                            pfrom->PushMessage("block", block, pMNWitness->Get(block.GetHash()));
+                            if (pfrom->nVersion >= COMPACT_WITNESS_VERSION)
+                                pfrom->PushMessage("block", block, pMNWitness->GetCompactWitness(block.GetHash(), pfrom));
+                            else
+                                pfrom->PushMessage("block", block, pMNWitness->Get(block.GetHash()));
                         }
                         else {
                             pfrom->PushMessage("block", block);
@@ -5331,20 +5449,22 @@ void static ProcessGetData(CNode* pfrom)
                 }
 
                 if (!pushed && inv.type == MSG_MASTERNODE_ANNOUNCE) {
-                    if (mnodeman.mapSeenMasternodeBroadcast.count(inv.hash)) {
+                    CSeenMasternodeMap<CMasternodeBroadcast>::const_iterator mi = mnodeman.mapSeenMasternodeBroadcast.find(inv.hash);
+                    if (mi != mnodeman.mapSeenMasternodeBroadcast.end()) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
-                        ss << mnodeman.mapSeenMasternodeBroadcast[inv.hash];
+                        ss << mi->second;
                         pfrom->PushMessage("mnb", ss);
                         pushed = true;
                     }
                 }
 
                 if (!pushed && inv.type == MSG_MASTERNODE_PING) {
-                    if (mnodeman.mapSeenMasternodePing.count(inv.hash)) {
+                    CSeenMasternodeMap<CMasternodePing>::const_iterator mi = mnodeman.mapSeenMasternodePing.find(inv.hash);
+                    if (mi != mnodeman.mapSeenMasternodePing.end()) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
-                        ss << mnodeman.mapSeenMasternodePing[inv.hash];
+                        ss << mi->second;
                         pfrom->PushMessage("mnp", ss);
                         pushed = true;
                     }
@@ -5390,6 +5510,81 @@ void static ProcessGetData(CNode* pfrom)
 }
 
 bool fRequestedSporksIDB = false;
+/** Store the witness of a fresh block received from the network */
+static bool AcceptReceivedWitness(const CMasterNodeWitness& witness)
+{
+    if (witness.nVersion != 0 || pMNWitness->Exist(witness.nTargetBlockHash))
+        return false;
+    if (!witness.SignatureValid())
+        return false;
+    return pMNWitness->Add(witness);
+}
+
+/**
+ * Rebuild the compact witness received with block. When proofs we have not seen
+ * are referenced, park the block and ask pfrom for them in full.
+ */
+static bool FillReceivedWitness(CNode* pfrom, const CBlock& block, const CCompactMasterNodeWitness& compactWitness, CMasterNodeWitness& witness)
+{
+    std::vector<uint32_t> vMissing;
+    if (pMNWitness->FillCompactWitness(compactWitness, witness, vMissing)) {
+        if (witness.SignatureValid())
+            return true;
+
+        // our copies differ from the ones which were signed, ask for every referenced proof
+        for (unsigned int i = 0; i < compactWitness.vProofs.size(); i++) {
+            if (!compactWitness.vProofs[i].fFull)
+                vMissing.push_back(i);
+        }
+        if (vMissing.empty())
+            return true;
+    }
+
+    LOCK(cs_main);
+    std::map<uint256, CBlockAwaitingProofs>::iterator it = mapBlocksAwaitingProofs.begin();
+    while (it != mapBlocksAwaitingProofs.end()) {
+        if (it->second.nTime < GetTime() - BLOCK_AWAITING_PROOFS_TIMEOUT)
+            mapBlocksAwaitingProofs.erase(it++);
+        else
+            ++it;
+    }
+    if (mapBlocksAwaitingProofs.size() >= MAX_BLOCKS_AWAITING_PROOFS && !mapBlocksAwaitingProofs.count(block.GetHash())) {
+        LogPrint("net", "%s : too many blocks awaiting proofs, dropping %s\n", __func__, block.GetHash().ToString());
+        return false;
+    }
+
+    CBlockAwaitingProofs& pending = mapBlocksAwaitingProofs[block.GetHash()];
+    pending.block = block;
+    pending.compactWitness = compactWitness;
+    pending.nodeId = pfrom->GetId();
+    pending.nTime = GetTime();
+
+    LogPrint("net", "%s : requesting %u proofs of block %s from peer=%d\n", __func__, vMissing.size(), block.GetHash().ToString(), pfrom->id);
+    pfrom->PushMessage("getmnwproofs", block.GetHash(), vMissing);
+    return false;
+}
+
+/** Validate a block received from pfrom and punish the peer if it is invalid */
+static void ProcessReceivedBlock(CNode* pfrom, CBlock& block, const std::string& strCommand)
+{
+    CValidationState state;
+    ProcessNewBlock(state, pfrom, &block);
+    int nDoS;
+    if (!state.IsInvalid(nDoS)) {
+        pMNWitness->AddBroadCastToMNManager(block.GetHash());
+    }
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
+        if (nDoS > 0) {
+            TRY_LOCK(cs_main, lockMain);
+            if (lockMain) Misbehaving(pfrom->GetId(), nDoS);
+        }
+    }
+    //disconnect this node if its old protocol version
+    pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     RandAddSeedPerfmon();
@@ -5977,23 +6172,24 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         } else {
             CInv inv(MSG_BLOCK, hashBlock);
             pfrom->AddInventoryKnown(inv);
-            CValidationState state;
             if (!mapBlockIndex.count(block.GetHash())) {
                 if (chainActive.Tip()->nHeight > START_HEIGHT_REWARD_BASED_ON_MN_COUNT
                     && (block.nTime + MASTERNODE_REMOVAL_SECONDS) >= GetAdjustedTime()) {
                     try {
                         CMasterNodeWitness witness;
-                        vRecv >> witness;
-                        if (witness.nVersion == 0 && !pMNWitness->Exist(witness.nTargetBlockHash)) {
-                            if (witness.SignatureValid()) {
-                                pMNWitness->Add(witness);
-                            }
-                            else {
-                                throw "received not valid proof";
+                        if (pfrom->nVersion >= COMPACT_WITNESS_VERSION) {
+                            CCompactMasterNodeWitness compactWitness;
+                            vRecv >> compactWitness;
+                            if (!FillReceivedWitness(pfrom, block, compactWitness, witness)) {
+                                // block is processed when the missing proofs arrive
+                                return true;
                             }
                         }
                         else {
-                            throw "can't get witness with block";
+                            vRecv >> witness;
+                        }
+                        if (!AcceptReceivedWitness(witness)) {
+                            throw "received not valid proof";
                         }
                     }
                     catch (...) {
@@ -6002,27 +6198,78 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                         return false;
                     }
                 }
-                ProcessNewBlock(state, pfrom, &block);
-                int nDoS;
-                if (!state.IsInvalid(nDoS)) {
-                    pMNWitness->AddBroadCastToMNManager(block.GetHash());
-                }
-                if (state.IsInvalid(nDoS)) {
-                    pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                                       state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-                    if (nDoS > 0) {
-                        TRY_LOCK(cs_main, lockMain);
-                        if (lockMain) Misbehaving(pfrom->GetId(), nDoS);
-                    }
-                }
-                //disconnect this node if its old protocol version
-                pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
+                ProcessReceivedBlock(pfrom, block, strCommand);
             } else {
                 LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
             }
         }
     }
 
+    else if (strCommand == "getmnwproofs") {
+        uint256 hashBlock;
+        std::vector<uint32_t> vIndexes;
+        vRecv >> hashBlock >> vIndexes;
+
+        if (!pMNWitness->Exist(hashBlock))
+            return true;
+
+        CMasterNodeWitness witness = pMNWitness->Get(hashBlock);
+        if (vIndexes.size() > witness.nProofs.size()) {
+            Misbehaving(pfrom->GetId(), 20);
+            return error("getmnwproofs size() = %u", vIndexes.size());
+        }
+
+        std::vector<std::pair<uint32_t, ActiveMasterNodeProofs> > vProofs;
+        vProofs.reserve(vIndexes.size());
+        BOOST_FOREACH (uint32_t nIndex, vIndexes) {
+            if (nIndex >= witness.nProofs.size()) {
+                Misbehaving(pfrom->GetId(), 20);
+                return error("getmnwproofs index %u out of range", nIndex);
+            }
+            vProofs.push_back(std::make_pair(nIndex, witness.nProofs[nIndex]));
+        }
+        pfrom->PushMessage("mnwproofs", hashBlock, vProofs);
+    }
+
+
+    else if (strCommand == "mnwproofs" && !fImporting && !fReindex) {
+        uint256 hashBlock;
+        std::vector<std::pair<uint32_t, ActiveMasterNodeProofs> > vProofs;
+        vRecv >> hashBlock >> vProofs;
+
+        CBlockAwaitingProofs pending;
+        {
+            LOCK(cs_main);
+            std::map<uint256, CBlockAwaitingProofs>::iterator it = mapBlocksAwaitingProofs.find(hashBlock);
+            if (it == mapBlocksAwaitingProofs.end() || it->second.nodeId != pfrom->GetId())
+                return true;
+            pending = it->second;
+            mapBlocksAwaitingProofs.erase(it);
+        }
+
+        for (unsigned int i = 0; i < vProofs.size(); i++) {
+            if (vProofs[i].first >= pending.compactWitness.vProofs.size()) {
+                Misbehaving(pfrom->GetId(), 20);
+                return error("mnwproofs index %u out of range", vProofs[i].first);
+            }
+            CCompactMasterNodeProof& entry = pending.compactWitness.vProofs[vProofs[i].first];
+            entry.fFull = true;
+            entry.proof = vProofs[i].second;
+        }
+
+        CMasterNodeWitness witness;
+        std::vector<uint32_t> vMissing;
+        if (!pMNWitness->FillCompactWitness(pending.compactWitness, witness, vMissing) || !AcceptReceivedWitness(witness)) {
+            LogPrintf("received a fresh block without valid witness from a node with new protocol\n");
+            Misbehaving(pfrom->GetId(), 5);
+            return false;
+        }
+
+        if (!mapBlockIndex.count(hashBlock))
+            ProcessReceivedBlock(pfrom, pending.block, "block");
+    }
+
+
     // This asymmetric behavior for inbound and outbound connections was introduced
     // to prevent a fingerprinting attack: an attacker can send specific fake addresses
     // to users' AddrMan and later request them by sending getaddr messages.
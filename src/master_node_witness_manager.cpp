@@ -14,6 +14,9 @@
 #include "chainparams.h"
 #include "obfuscation.h"
 #include "main.h"
+#include "validationinterface.h"
+
+#include <limits>
 
 
 class Witness_StateCatcher : public CValidationInterface
@@ -37,40 +40,63 @@ protected:
 
 MasterNodeWitnessManager::MasterNodeWitnessManager()
     : CLevelDBWrapper(GetDataDir() / "mnwitness", 0, false, false), _lastUpdate(0),
-      _stopThread(false)
+      _stopThread(false), _fRebuild(true)
 {
+    RegisterValidationInterface(this);
 }
 
 MasterNodeWitnessManager::~MasterNodeWitnessManager()
 {
+    UnregisterValidationInterface(this);
     _stopThread = true;
 }
 
 bool MasterNodeWitnessManager::Exist(const uint256 &targetBlockHash) const
 {
-    return _witnesses.find(targetBlockHash) != _witnesses.end();
+    boost::lock_guard<boost::mutex> guard(_mtx);
+    return _index.count(targetBlockHash) != 0;
 }
 
 bool MasterNodeWitnessManager::Add(const CMasterNodeWitness &proof, bool validate)
 {
+    if (Exist(proof.nTargetBlockHash))
+        return false;
+    if (validate && !proof.IsValid(GetAdjustedTime()))
+        return false;
+
     boost::lock_guard<boost::mutex> guard(_mtx);
-    if (!Exist(proof.nTargetBlockHash)) {
-        if (!validate || proof.IsValid(GetAdjustedTime())) {
-            _witnesses[proof.nTargetBlockHash] = proof;
-            return true;
-        }
-    }
-    return false;
+    if (_index.count(proof.nTargetBlockHash))
+        return false;
+
+    _witnesses[proof.nTargetBlockHash] = proof;
+    _index[proof.nTargetBlockHash] = proof.nTime;
+    _timeIndex.insert(std::make_pair(proof.nTime, proof.nTargetBlockHash));
+
+    CLevelDBBatch batch;
+    batch.Write(std::make_pair('w', proof.nTargetBlockHash), proof);
+    batch.Write(std::make_pair('t', proof.nTargetBlockHash), proof.nTime);
+    if (!WriteBatch(batch))
+        LogPrintf("%s : failed to write witness for %s\n", __func__, proof.nTargetBlockHash.ToString());
+    return true;
 }
 
 bool MasterNodeWitnessManager::Remove(const uint256 &targetBlockHash)
 {
     boost::lock_guard<boost::mutex> guard(_mtx);
-    if (Exist(targetBlockHash)) {
-        _witnesses.erase(targetBlockHash);
-        return true;
-    }
-    return false;
+    std::map<uint256, uint32_t>::iterator it = _index.find(targetBlockHash);
+    if (it == _index.end())
+        return false;
+
+    _timeIndex.erase(std::make_pair(it->second, targetBlockHash));
+    _index.erase(it);
+    _witnesses.erase(targetBlockHash);
+
+    CLevelDBBatch batch;
+    batch.Erase(std::make_pair('w', targetBlockHash));
+    batch.Erase(std::make_pair('t', targetBlockHash));
+    if (!WriteBatch(batch))
+        LogPrintf("%s : failed to erase witness for %s\n", __func__, targetBlockHash.ToString());
+    return true;
 }
 
 void MasterNodeWitnessManager::UpdateThread()
@@ -84,13 +110,14 @@ void MasterNodeWitnessManager::UpdateThread()
             _lastUpdate = GetTime();
 
             int64_t thresholdTime = GetAdjustedTime() - 2 * MASTERNODE_REMOVAL_SECONDS;
-            std::map<uint256, CMasterNodeWitness>::iterator it = _witnesses.begin();
             std::vector<uint256> toRemove;
-            while (it != _witnesses.end()) {
-                if (it->second.nTime < thresholdTime) {
-                    toRemove.push_back(it->first);
+            {
+                boost::lock_guard<boost::mutex> guardIndex(_mtx);
+                std::set<std::pair<uint32_t, uint256> >::iterator it = _timeIndex.begin();
+                while (it != _timeIndex.end() && it->first < thresholdTime) {
+                    toRemove.push_back(it->second);
+                    it++;
                 }
-                it++;
             }
 
             for (unsigned i = 0; i < toRemove.size(); i++) {
@@ -102,14 +129,8 @@ void MasterNodeWitnessManager::UpdateThread()
 
 void MasterNodeWitnessManager::Save()
 {
+    // witnesses are written when added, only make sure they reached the disk
     boost::lock_guard<boost::mutex> guard(_mtxGlobal);
-    EraseDB();
-    std::map<uint256, CMasterNodeWitness>::iterator it = _witnesses.begin();
-    while (it != _witnesses.end()) {
-        Write(it->first, it->second);
-        it++;
-    }
-
     Sync();
     Flush();
 }
@@ -117,26 +138,43 @@ void MasterNodeWitnessManager::Save()
 void MasterNodeWitnessManager::Load()
 {
     boost::lock_guard<boost::mutex> guard(_mtxGlobal);
+    boost::lock_guard<boost::mutex> guardIndex(_mtx);
     _witnesses.clear();
+    _index.clear();
+    _timeIndex.clear();
 
     try {
+        UpgradeDB();
+
+        // only the small time records are read, witnesses are loaded on first use
         boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
-        pcursor->SeekToFirst();
+        CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+        ssKeySet << std::make_pair('t', uint256(0));
+        pcursor->Seek(ssKeySet.str());
 
         while (pcursor->Valid()) {
             try {
+                leveldb::Slice slKey = pcursor->key();
+                CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+                char chType;
+                ssKey >> chType;
+                if (chType != 't')
+                    break;
+                uint256 targetBlockHash;
+                ssKey >> targetBlockHash;
+
                 leveldb::Slice slValue = pcursor->value();
                 CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CMasterNodeWitness witness;
-                ssValue >> witness;
+                uint32_t nTime;
+                ssValue >> nTime;
 
-                Add(witness);
-
-                pcursor->Next();
+                _index[targetBlockHash] = nTime;
+                _timeIndex.insert(std::make_pair(nTime, targetBlockHash));
             }
             catch (std::exception &e) {
                 LogPrintf("%s : Deserialize or I/O error - %s\n", __func__, e.what());
             }
+            pcursor->Next();
         }
     }
     catch (...) {
@@ -144,6 +182,44 @@ void MasterNodeWitnessManager::Load()
     }
 }
 
+void MasterNodeWitnessManager::UpgradeDB()
+{
+    // before keys were prefixed, every witness was stored under its bare target block hash
+    CLevelDBBatch batch;
+    unsigned int nUpgraded = 0;
+
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+    pcursor->SeekToFirst();
+    while (pcursor->Valid()) {
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() == sizeof(uint256)) {
+            try {
+                leveldb::Slice slValue = pcursor->value();
+                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+                CMasterNodeWitness witness;
+                ssValue >> witness;
+
+                batch.Write(std::make_pair('w', witness.nTargetBlockHash), witness);
+                batch.Write(std::make_pair('t', witness.nTargetBlockHash), witness.nTime);
+                nUpgraded++;
+            }
+            catch (std::exception &e) {
+                LogPrintf("%s : Deserialize or I/O error - %s\n", __func__, e.what());
+            }
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            uint256 legacyKey;
+            ssKey >> legacyKey;
+            batch.Erase(legacyKey);
+        }
+        pcursor->Next();
+    }
+
+    if (nUpgraded > 0) {
+        LogPrintf("%s : upgraded %u witnesses\n", __func__, nUpgraded);
+        WriteBatch(batch, true);
+    }
+}
+
 CMasterNodeWitness MasterNodeWitnessManager::CreateMasterNodeWitnessSnapshot(uint256 targetBlockHash)
 {
     CMasterNodeWitness result;
@@ -151,86 +227,252 @@ CMasterNodeWitness MasterNodeWitnessManager::CreateMasterNodeWitnessSnapshot(uin
     result.nTargetBlockHash = targetBlockHash;
     result.nTime = GetAdjustedTime();
 
-    std::map<std::pair<uint256, uint32_t>, CMasternodePing> pings;
+    // the snapshot is refreshed from mnodeman's seen maps, always locked before _mtxSnapshot
+    LOCK(mnodeman.cs);
+    boost::lock_guard<boost::mutex> guard(_mtxSnapshot);
+    RefreshSnapshot(result.nTime);
 
-    std::map<uint256, CMasternodePing>::iterator pingIt = mnodeman.mapSeenMasternodePing.begin();
-    while (pingIt != mnodeman.mapSeenMasternodePing.end()) {
-        const CMasternodePing &ping = pingIt->second;
-        if (ping.sigTime < (result.nTime - MASTERNODE_REMOVAL_SECONDS) || ping.sigTime>(result.nTime + MASTERNODE_PING_SECONDS)) {
-            pingIt++;
-            continue;
+    result.nProofs.reserve(_snapshotProofs.size());
+    for (std::map<uint256, ActiveMasterNodeProofs>::iterator it = _snapshotProofs.begin(); it != _snapshotProofs.end(); it++) {
+        result.nProofs.push_back(it->second);
+    }
+
+    return result;
+}
+
+unsigned int MasterNodeWitnessManager::GetMasterNodeWitnessSnapshotSize()
+{
+    LOCK(mnodeman.cs);
+    boost::lock_guard<boost::mutex> guard(_mtxSnapshot);
+    RefreshSnapshot(GetAdjustedTime());
+    return _snapshotProofs.size();
+}
+
+void MasterNodeWitnessManager::RefreshSnapshot(int64_t nNow)
+{
+    if (_fRebuild) {
+        RebuildCandidates();
+    }
+
+    // entries whose selected ping left (or a newer ping entered) the time window
+    while (!_setExpiry.empty() && _setExpiry.begin()->first <= nNow) {
+        _setDirty.insert(_setExpiry.begin()->second);
+        _setExpiry.erase(_setExpiry.begin());
+    }
+
+    std::set<COutPoint> setDirty;
+    setDirty.swap(_setDirty);
+    for (std::set<COutPoint>::iterator it = setDirty.begin(); it != setDirty.end(); it++) {
+        RefreshCandidate(*it, nNow);
+    }
+}
+
+void MasterNodeWitnessManager::NotifyPing(const CMasternodePing &mnp)
+{
+    boost::lock_guard<boost::mutex> guard(_mtxSnapshot);
+    if (_fRebuild)
+        return;
+    WitnessCandidate &candidate = _candidates[mnp.vin.prevout];
+    candidate.setPings.insert(std::make_pair(mnp.sigTime, mnp.GetHash()));
+    _setDirty.insert(mnp.vin.prevout);
+}
+
+void MasterNodeWitnessManager::NotifyBroadcast(const CMasternodeBroadcast &mnb)
+{
+    boost::lock_guard<boost::mutex> guard(_mtxSnapshot);
+    if (_fRebuild)
+        return;
+    WitnessCandidate &candidate = _candidates[mnb.vin.prevout];
+    candidate.setBroadcasts.insert(mnb.GetHash());
+    _setDirty.insert(mnb.vin.prevout);
+}
+
+void MasterNodeWitnessManager::NotifyBroadcastRemoved(const CMasternodeBroadcast &mnb)
+{
+    boost::lock_guard<boost::mutex> guard(_mtxSnapshot);
+    if (_candidates.count(mnb.vin.prevout))
+        _setDirty.insert(mnb.vin.prevout);
+}
+
+void MasterNodeWitnessManager::ResetSnapshot()
+{
+    boost::lock_guard<boost::mutex> guard(_mtxSnapshot);
+    _fRebuild = true;
+}
+
+void MasterNodeWitnessManager::UpdatedBlockTip(const CBlockIndex *pindex)
+{
+    // spent collaterals can come back through a reorg or a dropped mempool spend
+    boost::lock_guard<boost::mutex> guard(_mtxSnapshot);
+    for (std::map<COutPoint, WitnessCandidate>::iterator it = _candidates.begin(); it != _candidates.end(); it++) {
+        if (it->second.collateralState == COLLATERAL_SPENT) {
+            it->second.collateralState = COLLATERAL_UNKNOWN;
+            _setDirty.insert(it->first);
         }
-        std::pair<uint256, uint32_t> key(ping.vin.prevout.hash, ping.vin.prevout.n);
-        if (pings.find(key) == pings.end() || pings[key].sigTime < ping.sigTime)
-            pings[key] = ping;
-        pingIt++;
     }
+}
 
-    std::vector<CTxIn> included;
-    std::map<uint256, CMasternodeBroadcast>::iterator it = mnodeman.mapSeenMasternodeBroadcast.begin();
-    while (it != mnodeman.mapSeenMasternodeBroadcast.end()) {
-        std::pair<uint256, uint32_t> key(it->second.vin.prevout.hash, it->second.vin.prevout.n);
-        if (pings.find(key) != pings.end()) {
-            ActiveMasterNodeProofs proof;
-            proof.nVersion = 0;
-            proof.nBroadcast = it->second;
-            proof.nPing = pings[key];
-            bool skip = false;
-            {
-                CValidationState state;
-                CMutableTransaction dummyTx = CMutableTransaction();
-                CTxOut vout = CTxOut(2999.99 * COIN, obfuScationPool.collateralPubKey);
-                dummyTx.vin.push_back(proof.nPing.vin);
-                dummyTx.vout.push_back(vout);
-
-                TRY_LOCK(cs_main, lockMain);
-                if (lockMain && !AcceptableInputs(mempool, state, CTransaction(dummyTx), false, NULL)) {
-                    skip = true;
-                }
-            }
-            if (!skip && std::find(included.begin(), included.end(), proof.nPing.vin) == included.end())
-                result.nProofs.push_back(proof);
-            included.push_back(proof.nPing.vin);
+void MasterNodeWitnessManager::SyncTransaction(const CTransaction &tx, const CBlock *pblock)
+{
+    boost::lock_guard<boost::mutex> guard(_mtxSnapshot);
+    if (_candidates.empty())
+        return;
+
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        std::map<COutPoint, WitnessCandidate>::iterator it = _candidates.find(tx.vin[i].prevout);
+        if (it != _candidates.end()) {
+            it->second.collateralState = COLLATERAL_UNKNOWN;
+            _setDirty.insert(it->first);
         }
-        it++;
     }
 
-    return result;
+    // a disconnected transaction may have created a collateral
+    uint256 hashTx = tx.GetHash();
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        std::map<COutPoint, WitnessCandidate>::iterator it = _candidates.find(COutPoint(hashTx, i));
+        if (it != _candidates.end()) {
+            it->second.collateralState = COLLATERAL_UNKNOWN;
+            _setDirty.insert(it->first);
+        }
+    }
 }
 
-void MasterNodeWitnessManager::EraseDB()
+void MasterNodeWitnessManager::RebuildCandidates()
 {
-    std::vector<uint256> toRemove;
-    try {
-        boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
-        pcursor->SeekToFirst();
-        while (pcursor->Valid()) {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            uint256 targetBlockHash;
-            ssKey >> targetBlockHash;
+    _candidates.clear();
+    _snapshotProofs.clear();
+    _setExpiry.clear();
+    _setDirty.clear();
+
+    // unchecked messages are added once they pass their checks, see NotifyPing/NotifyBroadcast
+    for (CSeenMasternodeMap<CMasternodePing>::const_iterator it = mnodeman.mapSeenMasternodePing.begin(); it != mnodeman.mapSeenMasternodePing.end(); it++) {
+        if (!mnodeman.mapSeenMasternodePing.checked(it->first))
+            continue;
+        _candidates[it->second.vin.prevout].setPings.insert(std::make_pair(it->second.sigTime, it->first));
+    }
+    for (CSeenMasternodeMap<CMasternodeBroadcast>::const_iterator it = mnodeman.mapSeenMasternodeBroadcast.begin(); it != mnodeman.mapSeenMasternodeBroadcast.end(); it++) {
+        if (!mnodeman.mapSeenMasternodeBroadcast.checked(it->first))
+            continue;
+        _candidates[it->second.vin.prevout].setBroadcasts.insert(it->first);
+    }
+    for (std::map<COutPoint, WitnessCandidate>::iterator it = _candidates.begin(); it != _candidates.end(); it++) {
+        _setDirty.insert(it->first);
+    }
 
-            toRemove.push_back(targetBlockHash);
+    _fRebuild = false;
+}
 
-            pcursor->Next();
+void MasterNodeWitnessManager::RefreshCandidate(const COutPoint &outpoint, int64_t nNow)
+{
+    std::map<COutPoint, WitnessCandidate>::iterator mi = _candidates.find(outpoint);
+    if (mi == _candidates.end())
+        return;
+    WitnessCandidate &candidate = mi->second;
+
+    if (candidate.hashIncluded != 0) {
+        _snapshotProofs.erase(candidate.hashIncluded);
+        candidate.hashIncluded = 0;
+    }
+    if (candidate.nValidUntil != 0) {
+        _setExpiry.erase(std::make_pair(candidate.nValidUntil, outpoint));
+        candidate.nValidUntil = 0;
+    }
+
+    // drop pings which mnodeman has forgotten or which are too old to ever be selected again
+    std::set<std::pair<int64_t, uint256>, ComparePingTime>::iterator pingIt = candidate.setPings.begin();
+    while (pingIt != candidate.setPings.end()) {
+        if (pingIt->first < nNow - 2 * MASTERNODE_REMOVAL_SECONDS || !mnodeman.mapSeenMasternodePing.count(pingIt->second))
+            candidate.setPings.erase(pingIt++);
+        else
+            ++pingIt;
+    }
+
+    // the lowest hash broadcast which is still known, the same one a full scan would pick
+    CSeenMasternodeMap<CMasternodeBroadcast>::const_iterator broadcastIt = mnodeman.mapSeenMasternodeBroadcast.end();
+    std::set<uint256>::iterator hashIt = candidate.setBroadcasts.begin();
+    while (hashIt != candidate.setBroadcasts.end()) {
+        broadcastIt = mnodeman.mapSeenMasternodeBroadcast.find(*hashIt);
+        if (broadcastIt != mnodeman.mapSeenMasternodeBroadcast.end())
+            break;
+        candidate.setBroadcasts.erase(hashIt++);
+    }
+
+    if (candidate.setPings.empty() && candidate.setBroadcasts.empty()) {
+        _candidates.erase(mi);
+        return;
+    }
+
+    // newest ping inside [nNow - MASTERNODE_REMOVAL_SECONDS, nNow + MASTERNODE_PING_SECONDS]
+    int64_t nValidUntil = std::numeric_limits<int64_t>::max();
+    pingIt = candidate.setPings.upper_bound(std::make_pair(nNow + MASTERNODE_PING_SECONDS, uint256(0)));
+    if (pingIt != candidate.setPings.end())
+        nValidUntil = pingIt->first - MASTERNODE_PING_SECONDS;
+
+    const CMasternodePing *pping = NULL;
+    if (pingIt != candidate.setPings.begin()) {
+        --pingIt;
+        if (pingIt->first >= nNow - MASTERNODE_REMOVAL_SECONDS) {
+            pping = &mnodeman.mapSeenMasternodePing.find(pingIt->second)->second;
+            nValidUntil = std::min(nValidUntil, pingIt->first + MASTERNODE_REMOVAL_SECONDS);
         }
     }
-    catch (std::exception &e) {
-        LogPrintf("%s : Deserialize or I/O error - %s\n", __func__, e.what());
+
+    if (nValidUntil != std::numeric_limits<int64_t>::max()) {
+        candidate.nValidUntil = nValidUntil;
+        _setExpiry.insert(std::make_pair(nValidUntil, outpoint));
     }
 
-    for (std::vector<uint256>::iterator it = toRemove.begin(); it != toRemove.end(); it++) {
-        uint256 target = *it;
-        Erase(target, true);
+    if (pping == NULL || broadcastIt == mnodeman.mapSeenMasternodeBroadcast.end())
+        return;
+
+    if (candidate.collateralState == COLLATERAL_UNKNOWN) {
+        TRY_LOCK(cs_main, lockMain);
+        if (lockMain) {
+            candidate.collateralState = IsCollateralSpent(pping->vin) ? COLLATERAL_SPENT : COLLATERAL_UNSPENT;
+        } else {
+            // like the full scan, include it for now and check again on next use
+            _setDirty.insert(outpoint);
+        }
     }
+    if (candidate.collateralState == COLLATERAL_SPENT)
+        return;
+
+    ActiveMasterNodeProofs proof;
+    proof.nVersion = 0;
+    proof.nBroadcast = broadcastIt->second;
+    proof.nPing = *pping;
+    _snapshotProofs[broadcastIt->first] = proof;
+    candidate.hashIncluded = broadcastIt->first;
 }
 
-const CMasterNodeWitness &MasterNodeWitnessManager::Get(const uint256 &targetBlockHash)
+bool MasterNodeWitnessManager::IsCollateralSpent(const CTxIn &vin) const
 {
-    if (Exist(targetBlockHash))
-        return _witnesses[targetBlockHash];
-    static CMasterNodeWitness result;
-    return result;
+    AssertLockHeld(cs_main);
+
+    CValidationState state;
+    CMutableTransaction dummyTx = CMutableTransaction();
+    CTxOut vout = CTxOut(2999.99 * COIN, obfuScationPool.collateralPubKey);
+    dummyTx.vin.push_back(vin);
+    dummyTx.vout.push_back(vout);
+
+    return !AcceptableInputs(mempool, state, CTransaction(dummyTx), false, NULL);
+}
+
+CMasterNodeWitness MasterNodeWitnessManager::Get(const uint256 &targetBlockHash)
+{
+    boost::lock_guard<boost::mutex> guard(_mtx);
+    std::map<uint256, CMasterNodeWitness>::iterator it = _witnesses.find(targetBlockHash);
+    if (it != _witnesses.end())
+        return it->second;
+
+    if (_index.count(targetBlockHash)) {
+        CMasterNodeWitness witness;
+        if (Read(std::make_pair('w', targetBlockHash), witness))
+            return _witnesses[targetBlockHash] = witness;
+        LogPrintf("%s : failed to read witness for %s\n", __func__, targetBlockHash.ToString());
+    }
+
+    return CMasterNodeWitness();
 }
 
 void MasterNodeWitnessManager::AddBroadCastToMNManager(const uint256 &targetBlockHash)
@@ -247,12 +489,13 @@ void MasterNodeWitnessManager::AddBroadCastToMNManager(const uint256 &targetBloc
             masternodeSync.AddedMasternodeList(mnb.GetHash());
             continue;
         }
-        mnodeman.mapSeenMasternodeBroadcast.insert(make_pair(mnb.GetHash(), mnb));
+        mnodeman.AddSeenBroadcast(mnb, false);
 
         int nDoS = 0;
         if (!mnb.CheckAndUpdate(nDoS)) {
             continue;
         }
+        mnodeman.AddSeenBroadcast(mnb);
 
         // make sure it's still unspent
         //  - this is checked later by .check() in many places and by ThreadCheckObfuScationPool()
@@ -260,4 +503,84 @@ void MasterNodeWitnessManager::AddBroadCastToMNManager(const uint256 &targetBloc
             masternodeSync.AddedMasternodeList(mnb.GetHash());
         }
     }
-}
\ No newline at end of file
+}
+CCompactMasterNodeWitness MasterNodeWitnessManager::GetCompactWitness(const uint256 &targetBlockHash, CNode *pto)
+{
+    CMasterNodeWitness witness = Get(targetBlockHash);
+
+    CCompactMasterNodeWitness compact;
+    compact.nVersion = witness.nVersion;
+    compact.nTime = witness.nTime;
+    compact.nTargetBlockHash = witness.nTargetBlockHash;
+    compact.pubKeyWitness = witness.pubKeyWitness;
+    compact.vchSig = witness.vchSig;
+    compact.vProofs.resize(witness.nProofs.size());
+
+    LOCK(pto->cs_inventory);
+    for (unsigned i = 0; i < witness.nProofs.size(); i++) {
+        const ActiveMasterNodeProofs &proof = witness.nProofs[i];
+        CCompactMasterNodeProof &entry = compact.vProofs[i];
+
+        CMasterNodeProofRef ref;
+        ref.hashPing = proof.nPing.GetHash();
+        ref.hashBroadcast = proof.nBroadcast.GetHash();
+        const CMasternodePing &lastPing = proof.nBroadcast.lastPing;
+        bool fNullLastPing = lastPing == CMasternodePing() && lastPing.sigTime == 0 && lastPing.vchSig.empty();
+        ref.hashLastPing = fNullLastPing ? uint256(0) : lastPing.GetHash();
+        ref.nLastDsq = proof.nBroadcast.nLastDsq;
+
+        if (proof.nVersion == ActiveMasterNodeProofs::CURRENT_VERSION
+            && pto->setInventoryKnown.count(CInv(MSG_MASTERNODE_PING, ref.hashPing))
+            && pto->setInventoryKnown.count(CInv(MSG_MASTERNODE_ANNOUNCE, ref.hashBroadcast))
+            && (ref.hashLastPing == 0 || ref.hashLastPing == ref.hashPing
+                || pto->setInventoryKnown.count(CInv(MSG_MASTERNODE_PING, ref.hashLastPing)))) {
+            entry.ref = ref;
+        } else {
+            entry.fFull = true;
+            entry.proof = proof;
+        }
+    }
+
+    return compact;
+}
+
+bool MasterNodeWitnessManager::FillCompactWitness(const CCompactMasterNodeWitness &compact, CMasterNodeWitness &witness, std::vector<uint32_t> &vMissing) const
+{
+    witness.nVersion = compact.nVersion;
+    witness.nTime = compact.nTime;
+    witness.nTargetBlockHash = compact.nTargetBlockHash;
+    witness.pubKeyWitness = compact.pubKeyWitness;
+    witness.vchSig = compact.vchSig;
+    witness.nProofs.clear();
+    witness.nProofs.resize(compact.vProofs.size());
+    vMissing.clear();
+
+    LOCK(mnodeman.cs);
+
+    for (unsigned i = 0; i < compact.vProofs.size(); i++) {
+        const CCompactMasterNodeProof &entry = compact.vProofs[i];
+        if (entry.fFull) {
+            witness.nProofs[i] = entry.proof;
+            continue;
+        }
+
+        CSeenMasternodeMap<CMasternodePing>::const_iterator pingIt = mnodeman.mapSeenMasternodePing.find(entry.ref.hashPing);
+        CSeenMasternodeMap<CMasternodeBroadcast>::const_iterator broadcastIt = mnodeman.mapSeenMasternodeBroadcast.find(entry.ref.hashBroadcast);
+        CSeenMasternodeMap<CMasternodePing>::const_iterator lastPingIt = mnodeman.mapSeenMasternodePing.find(entry.ref.hashLastPing);
+        if (pingIt == mnodeman.mapSeenMasternodePing.end()
+            || broadcastIt == mnodeman.mapSeenMasternodeBroadcast.end()
+            || (entry.ref.hashLastPing != 0 && lastPingIt == mnodeman.mapSeenMasternodePing.end())) {
+            vMissing.push_back(i);
+            continue;
+        }
+
+        ActiveMasterNodeProofs &proof = witness.nProofs[i];
+        proof.nVersion = ActiveMasterNodeProofs::CURRENT_VERSION;
+        proof.nPing = pingIt->second;
+        proof.nBroadcast = broadcastIt->second;
+        proof.nBroadcast.lastPing = entry.ref.hashLastPing == 0 ? CMasternodePing() : lastPingIt->second;
+        proof.nBroadcast.nLastDsq = entry.ref.nLastDsq;
+    }
+
+    return vMissing.empty();
+}
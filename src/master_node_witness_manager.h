@@ -9,6 +9,9 @@
 
 #include "leveldbwrapper.h"
 #include "base58.h"
+#include "primitives/masternode_witness.h"
+#include "primitives/transaction.h"
+#include "validationinterface.h"
 
 #include <unordered_set>
 #include <string>
@@ -17,11 +20,12 @@
 class CMasterNodeWitness;
 class MasterNodeWitnessManager;
 class CBlock;
+class CNode;
 
 /*
  * Contains proofs of active master nodes
  */
-class MasterNodeWitnessManager: public CLevelDBWrapper
+class MasterNodeWitnessManager: public CLevelDBWrapper, public CValidationInterface
 {
 public:
     MasterNodeWitnessManager();
@@ -30,19 +34,82 @@ public:
     bool Exist(const uint256 &targetBlockHash) const;
     bool Add(const CMasterNodeWitness &proof, bool validate = false);
     bool Remove(const uint256 &targetBlockHash);
-    const CMasterNodeWitness &Get(const uint256 &targetBlockHash);
+    /// A copy, entries of the cache may be replaced once the lock is released
+    CMasterNodeWitness Get(const uint256 &targetBlockHash);
     CMasterNodeWitness CreateMasterNodeWitnessSnapshot(uint256 targetBlockHash = 0);
+    /// Number of proofs CreateMasterNodeWitnessSnapshot would return now, without copying them
+    unsigned int GetMasterNodeWitnessSnapshotSize();
 
     void UpdateThread();
     void Save();
     void Load();
 
     void AddBroadCastToMNManager(const uint256 &targetBlockHash);
+
+    /// Witness of targetBlockHash for relay to pto, proofs pto has already seen are sent as references
+    CCompactMasterNodeWitness GetCompactWitness(const uint256 &targetBlockHash, CNode *pto);
+    /// Rebuild a relayed compact witness, indexes of proofs which can't be rebuilt are returned in vMissing
+    bool FillCompactWitness(const CCompactMasterNodeWitness &compact, CMasterNodeWitness &witness, std::vector<uint32_t> &vMissing) const;
+
+    /// Keep the maintained snapshot in sync with mnodeman.mapSeenMasternodePing / mapSeenMasternodeBroadcast
+    void NotifyPing(const CMasternodePing &mnp);
+    void NotifyBroadcast(const CMasternodeBroadcast &mnb);
+    void NotifyBroadcastRemoved(const CMasternodeBroadcast &mnb);
+    /// Rebuild the maintained snapshot from mnodeman on next use (after bulk load or clear)
+    void ResetSnapshot();
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex *pindex);
+    void SyncTransaction(const CTransaction &tx, const CBlock *pblock);
+
 private:
-    void EraseDB();
+    enum CollateralState {
+        COLLATERAL_UNKNOWN,
+        COLLATERAL_UNSPENT,
+        COLLATERAL_SPENT
+    };
+
+    /** Ping hashes ordered by sigTime, ties ordered by descending hash */
+    struct ComparePingTime {
+        bool operator()(const std::pair<int64_t, uint256> &a, const std::pair<int64_t, uint256> &b) const
+        {
+            if (a.first != b.first)
+                return a.first < b.first;
+            return b.second < a.second;
+        }
+    };
+
+    /** Everything seen for one masternode collateral */
+    struct WitnessCandidate {
+        std::set<std::pair<int64_t, uint256>, ComparePingTime> setPings;
+        std::set<uint256> setBroadcasts;
+        CollateralState collateralState;
+        uint256 hashIncluded;   // key in _snapshotProofs, 0 if not included
+        int64_t nValidUntil;    // adjusted time after which the entry has to be refreshed
+
+        WitnessCandidate() : collateralState(COLLATERAL_UNKNOWN), hashIncluded(0), nValidUntil(0) {}
+    };
+
+    void UpgradeDB();
+    void RebuildCandidates();
+    void RefreshSnapshot(int64_t nNow);
+    void RefreshCandidate(const COutPoint &outpoint, int64_t nNow);
+    bool IsCollateralSpent(const CTxIn &vin) const;
+
+    // witnesses are written through to the db and loaded on first use, protected by _mtx
     std::map<uint256, CMasterNodeWitness> _witnesses;
+    std::map<uint256, uint32_t> _index;                    // every stored witness with its time
+    std::set<std::pair<uint32_t, uint256> > _timeIndex;     // stored witnesses ordered by time, for pruning
     int64_t _lastUpdate;
     bool _stopThread;
-    boost::mutex _mtx;
+    mutable boost::mutex _mtx;
     boost::mutex _mtxGlobal;
+
+    // maintained snapshot, protected by _mtxSnapshot
+    std::map<COutPoint, WitnessCandidate> _candidates;
+    std::map<uint256, ActiveMasterNodeProofs> _snapshotProofs;   // ordered by broadcast hash
+    std::set<std::pair<int64_t, COutPoint> > _setExpiry;
+    std::set<COutPoint> _setDirty;
+    bool _fRebuild;
+    boost::mutex _mtxSnapshot;
 };
\ No newline at end of file
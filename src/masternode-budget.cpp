@@ -9,11 +9,13 @@
 #include "main.h"
 
 #include "addrman.h"
+#include "checkqueue.h"
 #include "masternode-budget.h"
 #include "masternode-sync.h"
 #include "masternode.h"
 #include "masternodeman.h"
 #include "obfuscation.h"
+#include "sectionfile.h"
 #include "util.h"
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
@@ -23,6 +25,24 @@
 CBudgetManager budget;
 CCriticalSection cs_budget;
 
+static CCheckQueue<CBudgetVoteCheck> budgetvotecheckqueue(32);
+
+void ThreadBudgetVoteCheck()
+{
+    RenameThread("bitwin24-votech");
+    budgetvotecheckqueue.Thread();
+}
+
+bool CBudgetVoteCheck::operator()()
+{
+    std::string errorMessage;
+    *pfValid = obfuScationSigner.VerifyMessage(pubKey, vchSig, strMessage, errorMessage);
+    if (!*pfValid)
+        LogPrint("mnbudget", "CBudgetVoteCheck() - Verify message failed %s %s\n", strMessage, errorMessage);
+    // an invalid vote only rejects itself, not the rest of the batch
+    return true;
+}
+
 std::map<uint256, int64_t> askedForSourceProposalOrBudget;
 std::vector<CBudgetProposalBroadcast> vecImmatureBudgetProposals;
 std::vector<CFinalizedBudgetBroadcast> vecImmatureFinalizedBudgets;
@@ -120,31 +140,22 @@ bool IsBudgetCollateralValid(uint256 nTxCollateralHash, uint256 nExpectedHash, s
     }
 }
 
-void CBudgetManager::CheckOrphanVotes()
+void CBudgetManager::CheckOrphanVotes(const uint256& nParentHash)
 {
     LOCK(cs);
 
-
     std::string strError = "";
-    std::map<uint256, CBudgetVote>::iterator it1 = mapOrphanMasternodeBudgetVotes.begin();
-    while (it1 != mapOrphanMasternodeBudgetVotes.end()) {
-        if (budget.UpdateProposal(((*it1).second), NULL, strError)) {
-            LogPrint("mnbudget","CBudgetManager::CheckOrphanVotes - Proposal/Budget is known, activating and removing orphan vote\n");
-            mapOrphanMasternodeBudgetVotes.erase(it1++);
-        } else {
-            ++it1;
-        }
+    std::vector<CBudgetVote> vVotes = mapOrphanMasternodeBudgetVotes.take(nParentHash);
+    for (unsigned int i = 0; i < vVotes.size(); i++) {
+        if (UpdateProposal(vVotes[i], NULL, strError))
+            LogPrint("mnbudget","CBudgetManager::CheckOrphanVotes - Proposal/Budget is known, activating orphan vote\n");
     }
-    std::map<uint256, CFinalizedBudgetVote>::iterator it2 = mapOrphanFinalizedBudgetVotes.begin();
-    while (it2 != mapOrphanFinalizedBudgetVotes.end()) {
-        if (budget.UpdateFinalizedBudget(((*it2).second), NULL, strError)) {
-            LogPrint("mnbudget","CBudgetManager::CheckOrphanVotes - Proposal/Budget is known, activating and removing orphan vote\n");
-            mapOrphanFinalizedBudgetVotes.erase(it2++);
-        } else {
-            ++it2;
-        }
+    std::vector<CFinalizedBudgetVote> vFinalizedVotes = mapOrphanFinalizedBudgetVotes.take(nParentHash);
+    for (unsigned int i = 0; i < vFinalizedVotes.size(); i++) {
+        if (UpdateFinalizedBudget(vFinalizedVotes[i], NULL, strError))
+            LogPrint("mnbudget","CBudgetManager::CheckOrphanVotes - Proposal/Budget is known, activating orphan vote\n");
     }
-    LogPrint("mnbudget","CBudgetManager::CheckOrphanVotes - Done\n");
+    LogPrint("mnbudget","CBudgetManager::CheckOrphanVotes - Done, retried %u votes for %s\n", vVotes.size() + vFinalizedVotes.size(), nParentHash.ToString());
 }
 
 void CBudgetManager::SubmitFinalBudget()
@@ -293,27 +304,15 @@ bool CBudgetDB::Write(const CBudgetManager& objToSave)
 
     int64_t nStart = GetTimeMillis();
 
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
-    ssObj << strMagicMessage;                   // masternode cache file specific bitwin24ic message
-    ssObj << FLATDATA(Params().MessageStart()); // network specific bitwin24ic number
-    ssObj << objToSave;
-    uint256 hash = Hash(ssObj.begin(), ssObj.end());
-    ssObj << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathDB.string());
-
-    // Write and commit header, data
+    // serialize every section, each one gets its own checksum
+    CSectionFileWriter fileout(strMagicMessage);
     try {
-        fileout << ssObj;
+        objToSave.WriteSections(fileout);
     } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+        return error("%s : Serialize error - %s", __func__, e.what());
     }
-    fileout.fclose();
+    if (!fileout.Write(pathDB))
+        return false;
 
     LogPrint("mnbudget","Written info to budget.dat  %dms\n", GetTimeMillis() - nStart);
 
@@ -325,7 +324,23 @@ CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
     LOCK(objToLoad.cs);
 
     int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
+
+    CSectionFileReader fileSections;
+    CSectionFileReader::Result result = fileSections.Open(pathDB, strMagicMessage);
+    if (result != CSectionFileReader::Legacy) {
+        if (result != CSectionFileReader::Ok)
+            return SectionFileReadResult<CBudgetDB>(result);
+        try {
+            objToLoad.ReadSections(fileSections);
+        } catch (std::exception& e) {
+            objToLoad.Clear();
+            error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            return IncorrectFormat;
+        }
+        return Loaded(objToLoad, nStart, fDryRun);
+    }
+
+    // import the older single checksum format, it is replaced on the next write
     FILE* file = fopen(pathDB.string().c_str(), "rb");
     CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
     if (filein.IsNull()) {
@@ -393,6 +408,11 @@ CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
         return IncorrectFormat;
     }
 
+    return Loaded(objToLoad, nStart, fDryRun);
+}
+
+CBudgetDB::ReadResult CBudgetDB::Loaded(CBudgetManager& objToLoad, int64_t nStart, bool fDryRun)
+{
     LogPrint("mnbudget","Loaded info from budget.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrint("mnbudget","  %s\n", objToLoad.ToString());
     if (!fDryRun) {
@@ -442,6 +462,9 @@ bool CBudgetManager::AddFinalizedBudget(CFinalizedBudget& finalizedBudget)
     }
 
     mapFinalizedBudgets.insert(make_pair(finalizedBudget.GetHash(), finalizedBudget));
+
+    //we might have active votes for this budget that are now valid
+    CheckOrphanVotes(finalizedBudget.GetHash());
     return true;
 }
 
@@ -460,6 +483,9 @@ bool CBudgetManager::AddProposal(CBudgetProposal& budgetProposal)
 
     mapProposals.insert(make_pair(budgetProposal.GetHash(), budgetProposal));
     LogPrint("mnbudget","CBudgetManager::AddProposal - proposal %s added\n", budgetProposal.GetName ().c_str ());
+
+    //We might have active votes for this proposal that are valid now
+    CheckOrphanVotes(budgetProposal.GetHash());
     return true;
 }
 
@@ -566,8 +592,7 @@ void CBudgetManager::FillBlockPayee(CMutableTransaction& txNew, CAmount nFees, b
         ++it;
     }
 
-    CMasterNodeWitness witness = pMNWitness->CreateMasterNodeWitnessSnapshot();
-    CAmount blockValue = GetBlockValue(pindexPrev->nHeight, witness.nProofs.size());
+    CAmount blockValue = GetBlockValue(pindexPrev->nHeight, pMNWitness->GetMasterNodeWitnessSnapshotSize());
 
     if (fProofOfStake) {
         if (nHighestCount > 0) {
@@ -992,6 +1017,11 @@ void CBudgetManager::NewBlock()
 
     //remove invalid votes once in a while (we have to check the signatures and validity of every vote, somewhat CPU intensive)
 
+    unsigned int nOrphansExpired = mapOrphanMasternodeBudgetVotes.expire(GetTime() - BUDGET_ORPHAN_VOTE_EXPIRY);
+    nOrphansExpired += mapOrphanFinalizedBudgetVotes.expire(GetTime() - BUDGET_ORPHAN_VOTE_EXPIRY);
+    LogPrint("mnbudget","CBudgetManager::NewBlock - orphan votes cleanup - expired: %u, left: %u\n", nOrphansExpired,
+        mapOrphanMasternodeBudgetVotes.size() + mapOrphanFinalizedBudgetVotes.size());
+
     LogPrint("mnbudget","CBudgetManager::NewBlock - askedForSourceProposalOrBudget cleanup - size: %d\n", askedForSourceProposalOrBudget.size());
     std::map<uint256, int64_t>::iterator it = askedForSourceProposalOrBudget.begin();
     while (it != askedForSourceProposalOrBudget.end()) {
@@ -1075,6 +1105,15 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
     if (fLiteMode) return;
     if (!masternodeSync.IsBlockchainSynced()) return;
 
+    ProcessBudgetMessage(pfrom, strCommand, vRecv);
+
+    // votes are verified once a batch is full, outside of cs_budget
+    if (strCommand == "mvote" || strCommand == "fbvote")
+        ProcessVoteQueue(false);
+}
+
+void CBudgetManager::ProcessBudgetMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
+{
     LOCK(cs_budget);
 
     if (strCommand == "mnvs") { //Masternode vote sync
@@ -1127,9 +1166,6 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         masternodeSync.AddedBudgetItem(budgetProposalBroadcast.GetHash());
 
         LogPrint("mnbudget","mprop - new budget - %s\n", budgetProposalBroadcast.GetHash().ToString());
-
-        //We might have active votes for this proposal that are valid now
-        CheckOrphanVotes();
     }
 
     if (strCommand == "mvote") { //Masternode Vote
@@ -1150,24 +1186,14 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         }
 
 
+        // marked as seen right away, so copies arriving before the check are dropped
         mapSeenMasternodeBudgetVotes.insert(make_pair(vote.GetHash(), vote));
-        if (!vote.SignatureValid(true)) {
-            if (masternodeSync.IsSynced()) {
-                LogPrintf("CBudgetManager::ProcessMessage() : mvote - signature invalid\n");
-                Misbehaving(pfrom->GetId(), 20);
-            }
-            // it could just be a non-synced masternode
-            mnodeman.AskForMN(pfrom, vote.vin);
-            return;
-        }
 
-        std::string strError = "";
-        if (UpdateProposal(vote, pfrom, strError)) {
-            vote.Relay();
-            masternodeSync.AddedBudgetItem(vote.GetHash());
-        }
-
-        LogPrint("mnbudget","mvote - new budget vote for budget %s - %s\n", vote.nProposalHash.ToString(),  vote.GetHash().ToString());
+        CBudgetVoteQueueEntry entry;
+        entry.vote = vote;
+        entry.pubKeyMasternode = pmn->pubKeyMasternode;
+        entry.pfrom = pfrom;
+        QueueVote(entry);
     }
 
     if (strCommand == "fbs") { //Finalized Budget Suggestion
@@ -1202,9 +1228,6 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             finalizedBudgetBroadcast.Relay();
         }
         masternodeSync.AddedBudgetItem(finalizedBudgetBroadcast.GetHash());
-
-        //we might have active votes for this budget that are now valid
-        CheckOrphanVotes();
     }
 
     if (strCommand == "fbvote") { //Finalized Budget Vote
@@ -1225,9 +1248,72 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         }
 
         mapSeenFinalizedBudgetVotes.insert(make_pair(vote.GetHash(), vote));
-        if (!vote.SignatureValid(true)) {
+
+        CBudgetVoteQueueEntry entry;
+        entry.fFinalized = true;
+        entry.finalizedVote = vote;
+        entry.pubKeyMasternode = pmn->pubKeyMasternode;
+        entry.pfrom = pfrom;
+        QueueVote(entry);
+    }
+}
+
+void CBudgetManager::QueueVote(const CBudgetVoteQueueEntry& entry)
+{
+    LOCK(cs_votequeue);
+    vecVoteQueue.push_back(entry);
+    // keep the peer around until its vote has been applied
+    vecVoteQueue.back().pfrom->AddRef();
+}
+
+void CBudgetManager::ProcessVoteQueue(bool fForce)
+{
+    LOCK(cs_voteprocess);
+
+    std::vector<CBudgetVoteQueueEntry> vecVotes;
+    {
+        LOCK(cs_votequeue);
+        if (vecVoteQueue.empty() || (!fForce && vecVoteQueue.size() < BUDGET_VOTE_BATCH_SIZE)) return;
+        vecVotes.swap(vecVoteQueue);
+    }
+
+    // the signatures are checked without holding any of the budget locks
+    std::vector<CBudgetVoteCheck> vChecks;
+    vChecks.reserve(vecVotes.size());
+    for (unsigned int i = 0; i < vecVotes.size(); i++) {
+        CBudgetVoteQueueEntry& entry = vecVotes[i];
+        if (entry.fFinalized)
+            vChecks.push_back(CBudgetVoteCheck(entry.pubKeyMasternode, entry.finalizedVote.GetSignatureMessage(), entry.finalizedVote.vchSig, &entry.fValid));
+        else
+            vChecks.push_back(CBudgetVoteCheck(entry.pubKeyMasternode, entry.vote.GetSignatureMessage(), entry.vote.vchSig, &entry.fValid));
+    }
+    if (nScriptCheckThreads) {
+        CCheckQueueControl<CBudgetVoteCheck> control(&budgetvotecheckqueue);
+        control.Add(vChecks);
+        control.Wait();
+    } else {
+        for (unsigned int i = 0; i < vChecks.size(); i++)
+            vChecks[i]();
+    }
+    LogPrint("mnbudget", "CBudgetManager::ProcessVoteQueue - verified %u votes\n", vecVotes.size());
+
+    // results are applied in the order the votes arrived
+    LOCK(cs_budget);
+    for (unsigned int i = 0; i < vecVotes.size(); i++) {
+        ApplyVote(vecVotes[i]);
+        vecVotes[i].pfrom->Release();
+    }
+}
+
+void CBudgetManager::ApplyVote(CBudgetVoteQueueEntry& entry)
+{
+    CNode* pfrom = entry.pfrom;
+
+    if (!entry.fFinalized) {
+        CBudgetVote& vote = entry.vote;
+        if (!entry.fValid) {
             if (masternodeSync.IsSynced()) {
-                LogPrintf("CBudgetManager::ProcessMessage() : fbvote - signature invalid\n");
+                LogPrintf("CBudgetManager::ProcessMessage() : mvote - signature invalid\n");
                 Misbehaving(pfrom->GetId(), 20);
             }
             // it could just be a non-synced masternode
@@ -1236,14 +1322,34 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         }
 
         std::string strError = "";
-        if (UpdateFinalizedBudget(vote, pfrom, strError)) {
+        if (UpdateProposal(vote, pfrom, strError)) {
             vote.Relay();
             masternodeSync.AddedBudgetItem(vote.GetHash());
+        }
 
-            LogPrint("mnbudget","fbvote - new finalized budget vote - %s\n", vote.GetHash().ToString());
-        } else {
-            LogPrint("mnbudget","fbvote - rejected finalized budget vote - %s - %s\n", vote.GetHash().ToString(), strError);
+        LogPrint("mnbudget","mvote - new budget vote for budget %s - %s\n", vote.nProposalHash.ToString(),  vote.GetHash().ToString());
+        return;
+    }
+
+    CFinalizedBudgetVote& vote = entry.finalizedVote;
+    if (!entry.fValid) {
+        if (masternodeSync.IsSynced()) {
+            LogPrintf("CBudgetManager::ProcessMessage() : fbvote - signature invalid\n");
+            Misbehaving(pfrom->GetId(), 20);
         }
+        // it could just be a non-synced masternode
+        mnodeman.AskForMN(pfrom, vote.vin);
+        return;
+    }
+
+    std::string strError = "";
+    if (UpdateFinalizedBudget(vote, pfrom, strError)) {
+        vote.Relay();
+        masternodeSync.AddedBudgetItem(vote.GetHash());
+
+        LogPrint("mnbudget","fbvote - new finalized budget vote - %s\n", vote.GetHash().ToString());
+    } else {
+        LogPrint("mnbudget","fbvote - rejected finalized budget vote - %s - %s\n", vote.GetHash().ToString(), strError);
     }
 }
 
@@ -1409,7 +1515,7 @@ bool CBudgetManager::UpdateProposal(CBudgetVote& vote, CNode* pfrom, std::string
             if (!masternodeSync.IsSynced()) return false;
 
             LogPrint("mnbudget","CBudgetManager::UpdateProposal - Unknown proposal %d, asking for source proposal\n", vote.nProposalHash.ToString());
-            mapOrphanMasternodeBudgetVotes[vote.nProposalHash] = vote;
+            mapOrphanMasternodeBudgetVotes.insert(vote, GetTime());
 
             if (!askedForSourceProposalOrBudget.count(vote.nProposalHash)) {
                 pfrom->PushMessage("mnvs", vote.nProposalHash);
@@ -1436,7 +1542,7 @@ bool CBudgetManager::UpdateFinalizedBudget(CFinalizedBudgetVote& vote, CNode* pf
             if (!masternodeSync.IsSynced()) return false;
 
             LogPrint("mnbudget","CBudgetManager::UpdateFinalizedBudget - Unknown Finalized Proposal %s, asking for source budget\n", vote.nBudgetHash.ToString());
-            mapOrphanFinalizedBudgetVotes[vote.nBudgetHash] = vote;
+            mapOrphanFinalizedBudgetVotes.insert(vote, GetTime());
 
             if (!askedForSourceProposalOrBudget.count(vote.nBudgetHash)) {
                 pfrom->PushMessage("mnvs", vote.nBudgetHash);
@@ -1769,7 +1875,7 @@ bool CBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     CKey keyCollateralAddress;
 
     std::string errorMessage;
-    std::string strMessage = vin.prevout.ToStringShort() + nProposalHash.ToString() + boost::lexical_cast<std::string>(nVote) + boost::lexical_cast<std::string>(nTime);
+    std::string strMessage = GetSignatureMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrint("mnbudget","CBudgetVote::Sign - Error upon calling SignMessage");
@@ -1784,10 +1890,15 @@ bool CBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     return true;
 }
 
+std::string CBudgetVote::GetSignatureMessage() const
+{
+    return vin.prevout.ToStringShort() + nProposalHash.ToString() + boost::lexical_cast<std::string>(nVote) + boost::lexical_cast<std::string>(nTime);
+}
+
 bool CBudgetVote::SignatureValid(bool fSignatureCheck)
 {
     std::string errorMessage;
-    std::string strMessage = vin.prevout.ToStringShort() + nProposalHash.ToString() + boost::lexical_cast<std::string>(nVote) + boost::lexical_cast<std::string>(nTime);
+    std::string strMessage = GetSignatureMessage();
 
     CMasternode* pmn = mnodeman.Find(vin);
 
@@ -2274,7 +2385,7 @@ bool CFinalizedBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     CKey keyCollateralAddress;
 
     std::string errorMessage;
-    std::string strMessage = vin.prevout.ToStringShort() + nBudgetHash.ToString() + boost::lexical_cast<std::string>(nTime);
+    std::string strMessage = GetSignatureMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrint("mnbudget","CFinalizedBudgetVote::Sign - Error upon calling SignMessage");
@@ -2289,11 +2400,16 @@ bool CFinalizedBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     return true;
 }
 
+std::string CFinalizedBudgetVote::GetSignatureMessage() const
+{
+    return vin.prevout.ToStringShort() + nBudgetHash.ToString() + boost::lexical_cast<std::string>(nTime);
+}
+
 bool CFinalizedBudgetVote::SignatureValid(bool fSignatureCheck)
 {
     std::string errorMessage;
 
-    std::string strMessage = vin.prevout.ToStringShort() + nBudgetHash.ToString() + boost::lexical_cast<std::string>(nTime);
+    std::string strMessage = GetSignatureMessage();
 
     CMasternode* pmn = mnodeman.Find(vin);
 
@@ -2312,6 +2428,24 @@ bool CFinalizedBudgetVote::SignatureValid(bool fSignatureCheck)
     return true;
 }
 
+void CBudgetManager::WriteSections(CSectionFileWriter& fileout) const
+{
+    LOCK(cs);
+    fileout.AddSection(BUDGET_SECTION_SEEN) << mapSeenMasternodeBudgetProposals << mapSeenMasternodeBudgetVotes
+        << mapSeenFinalizedBudgets << mapSeenFinalizedBudgetVotes;
+    fileout.AddSection(BUDGET_SECTION_ORPHANS) << mapOrphanMasternodeBudgetVotes << mapOrphanFinalizedBudgetVotes;
+    fileout.AddSection(BUDGET_SECTION_BUDGETS) << mapProposals << mapFinalizedBudgets;
+}
+
+void CBudgetManager::ReadSections(const CSectionFileReader& filein)
+{
+    LOCK(cs);
+    filein.GetSection(BUDGET_SECTION_SEEN) >> mapSeenMasternodeBudgetProposals >> mapSeenMasternodeBudgetVotes
+        >> mapSeenFinalizedBudgets >> mapSeenFinalizedBudgetVotes;
+    filein.GetSection(BUDGET_SECTION_ORPHANS) >> mapOrphanMasternodeBudgetVotes >> mapOrphanFinalizedBudgetVotes;
+    filein.GetSection(BUDGET_SECTION_BUDGETS) >> mapProposals >> mapFinalizedBudgets;
+}
+
 std::string CBudgetManager::ToString() const
 {
     std::ostringstream info;
@@ -28,6 +28,8 @@ class CFinalizedBudget;
 class CBudgetProposal;
 class CBudgetProposalBroadcast;
 class CTxBudgetPayment;
+class CSectionFileReader;
+class CSectionFileWriter;
 
 #define VOTE_ABSTAIN 0
 #define VOTE_YES 1
@@ -44,6 +46,11 @@ static const CAmount PROPOSAL_FEE_TX = (50 * COIN);
 static const CAmount BUDGET_FEE_TX_OLD = (50 * COIN);
 static const CAmount BUDGET_FEE_TX = (5 * COIN);
 static const int64_t BUDGET_VOTE_UPDATE_MIN = 60 * 60;
+/** Orphan votes kept per vote type, and how long they wait for their proposal or budget */
+static const unsigned int BUDGET_MAX_ORPHAN_VOTES = 10000;
+static const int64_t BUDGET_ORPHAN_VOTE_EXPIRY = 60 * 60;
+/** Number of received votes that are verified together as one batch */
+static const unsigned int BUDGET_VOTE_BATCH_SIZE = 256;
 static map<uint256, int> mapPayment_History;
 
 extern std::vector<CBudgetProposalBroadcast> vecImmatureBudgetProposals;
@@ -78,6 +85,7 @@ public:
 
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     bool SignatureValid(bool fSignatureCheck);
+    std::string GetSignatureMessage() const;
     void Relay();
 
     std::string GetVoteString()
@@ -88,7 +96,7 @@ public:
         return ret;
     }
 
-    uint256 GetHash()
+    uint256 GetHash() const
     {
         CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
         ss << vin;
@@ -130,9 +138,10 @@ public:
 
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     bool SignatureValid(bool fSignatureCheck);
+    std::string GetSignatureMessage() const;
     void Relay();
 
-    uint256 GetHash()
+    uint256 GetHash() const
     {
         CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
         ss << vin;
@@ -153,6 +162,167 @@ public:
     }
 };
 
+/** Hash of the proposal or finalized budget a vote is for */
+inline uint256 GetVoteParentHash(const CBudgetVote& vote) { return vote.nProposalHash; }
+inline uint256 GetVoteParentHash(const CFinalizedBudgetVote& vote) { return vote.nBudgetHash; }
+
+/** Votes waiting for the proposal or finalized budget they vote on, indexed by
+ *  that parent so that a new parent only retries its own votes. Holds at most
+ *  nMaxSize votes, the longest waiting ones are dropped first.
+ */
+template <typename T>
+class CBudgetOrphanVotes
+{
+private:
+    // vote hash -> vote and the time it was received
+    std::map<uint256, std::pair<T, int64_t> > mapVotes;
+    std::multimap<uint256, uint256> mapByParent;
+    std::set<std::pair<int64_t, uint256> > setByTime;
+    size_t nMaxSize;
+
+    void erase(const uint256& hash)
+    {
+        typename std::map<uint256, std::pair<T, int64_t> >::iterator it = mapVotes.find(hash);
+        if (it == mapVotes.end())
+            return;
+        std::pair<std::multimap<uint256, uint256>::iterator, std::multimap<uint256, uint256>::iterator> range =
+            mapByParent.equal_range(GetVoteParentHash(it->second.first));
+        for (std::multimap<uint256, uint256>::iterator itParent = range.first; itParent != range.second; ++itParent) {
+            if (itParent->second == hash) {
+                mapByParent.erase(itParent);
+                break;
+            }
+        }
+        setByTime.erase(std::make_pair(it->second.second, hash));
+        mapVotes.erase(it);
+    }
+
+public:
+    CBudgetOrphanVotes(size_t nMaxSizeIn) : nMaxSize(nMaxSizeIn) {}
+
+    size_t size() const { return mapVotes.size(); }
+    bool empty() const { return mapVotes.empty(); }
+    size_t count(const uint256& nParentHash) const { return mapByParent.count(nParentHash); }
+
+    void clear()
+    {
+        mapVotes.clear();
+        mapByParent.clear();
+        setByTime.clear();
+    }
+
+    /** Returns false if the vote was already waiting */
+    bool insert(const T& vote, int64_t nNow)
+    {
+        uint256 hash = vote.GetHash();
+        if (!mapVotes.insert(std::make_pair(hash, std::make_pair(vote, nNow))).second)
+            return false;
+        mapByParent.insert(std::make_pair(GetVoteParentHash(vote), hash));
+        setByTime.insert(std::make_pair(nNow, hash));
+        while (mapVotes.size() > nMaxSize)
+            erase(setByTime.begin()->second);
+        return true;
+    }
+
+    /** Take out the votes for nParentHash, in the order they were received */
+    std::vector<T> take(const uint256& nParentHash)
+    {
+        std::vector<uint256> vHashes;
+        std::pair<std::multimap<uint256, uint256>::iterator, std::multimap<uint256, uint256>::iterator> range =
+            mapByParent.equal_range(nParentHash);
+        for (std::multimap<uint256, uint256>::iterator it = range.first; it != range.second; ++it)
+            vHashes.push_back(it->second);
+
+        std::vector<T> vVotes;
+        for (unsigned int i = 0; i < vHashes.size(); i++) {
+            vVotes.push_back(mapVotes[vHashes[i]].first);
+            erase(vHashes[i]);
+        }
+        return vVotes;
+    }
+
+    /** Drop the votes received before nTime, returns how many */
+    unsigned int expire(int64_t nTime)
+    {
+        unsigned int nExpired = 0;
+        while (!setByTime.empty() && setByTime.begin()->first < nTime) {
+            erase(setByTime.begin()->second);
+            nExpired++;
+        }
+        return nExpired;
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        // stored as a plain map of votes, which older versions keyed by parent
+        std::map<uint256, T> mapStored;
+        if (!ser_action.ForRead()) {
+            for (typename std::map<uint256, std::pair<T, int64_t> >::const_iterator it = mapVotes.begin(); it != mapVotes.end(); ++it)
+                mapStored.insert(std::make_pair(it->first, it->second.first));
+        }
+        READWRITE(mapStored);
+        if (ser_action.ForRead()) {
+            clear();
+            int64_t nNow = GetTime();
+            for (typename std::map<uint256, T>::const_iterator it = mapStored.begin(); it != mapStored.end(); ++it)
+                insert(it->second, nNow);
+        }
+    }
+};
+
+/** Signature check of a received vote, run on the budget vote check threads.
+ *  The outcome is stored per vote instead of failing the whole batch.
+ */
+class CBudgetVoteCheck
+{
+private:
+    CPubKey pubKey;
+    std::string strMessage;
+    std::vector<unsigned char> vchSig;
+    bool* pfValid;
+
+public:
+    CBudgetVoteCheck() : pfValid(NULL) {}
+    CBudgetVoteCheck(const CPubKey& pubKeyIn, const std::string& strMessageIn, const std::vector<unsigned char>& vchSigIn, bool* pfValidIn) :
+        pubKey(pubKeyIn), strMessage(strMessageIn), vchSig(vchSigIn), pfValid(pfValidIn) {}
+
+    bool operator()();
+
+    void swap(CBudgetVoteCheck& check)
+    {
+        std::swap(pubKey, check.pubKey);
+        strMessage.swap(check.strMessage);
+        vchSig.swap(check.vchSig);
+        std::swap(pfValid, check.pfValid);
+    }
+};
+
+/** A received vote waiting for its signature check */
+class CBudgetVoteQueueEntry
+{
+public:
+    bool fFinalized;
+    CBudgetVote vote;
+    CFinalizedBudgetVote finalizedVote;
+    CPubKey pubKeyMasternode;
+    CNode* pfrom;
+    bool fValid;
+
+    CBudgetVoteQueueEntry() : fFinalized(false), pfrom(NULL), fValid(false) {}
+};
+
+void ThreadBudgetVoteCheck();
+
+/** Sections of budget.dat */
+enum BudgetSection {
+    BUDGET_SECTION_SEEN = 1,
+    BUDGET_SECTION_ORPHANS = 2,
+    BUDGET_SECTION_BUDGETS = 3
+};
+
 /** Save Budget Manager (budget.dat)
  */
 class CBudgetDB
@@ -175,6 +345,9 @@ public:
     CBudgetDB();
     bool Write(const CBudgetManager& objToSave);
     ReadResult Read(CBudgetManager& objToLoad, bool fDryRun = false);
+
+private:
+    ReadResult Loaded(CBudgetManager& objToLoad, int64_t nStart, bool fDryRun);
 };
 
 
@@ -188,6 +361,16 @@ private:
     // XX42    map<uint256, CTransaction> mapCollateral;
     map<uint256, uint256> mapCollateralTxids;
 
+    // received votes waiting for their signature check, in arrival order
+    CCriticalSection cs_votequeue;
+    std::vector<CBudgetVoteQueueEntry> vecVoteQueue;
+    // only one batch is verified and applied at a time, keeping the arrival order
+    CCriticalSection cs_voteprocess;
+
+    void ProcessBudgetMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
+    void QueueVote(const CBudgetVoteQueueEntry& entry);
+    void ApplyVote(CBudgetVoteQueueEntry& entry);
+
 public:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
@@ -198,12 +381,12 @@ public:
 
     std::map<uint256, CBudgetProposalBroadcast> mapSeenMasternodeBudgetProposals;
     std::map<uint256, CBudgetVote> mapSeenMasternodeBudgetVotes;
-    std::map<uint256, CBudgetVote> mapOrphanMasternodeBudgetVotes;
+    CBudgetOrphanVotes<CBudgetVote> mapOrphanMasternodeBudgetVotes;
     std::map<uint256, CFinalizedBudgetBroadcast> mapSeenFinalizedBudgets;
     std::map<uint256, CFinalizedBudgetVote> mapSeenFinalizedBudgetVotes;
-    std::map<uint256, CFinalizedBudgetVote> mapOrphanFinalizedBudgetVotes;
+    CBudgetOrphanVotes<CFinalizedBudgetVote> mapOrphanFinalizedBudgetVotes;
 
-    CBudgetManager()
+    CBudgetManager() : mapOrphanMasternodeBudgetVotes(BUDGET_MAX_ORPHAN_VOTES), mapOrphanFinalizedBudgetVotes(BUDGET_MAX_ORPHAN_VOTES)
     {
         mapProposals.clear();
         mapFinalizedBudgets.clear();
@@ -226,6 +409,8 @@ public:
 
     void Calculate();
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
+    /// Verify the queued votes in parallel and apply them, unless fForce is false and the batch is not full yet
+    void ProcessVoteQueue(bool fForce);
     void NewBlock();
     CBudgetProposal* FindProposal(const std::string& strProposalName);
     CBudgetProposal* FindProposal(uint256 nHash);
@@ -248,7 +433,8 @@ public:
     std::string GetRequiredPaymentsString(int nBlockHeight);
     void FillBlockPayee(CMutableTransaction& txNew, CAmount nFees, bool fProofOfStake);
 
-    void CheckOrphanVotes();
+    /// Retry the orphan votes for a proposal or finalized budget that just arrived
+    void CheckOrphanVotes(const uint256& nParentHash);
     void Clear()
     {
         LOCK(cs);
@@ -266,6 +452,10 @@ public:
     void CheckAndRemove();
     std::string ToString() const;
 
+    /// Store in / load from the sections of budget.dat
+    void WriteSections(CSectionFileWriter& fileout) const;
+    void ReadSections(const CSectionFileReader& filein);
+
 
     ADD_SERIALIZE_METHODS;
 
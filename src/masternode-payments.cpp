@@ -13,6 +13,7 @@
 #include "masternode-sync.h"
 #include "masternodeman.h"
 #include "obfuscation.h"
+#include "sectionfile.h"
 #include "spork.h"
 #include "sync.h"
 #include "util.h"
@@ -45,27 +46,15 @@ bool CMasternodePaymentDB::Write(const CMasternodePayments& objToSave)
 {
     int64_t nStart = GetTimeMillis();
 
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
-    ssObj << strMagicMessage;                   // masternode cache file specific bitwin24ic message
-    ssObj << FLATDATA(Params().MessageStart()); // network specific bitwin24ic number
-    ssObj << objToSave;
-    uint256 hash = Hash(ssObj.begin(), ssObj.end());
-    ssObj << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathDB.string());
-
-    // Write and commit header, data
+    // serialize every section, each one gets its own checksum
+    CSectionFileWriter fileout(strMagicMessage);
     try {
-        fileout << ssObj;
+        objToSave.WriteSections(fileout);
     } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+        return error("%s : Serialize error - %s", __func__, e.what());
     }
-    fileout.fclose();
+    if (!fileout.Write(pathDB))
+        return false;
 
     LogPrint("masternode","Written info to mnpayments.dat  %dms\n", GetTimeMillis() - nStart);
 
@@ -75,7 +64,23 @@ bool CMasternodePaymentDB::Write(const CMasternodePayments& objToSave)
 CMasternodePaymentDB::ReadResult CMasternodePaymentDB::Read(CMasternodePayments& objToLoad, bool fDryRun)
 {
     int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
+
+    CSectionFileReader fileSections;
+    CSectionFileReader::Result result = fileSections.Open(pathDB, strMagicMessage);
+    if (result != CSectionFileReader::Legacy) {
+        if (result != CSectionFileReader::Ok)
+            return SectionFileReadResult<CMasternodePaymentDB>(result);
+        try {
+            objToLoad.ReadSections(fileSections);
+        } catch (std::exception& e) {
+            objToLoad.Clear();
+            error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            return IncorrectFormat;
+        }
+        return Loaded(objToLoad, nStart, fDryRun);
+    }
+
+    // import the older single checksum format, it is replaced on the next write
     FILE* file = fopen(pathDB.string().c_str(), "rb");
     CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
     if (filein.IsNull()) {
@@ -142,6 +147,11 @@ CMasternodePaymentDB::ReadResult CMasternodePaymentDB::Read(CMasternodePayments&
         return IncorrectFormat;
     }
 
+    return Loaded(objToLoad, nStart, fDryRun);
+}
+
+CMasternodePaymentDB::ReadResult CMasternodePaymentDB::Loaded(CMasternodePayments& objToLoad, int64_t nStart, bool fDryRun)
+{
     LogPrint("masternode","Loaded info from mnpayments.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrint("masternode","  %s\n", objToLoad.ToString());
     if (!fDryRun) {
@@ -322,9 +332,9 @@ void CMasternodePayments::FillBlockPayee(CMutableTransaction& txNew, int64_t nFe
         }
     }
 
-    CMasterNodeWitness witness = pMNWitness->CreateMasterNodeWitnessSnapshot();
-    CAmount blockValue = GetBlockValue(pindexPrev->nHeight + 1, witness.nProofs.size());
-    LogPrintf("CMasternodePayments::FillBlockPayee: value=%d; mn=%d", blockValue, witness.nProofs.size());
+    unsigned int nMasternodes = pMNWitness->GetMasterNodeWitnessSnapshotSize();
+    CAmount blockValue = GetBlockValue(pindexPrev->nHeight + 1, nMasternodes);
+    LogPrintf("CMasternodePayments::FillBlockPayee: value=%d; mn=%d", blockValue, nMasternodes);
     CAmount masternodePayment = GetMasterNodePayment(blockValue);
 
     if (hasPayment) {
@@ -473,8 +483,9 @@ bool CMasternodePaymentWinner::Sign(CKey& keyMasternode, CPubKey& pubKeyMasterno
 
 bool CMasternodePayments::GetBlockPayee(int nBlockHeight, CScript& payee)
 {
-    if (mapMasternodeBlocks.count(nBlockHeight)) {
-        return mapMasternodeBlocks[nBlockHeight].GetPayee(payee);
+    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.find(nBlockHeight);
+    if (it != mapMasternodeBlocks.end()) {
+        return it->second.GetPayee(payee);
     }
 
     return false;
@@ -497,13 +508,12 @@ bool CMasternodePayments::IsScheduled(CMasternode& mn, int nNotBlockHeight)
     mnpayee = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
 
     CScript payee;
-    for (int64_t h = nHeight; h <= nHeight + 8; h++) {
-        if (h == nNotBlockHeight) continue;
-        if (mapMasternodeBlocks.count(h)) {
-            if (mapMasternodeBlocks[h].GetPayee(payee)) {
-                if (mnpayee == payee) {
-                    return true;
-                }
+    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.lower_bound(nHeight);
+    for (; it != mapMasternodeBlocks.end() && it->first <= nHeight + 8; ++it) {
+        if (it->first == nNotBlockHeight) continue;
+        if (it->second.GetPayee(payee)) {
+            if (mnpayee == payee) {
+                return true;
             }
         }
     }
@@ -521,11 +531,13 @@ bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerI
     {
         LOCK2(cs_mapMasternodePayeeVotes, cs_mapMasternodeBlocks);
 
-        if (mapMasternodePayeeVotes.count(winnerIn.GetHash())) {
+        uint256 hash = winnerIn.GetHash();
+        if (mapMasternodePayeeVotes.count(hash)) {
             return false;
         }
 
-        mapMasternodePayeeVotes[winnerIn.GetHash()] = winnerIn;
+        mapMasternodePayeeVotes[hash] = winnerIn;
+        mapPayeeVotesByHeight[winnerIn.nBlockHeight].push_back(hash);
 
         if (!mapMasternodeBlocks.count(winnerIn.nBlockHeight)) {
             CMasternodeBlockPayees blockPayees(winnerIn.nBlockHeight);
@@ -538,7 +550,7 @@ bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerI
     return true;
 }
 
-bool CMasternodeBlockPayees::IsTransactionValid(const CTransaction& txNew)
+bool CMasternodeBlockPayees::IsTransactionValid(const CTransaction& txNew, unsigned int nMasternodes)
 {
     LOCK(cs_vecPayments);
 
@@ -546,9 +558,8 @@ bool CMasternodeBlockPayees::IsTransactionValid(const CTransaction& txNew)
 
     std::string strPayeesPossible = "";
 
-    CMasterNodeWitness witness = pMNWitness->CreateMasterNodeWitnessSnapshot();
-    CAmount nReward = GetBlockValue(nBlockHeight, witness.nProofs.size());
-    LogPrintf("CMasternodeBlockPayees::IsTransactionValid: value=%d; mn=%d", nReward, witness.nProofs.size());
+    CAmount nReward = GetBlockValue(nBlockHeight, nMasternodes);
+    LogPrintf("CMasternodeBlockPayees::IsTransactionValid: value=%d; mn=%d", nReward, nMasternodes);
 
     CAmount requiredMasternodePayment = GetMasterNodePayment(nReward);
 
@@ -615,8 +626,9 @@ std::string CMasternodePayments::GetRequiredPaymentsString(int nBlockHeight)
 {
     LOCK(cs_mapMasternodeBlocks);
 
-    if (mapMasternodeBlocks.count(nBlockHeight)) {
-        return mapMasternodeBlocks[nBlockHeight].GetRequiredPaymentsString();
+    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.find(nBlockHeight);
+    if (it != mapMasternodeBlocks.end()) {
+        return it->second.GetRequiredPaymentsString();
     }
 
     return "Unknown";
@@ -624,10 +636,14 @@ std::string CMasternodePayments::GetRequiredPaymentsString(int nBlockHeight)
 
 bool CMasternodePayments::IsTransactionValid(const CTransaction& txNew, int nBlockHeight)
 {
+    // the snapshot takes mnodeman.cs, which is held while taking cs_mapMasternodeBlocks in IsScheduled
+    unsigned int nMasternodes = pMNWitness->GetMasterNodeWitnessSnapshotSize();
+
     LOCK(cs_mapMasternodeBlocks);
 
-    if (mapMasternodeBlocks.count(nBlockHeight)) {
-        return mapMasternodeBlocks[nBlockHeight].IsTransactionValid(txNew);
+    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.find(nBlockHeight);
+    if (it != mapMasternodeBlocks.end()) {
+        return it->second.IsTransactionValid(txNew, nMasternodes);
     }
 
     return true;
@@ -635,6 +651,9 @@ bool CMasternodePayments::IsTransactionValid(const CTransaction& txNew, int nBlo
 
 void CMasternodePayments::CleanPaymentList()
 {
+    // read before the payment locks, see IsTransactionValid
+    unsigned int nMasternodes = pMNWitness->GetMasterNodeWitnessSnapshotSize();
+
     LOCK2(cs_mapMasternodePayeeVotes, cs_mapMasternodeBlocks);
 
     int nHeight;
@@ -645,22 +664,27 @@ void CMasternodePayments::CleanPaymentList()
     }
 
     //keep up to five cycles for historical sake
-    CMasterNodeWitness witness = pMNWitness->CreateMasterNodeWitnessSnapshot();
-    int nLimit = std::max(int(witness.nProofs.size() * 1.25), 1000);
-
-    std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.begin();
-    while (it != mapMasternodePayeeVotes.end()) {
-        CMasternodePaymentWinner winner = (*it).second;
-
-        if (nHeight - winner.nBlockHeight > nLimit) {
-            LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payment - block %d\n", winner.nBlockHeight);
-            masternodeSync.mapSeenSyncMNW.erase((*it).first);
-            mapMasternodePayeeVotes.erase(it++);
-            mapMasternodeBlocks.erase(winner.nBlockHeight);
-        } else {
-            ++it;
+    int nLimit = std::max(int(nMasternodes * 1.25), 1000);
+
+    // whole heights expire at once, oldest first
+    std::map<int, std::vector<uint256> >::iterator it = mapPayeeVotesByHeight.begin();
+    while (it != mapPayeeVotesByHeight.end() && nHeight - it->first > nLimit) {
+        LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payments - block %d\n", it->first);
+        BOOST_FOREACH (const uint256& hash, it->second) {
+            masternodeSync.mapSeenSyncMNW.erase(hash);
+            mapMasternodePayeeVotes.erase(hash);
         }
+        mapPayeeVotesByHeight.erase(it++);
     }
+    mapMasternodeBlocks.erase(mapMasternodeBlocks.begin(), mapMasternodeBlocks.lower_bound(nHeight - nLimit));
+}
+
+void CMasternodePayments::RebuildVotesByHeight()
+{
+    mapPayeeVotesByHeight.clear();
+    std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.begin();
+    for (; it != mapMasternodePayeeVotes.end(); ++it)
+        mapPayeeVotesByHeight[it->second.nBlockHeight].push_back(it->first);
 }
 
 bool CMasternodePaymentWinner::IsValid(CNode* pnode, std::string& strError)
@@ -809,18 +833,31 @@ void CMasternodePayments::Sync(CNode* node, int nCountNeeded)
     if (nCountNeeded > nCount) nCountNeeded = nCount;
 
     int nInvCount = 0;
-    std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.begin();
-    while (it != mapMasternodePayeeVotes.end()) {
-        CMasternodePaymentWinner winner = (*it).second;
-        if (winner.nBlockHeight >= nHeight - nCountNeeded && winner.nBlockHeight <= nHeight + 20) {
-            node->PushInventory(CInv(MSG_MASTERNODE_WINNER, winner.GetHash()));
+    std::map<int, std::vector<uint256> >::iterator it = mapPayeeVotesByHeight.lower_bound(nHeight - nCountNeeded);
+    for (; it != mapPayeeVotesByHeight.end() && it->first <= nHeight + 20; ++it) {
+        BOOST_FOREACH (const uint256& hash, it->second) {
+            node->PushInventory(CInv(MSG_MASTERNODE_WINNER, hash));
             nInvCount++;
         }
-        ++it;
     }
     node->PushMessage("ssc", MASTERNODE_SYNC_MNW, nInvCount);
 }
 
+void CMasternodePayments::WriteSections(CSectionFileWriter& fileout) const
+{
+    LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
+    fileout.AddSection(MNPAYMENTS_SECTION_VOTES) << mapMasternodePayeeVotes;
+    fileout.AddSection(MNPAYMENTS_SECTION_BLOCKS) << mapMasternodeBlocks;
+}
+
+void CMasternodePayments::ReadSections(const CSectionFileReader& filein)
+{
+    LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
+    filein.GetSection(MNPAYMENTS_SECTION_VOTES) >> mapMasternodePayeeVotes;
+    filein.GetSection(MNPAYMENTS_SECTION_BLOCKS) >> mapMasternodeBlocks;
+    RebuildVotesByHeight();
+}
+
 std::string CMasternodePayments::ToString() const
 {
     std::ostringstream info;
@@ -835,17 +872,10 @@ int CMasternodePayments::GetOldestBlock()
 {
     LOCK(cs_mapMasternodeBlocks);
 
-    int nOldestBlock = std::numeric_limits<int>::max();
-
-    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.begin();
-    while (it != mapMasternodeBlocks.end()) {
-        if ((*it).first < nOldestBlock) {
-            nOldestBlock = (*it).first;
-        }
-        it++;
-    }
+    if (mapMasternodeBlocks.empty())
+        return std::numeric_limits<int>::max();
 
-    return nOldestBlock;
+    return mapMasternodeBlocks.begin()->first;
 }
 
 
@@ -853,15 +883,8 @@ int CMasternodePayments::GetNewestBlock()
 {
     LOCK(cs_mapMasternodeBlocks);
 
-    int nNewestBlock = 0;
-
-    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.begin();
-    while (it != mapMasternodeBlocks.end()) {
-        if ((*it).first > nNewestBlock) {
-            nNewestBlock = (*it).first;
-        }
-        it++;
-    }
+    if (mapMasternodeBlocks.empty())
+        return 0;
 
-    return nNewestBlock;
+    return std::max(mapMasternodeBlocks.rbegin()->first, 0);
 }
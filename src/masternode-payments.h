@@ -22,6 +22,8 @@ extern CCriticalSection cs_mapMasternodePayeeVotes;
 class CMasternodePayments;
 class CMasternodePaymentWinner;
 class CMasternodeBlockPayees;
+class CSectionFileReader;
+class CSectionFileWriter;
 
 extern CMasternodePayments masternodePayments;
 
@@ -36,6 +38,12 @@ void FillBlockPayee(CMutableTransaction& txNew, CAmount nFees, bool fProofOfStak
 
 void DumpMasternodePayments();
 
+/** Sections of mnpayments.dat */
+enum MasternodePaymentsSection {
+    MNPAYMENTS_SECTION_VOTES = 1,
+    MNPAYMENTS_SECTION_BLOCKS = 2
+};
+
 /** Save Masternode Payment Data (mnpayments.dat)
  */
 class CMasternodePaymentDB
@@ -58,6 +66,9 @@ public:
     CMasternodePaymentDB();
     bool Write(const CMasternodePayments& objToSave);
     ReadResult Read(CMasternodePayments& objToLoad, bool fDryRun = false);
+
+private:
+    ReadResult Loaded(CMasternodePayments& objToLoad, int64_t nStart, bool fDryRun);
 };
 
 class CMasternodePayee
@@ -147,7 +158,8 @@ public:
         return false;
     }
 
-    bool IsTransactionValid(const CTransaction& txNew);
+    /** nMasternodes is the witness snapshot size the block value is computed from */
+    bool IsTransactionValid(const CTransaction& txNew, unsigned int nMasternodes);
     std::string GetRequiredPaymentsString();
 
     ADD_SERIALIZE_METHODS;
@@ -238,6 +250,12 @@ private:
     int nSyncedFromPeer;
     int nLastBlockHeight;
 
+    // hashes of mapMasternodePayeeVotes by block height, so that cleaning and
+    // syncing only visit the heights they need
+    std::map<int, std::vector<uint256> > mapPayeeVotesByHeight;
+
+    void RebuildVotesByHeight();
+
 public:
     std::map<uint256, CMasternodePaymentWinner> mapMasternodePayeeVotes;
     std::map<int, CMasternodeBlockPayees> mapMasternodeBlocks;
@@ -254,8 +272,13 @@ public:
         LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
         mapMasternodeBlocks.clear();
         mapMasternodePayeeVotes.clear();
+        mapPayeeVotesByHeight.clear();
     }
 
+    /// Store in / load from the sections of mnpayments.dat
+    void WriteSections(CSectionFileWriter& fileout) const;
+    void ReadSections(const CSectionFileReader& filein);
+
     bool AddWinningMasternode(CMasternodePaymentWinner& winner);
     bool ProcessBlock(int nBlockHeight);
 
@@ -297,6 +320,8 @@ public:
     {
         READWRITE(mapMasternodePayeeVotes);
         READWRITE(mapMasternodeBlocks);
+        if (ser_action.ForRead())
+            RebuildVotesByHeight();
     }
 };
 
@@ -66,7 +66,7 @@ public:
     bool VerifySignature(CPubKey& pubKeyMasternode, int &nDos);
     void Relay();
 
-    uint256 GetHash()
+    uint256 GetHash() const
     {
         CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
         ss << vin;
@@ -323,7 +323,7 @@ public:
         READWRITE(nLastDsq);
     }
 
-    uint256 GetHash()
+    uint256 GetHash() const
     {
         CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
         ss << sigTime;
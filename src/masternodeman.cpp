@@ -9,7 +9,9 @@
 #include "activemasternode.h"
 #include "addrman.h"
 #include "masternode.h"
+#include "master_node_witness_manager.h"
 #include "obfuscation.h"
+#include "sectionfile.h"
 #include "spork.h"
 #include "util.h"
 #include <boost/filesystem.hpp>
@@ -28,11 +30,14 @@ struct CompareLastPaid {
     }
 };
 
-struct CompareScoreTxIn {
+// Orders scores high to low, ties are broken by collateral so the order is total
+struct CompareScoreRank {
     bool operator()(const pair<int64_t, CTxIn>& t1,
         const pair<int64_t, CTxIn>& t2) const
     {
-        return t1.first < t2.first;
+        if (t1.first != t2.first)
+            return t1.first > t2.first;
+        return t1.second.prevout < t2.second.prevout;
     }
 };
 
@@ -58,28 +63,15 @@ bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
 {
     int64_t nStart = GetTimeMillis();
 
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssMasternodes(SER_DISK, CLIENT_VERSION);
-    ssMasternodes << strMagicMessage;                   // masternode cache file specific magic message
-    ssMasternodes << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssMasternodes << mnodemanToSave;
-    uint256 hash = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    ssMasternodes << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathMN.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathMN.string());
-
-    // Write and commit header, data
+    // serialize every section, each one gets its own checksum
+    CSectionFileWriter fileout(strMagicMessage);
     try {
-        fileout << ssMasternodes;
+        mnodemanToSave.WriteSections(fileout);
     } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+        return error("%s : Serialize error - %s", __func__, e.what());
     }
-    //    FileCommit(fileout);
-    fileout.fclose();
+    if (!fileout.Write(pathMN))
+        return false;
 
     LogPrint("masternode","Written info to mncache.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrint("masternode","  %s\n", mnodemanToSave.ToString());
@@ -90,7 +82,23 @@ bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
 CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bool fDryRun)
 {
     int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
+
+    CSectionFileReader fileSections;
+    CSectionFileReader::Result result = fileSections.Open(pathMN, strMagicMessage);
+    if (result != CSectionFileReader::Legacy) {
+        if (result != CSectionFileReader::Ok)
+            return SectionFileReadResult<CMasternodeDB>(result);
+        try {
+            mnodemanToLoad.ReadSections(fileSections);
+        } catch (std::exception& e) {
+            mnodemanToLoad.Clear();
+            error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            return IncorrectFormat;
+        }
+        return Loaded(mnodemanToLoad, nStart, fDryRun);
+    }
+
+    // import the older single checksum format, it is replaced on the next write
     FILE* file = fopen(pathMN.string().c_str(), "rb");
     CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
     if (filein.IsNull()) {
@@ -156,6 +164,11 @@ CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bo
         return IncorrectFormat;
     }
 
+    return Loaded(mnodemanToLoad, nStart, fDryRun);
+}
+
+CMasternodeDB::ReadResult CMasternodeDB::Loaded(CMasternodeMan& mnodemanToLoad, int64_t nStart, bool fDryRun)
+{
     LogPrint("masternode","Loaded info from mncache.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrint("masternode","  %s\n", mnodemanToLoad.ToString());
     if (!fDryRun) {
@@ -195,11 +208,34 @@ void DumpMasternodes()
     LogPrint("masternode","Masternode dump finished  %dms\n", GetTimeMillis() - nStart);
 }
 
-CMasternodeMan::CMasternodeMan()
+CMasternodeMan::CMasternodeMan() : mapSeenMasternodeBroadcast(MAX_SEEN_MASTERNODE_BROADCASTS),
+                                   mapSeenMasternodePing(MAX_SEEN_MASTERNODE_PINGS)
 {
     nDsqCount = 0;
 }
 
+void CMasternodeMan::WriteSections(CSectionFileWriter& fileout) const
+{
+    LOCK(cs);
+    std::vector<CMasternode> vMasternodes(listMasternodes.begin(), listMasternodes.end());
+    fileout.AddSection(MNCACHE_SECTION_MASTERNODES) << vMasternodes << mAskedUsForMasternodeList
+        << mWeAskedForMasternodeList << mWeAskedForMasternodeListEntry << nDsqCount;
+    fileout.AddSection(MNCACHE_SECTION_SEEN_BROADCASTS) << mapSeenMasternodeBroadcast;
+    fileout.AddSection(MNCACHE_SECTION_SEEN_PINGS) << mapSeenMasternodePing;
+}
+
+void CMasternodeMan::ReadSections(const CSectionFileReader& filein)
+{
+    LOCK(cs);
+    std::vector<CMasternode> vMasternodes;
+    filein.GetSection(MNCACHE_SECTION_MASTERNODES) >> vMasternodes >> mAskedUsForMasternodeList
+        >> mWeAskedForMasternodeList >> mWeAskedForMasternodeListEntry >> nDsqCount;
+    listMasternodes.assign(vMasternodes.begin(), vMasternodes.end());
+    RebuildIndexes();
+    mapSeenMasternodeBroadcast.SetPending(filein.GetSection(MNCACHE_SECTION_SEEN_BROADCASTS));
+    mapSeenMasternodePing.SetPending(filein.GetSection(MNCACHE_SECTION_SEEN_PINGS));
+}
+
 bool CMasternodeMan::Add(CMasternode& mn)
 {
     LOCK(cs);
@@ -210,13 +246,81 @@ bool CMasternodeMan::Add(CMasternode& mn)
     CMasternode* pmn = Find(mn.vin);
     if (pmn == NULL) {
         LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.vin.prevout.hash.ToString(), size() + 1);
-        vMasternodes.push_back(mn);
+        listMasternodes.push_back(mn);
+        IndexMasternode(listMasternodes.back());
         return true;
     }
 
     return false;
 }
 
+bool CMasternodeMan::AddSeenBroadcast(const CMasternodeBroadcast& mnb, bool fChecked)
+{
+    LOCK(cs);
+    if (!mapSeenMasternodeBroadcast.insert(make_pair(mnb.GetHash(), mnb), fChecked)) {
+        // known, but it may only pass its checks now
+        if (fChecked && mapSeenMasternodeBroadcast.check(mnb.GetHash()) && pMNWitness)
+            pMNWitness->NotifyBroadcast(mapSeenMasternodeBroadcast.find(mnb.GetHash())->second);
+        return false;
+    }
+    if (fChecked && pMNWitness) pMNWitness->NotifyBroadcast(mnb);
+
+    // unchecked broadcasts go first, so that a flood of invalid ones can't push out valid ones
+    uint256 hash;
+    CMasternodeBroadcast mnbOldest;
+    while (mapSeenMasternodeBroadcast.full() && mapSeenMasternodeBroadcast.pop_unchecked(hash, mnbOldest)) {
+        LogPrint("masternode", "CMasternodeMan::AddSeenBroadcast - Too many broadcasts, forgetting unchecked %s\n", hash.ToString());
+        masternodeSync.mapSeenSyncMNB.erase(hash);
+    }
+    while (mapSeenMasternodeBroadcast.full() && mapSeenMasternodeBroadcast.pop_oldest(std::numeric_limits<int64_t>::max(), hash, mnbOldest)) {
+        LogPrint("masternode", "CMasternodeMan::AddSeenBroadcast - Too many broadcasts, forgetting %s\n", hash.ToString());
+        masternodeSync.mapSeenSyncMNB.erase(hash);
+        if (pMNWitness) pMNWitness->NotifyBroadcastRemoved(mnbOldest);
+    }
+    return true;
+}
+
+bool CMasternodeMan::AddSeenPing(const CMasternodePing& mnp, bool fChecked)
+{
+    LOCK(cs);
+    if (!mapSeenMasternodePing.insert(make_pair(mnp.GetHash(), mnp), fChecked)) {
+        if (fChecked && mapSeenMasternodePing.check(mnp.GetHash()) && pMNWitness)
+            pMNWitness->NotifyPing(mapSeenMasternodePing.find(mnp.GetHash())->second);
+        return false;
+    }
+    if (fChecked && pMNWitness) pMNWitness->NotifyPing(mnp);
+
+    uint256 hash;
+    CMasternodePing mnpOldest;
+    while (mapSeenMasternodePing.full() && mapSeenMasternodePing.pop_unchecked(hash, mnpOldest))
+        LogPrint("masternode", "CMasternodeMan::AddSeenPing - Too many pings, forgetting unchecked %s\n", hash.ToString());
+    while (mapSeenMasternodePing.full() && mapSeenMasternodePing.pop_oldest(std::numeric_limits<int64_t>::max(), hash, mnpOldest))
+        LogPrint("masternode", "CMasternodeMan::AddSeenPing - Too many pings, forgetting %s\n", hash.ToString());
+    return true;
+}
+
+void CMasternodeMan::RemoveSeenBroadcast(const uint256& hash)
+{
+    LOCK(cs);
+    CSeenMasternodeMap<CMasternodeBroadcast>::const_iterator it = mapSeenMasternodeBroadcast.find(hash);
+    if (it != mapSeenMasternodeBroadcast.end()) {
+        if (pMNWitness) pMNWitness->NotifyBroadcastRemoved(it->second);
+        mapSeenMasternodeBroadcast.erase(hash);
+    }
+    masternodeSync.mapSeenSyncMNB.erase(hash);
+}
+
+void CMasternodeMan::UpdateSeenBroadcastPing(const uint256& hash, const CMasternodePing& mnp)
+{
+    LOCK(cs);
+    CSeenMasternodeMap<CMasternodeBroadcast>::const_iterator it = mapSeenMasternodeBroadcast.find(hash);
+    if (it == mapSeenMasternodeBroadcast.end())
+        return;
+    CMasternodeBroadcast mnb = it->second;
+    mnb.lastPing = mnp;
+    mapSeenMasternodeBroadcast.update(it, mnb);
+}
+
 void CMasternodeMan::AskForMN(CNode* pnode, CTxIn& vin)
 {
     std::map<COutPoint, int64_t>::iterator i = mWeAskedForMasternodeListEntry.find(vin.prevout);
@@ -237,7 +341,7 @@ void CMasternodeMan::Check()
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
     }
 }
@@ -249,8 +353,8 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     LOCK(cs);
 
     //remove inactive and outdated
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
+    std::list<CMasternode>::iterator it = listMasternodes.begin();
+    while (it != listMasternodes.end()) {
         if ((*it).activeState == CMasternode::MASTERNODE_REMOVE ||
             (*it).activeState == CMasternode::MASTERNODE_VIN_SPENT ||
             (forceExpiredRemoval && (*it).activeState == CMasternode::MASTERNODE_EXPIRED) ||
@@ -260,27 +364,14 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
             //erase all of the broadcasts we've seen from this vin
             // -- if we missed a few pings and the node was removed, this will allow is to get it back without them
             //    sending a brand new mnb
-            map<uint256, CMasternodeBroadcast>::iterator it3 = mapSeenMasternodeBroadcast.begin();
-            while (it3 != mapSeenMasternodeBroadcast.end()) {
-                if ((*it3).second.vin == (*it).vin) {
-                    masternodeSync.mapSeenSyncMNB.erase((*it3).first);
-                    mapSeenMasternodeBroadcast.erase(it3++);
-                } else {
-                    ++it3;
-                }
-            }
+            BOOST_FOREACH (const uint256& hash, mapSeenMasternodeBroadcast.find_by_outpoint((*it).vin.prevout))
+                RemoveSeenBroadcast(hash);
 
             // allow us to ask for this masternode again if we see another ping
-            map<COutPoint, int64_t>::iterator it2 = mWeAskedForMasternodeListEntry.begin();
-            while (it2 != mWeAskedForMasternodeListEntry.end()) {
-                if ((*it2).first == (*it).vin.prevout) {
-                    mWeAskedForMasternodeListEntry.erase(it2++);
-                } else {
-                    ++it2;
-                }
-            }
+            mWeAskedForMasternodeListEntry.erase((*it).vin.prevout);
 
-            it = vMasternodes.erase(it);
+            UnindexMasternode(*it);
+            it = listMasternodes.erase(it);
         } else {
             ++it;
         }
@@ -316,38 +407,40 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
         }
     }
 
-    // remove expired mapSeenMasternodeBroadcast
-    map<uint256, CMasternodeBroadcast>::iterator it3 = mapSeenMasternodeBroadcast.begin();
-    while (it3 != mapSeenMasternodeBroadcast.end()) {
-        if ((*it3).second.lastPing.sigTime < GetTime() - (MASTERNODE_REMOVAL_SECONDS * 2)) {
-            mapSeenMasternodeBroadcast.erase(it3++);
-            masternodeSync.mapSeenSyncMNB.erase((*it3).second.GetHash());
-        } else {
-            ++it3;
-        }
+    // remove expired mapSeenMasternodeBroadcast, oldest first
+    int64_t nExpireBefore = GetTime() - (MASTERNODE_REMOVAL_SECONDS * 2);
+    uint256 hash;
+    CMasternodeBroadcast mnb;
+    while (mapSeenMasternodeBroadcast.pop_oldest(nExpireBefore, hash, mnb)) {
+        if (pMNWitness) pMNWitness->NotifyBroadcastRemoved(mnb);
+        masternodeSync.mapSeenSyncMNB.erase(hash);
     }
 
     // remove expired mapSeenMasternodePing
-    map<uint256, CMasternodePing>::iterator it4 = mapSeenMasternodePing.begin();
-    while (it4 != mapSeenMasternodePing.end()) {
-        if ((*it4).second.sigTime < GetTime() - (MASTERNODE_REMOVAL_SECONDS * 2)) {
-            mapSeenMasternodePing.erase(it4++);
-        } else {
-            ++it4;
-        }
-    }
+    CMasternodePing mnp;
+    int nExpiredPings = 0;
+    while (mapSeenMasternodePing.pop_oldest(nExpireBefore, hash, mnp))
+        nExpiredPings++;
+    if (nExpiredPings)
+        LogPrint("masternode", "CMasternodeMan::CheckAndRemove - Removed %d expired pings\n", nExpiredPings);
 }
 
 void CMasternodeMan::Clear()
 {
     LOCK(cs);
-    vMasternodes.clear();
+    listMasternodes.clear();
+    mapMasternodesByVin.clear();
+    mapMasternodesByPayee.clear();
+    mapMasternodesByPubKey.clear();
+    mapIndexedKeys.clear();
+    mapRankTables.clear();
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
     mapSeenMasternodeBroadcast.clear();
     mapSeenMasternodePing.clear();
     nDsqCount = 0;
+    if (pMNWitness) pMNWitness->ResetSnapshot();
 }
 
 int CMasternodeMan::stable_size ()
@@ -357,7 +450,7 @@ int CMasternodeMan::stable_size ()
     int64_t nMasternode_Min_Age = MN_WINNER_MINIMUM_AGE;
     int64_t nMasternode_Age = 0;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         if (mn.protocolVersion < nMinProtocol) {
             continue; // Skip obsolete versions
         }
@@ -382,7 +475,7 @@ int CMasternodeMan::CountEnabled(int protocolVersion)
     int i = 0;
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         i++;
@@ -395,7 +488,7 @@ void CMasternodeMan::CountNetworks(int protocolVersion, int& ipv4, int& ipv6, in
 {
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         std::string strHost;
         int port;
@@ -432,33 +525,130 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
         }
     }
 
-    pnode->PushMessage("dseg", CTxIn());
+    // peers that understand it only announce the broadcasts we don't hold yet
+    if (pnode->nVersion >= MNLIST_FILTER_VERSION && !mapSeenMasternodeBroadcast.empty())
+        pnode->PushMessage("dseg", CTxIn(), GetKnownBroadcastsFilter());
+    else
+        pnode->PushMessage("dseg", CTxIn());
     int64_t askAgain = GetTime() + MASTERNODES_DSEG_SECONDS;
     mWeAskedForMasternodeList[pnode->addr] = askAgain;
 }
 
-CMasternode* CMasternodeMan::Find(const CScript& payee)
+CBloomFilter CMasternodeMan::GetKnownBroadcastsFilter()
 {
     LOCK(cs);
-    CScript payee2;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        payee2 = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
-        if (payee2 == payee)
-            return &mn;
+    // a fresh tweak per request, so different peers miss different false positives
+    CBloomFilter filter(std::max<unsigned int>(mapSeenMasternodeBroadcast.size(), 1), MASTERNODES_DSEG_FILTER_FP_RATE,
+        GetRand(std::numeric_limits<unsigned int>::max()), BLOOM_UPDATE_NONE);
+    for (CSeenMasternodeMap<CMasternodeBroadcast>::const_iterator it = mapSeenMasternodeBroadcast.begin(); it != mapSeenMasternodeBroadcast.end(); ++it)
+        filter.insert(it->first);
+    return filter;
+}
+
+bool CMasternodeMan::ReadDsegFilter(CDataStream& vRecv, CBloomFilter& filter)
+{
+    vRecv >> filter;
+    if (!filter.IsWithinSizeConstraints())
+        return false;
+    // a deserialized filter starts out matching everything
+    filter.UpdateEmptyFull();
+    return true;
+}
+
+int CMasternodeMan::GetDsegInventory(const CTxIn& vin, const CBloomFilter* pfilter, std::vector<CInv>& vInvRet)
+{
+    LOCK(cs);
+
+    int nCount = 0;
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
+        if (mn.addr.IsRFC1918()) continue; //local network
+        if (!mn.IsEnabled()) continue;
+        if (vin != CTxIn() && vin != mn.vin) continue;
+
+        CMasternodeBroadcast mnb = CMasternodeBroadcast(mn);
+        uint256 hash = mnb.GetHash();
+        nCount++;
+        if (pfilter && pfilter->contains(hash)) continue;
+
+        LogPrint("masternode", "dseg - Sending Masternode entry - %s \n", mn.vin.prevout.hash.ToString());
+        vInvRet.push_back(CInv(MSG_MASTERNODE_ANNOUNCE, hash));
+        AddSeenBroadcast(mnb);
+
+        if (vin == mn.vin) break;
     }
-    return NULL;
+    return nCount;
+}
+
+void CMasternodeMan::IndexMasternode(CMasternode& mn)
+{
+    mapRankTables.clear();
+    CScript payee = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
+    mapMasternodesByVin[mn.vin.prevout] = &mn;
+    mapMasternodesByPayee.insert(std::make_pair(payee, &mn));
+    mapMasternodesByPubKey.insert(std::make_pair(mn.pubKeyMasternode, &mn));
+    mapIndexedKeys[&mn] = std::make_pair(payee, mn.pubKeyMasternode);
+}
+
+void CMasternodeMan::UnindexMasternode(CMasternode& mn)
+{
+    mapRankTables.clear();
+    std::map<COutPoint, CMasternode*>::iterator itVin = mapMasternodesByVin.find(mn.vin.prevout);
+    if (itVin != mapMasternodesByVin.end() && itVin->second == &mn)
+        mapMasternodesByVin.erase(itVin);
+
+    std::map<const CMasternode*, std::pair<CScript, CPubKey> >::iterator itKeys = mapIndexedKeys.find(&mn);
+    if (itKeys == mapIndexedKeys.end())
+        return;
+
+    std::pair<std::multimap<CScript, CMasternode*>::iterator, std::multimap<CScript, CMasternode*>::iterator> rangePayee = mapMasternodesByPayee.equal_range(itKeys->second.first);
+    for (std::multimap<CScript, CMasternode*>::iterator it = rangePayee.first; it != rangePayee.second; ++it) {
+        if (it->second == &mn) {
+            mapMasternodesByPayee.erase(it);
+            break;
+        }
+    }
+    std::pair<std::multimap<CPubKey, CMasternode*>::iterator, std::multimap<CPubKey, CMasternode*>::iterator> rangePubKey = mapMasternodesByPubKey.equal_range(itKeys->second.second);
+    for (std::multimap<CPubKey, CMasternode*>::iterator it = rangePubKey.first; it != rangePubKey.second; ++it) {
+        if (it->second == &mn) {
+            mapMasternodesByPubKey.erase(it);
+            break;
+        }
+    }
+    mapIndexedKeys.erase(itKeys);
+}
+
+void CMasternodeMan::RebuildIndexes()
+{
+    mapMasternodesByVin.clear();
+    mapMasternodesByPayee.clear();
+    mapMasternodesByPubKey.clear();
+    mapIndexedKeys.clear();
+    BOOST_FOREACH (CMasternode& mn, listMasternodes)
+        IndexMasternode(mn);
+}
+
+void CMasternodeMan::ReindexMasternode(CMasternode* pmn)
+{
+    LOCK(cs);
+    UnindexMasternode(*pmn);
+    IndexMasternode(*pmn);
+}
+
+CMasternode* CMasternodeMan::Find(const CScript& payee)
+{
+    LOCK(cs);
+
+    std::multimap<CScript, CMasternode*>::iterator it = mapMasternodesByPayee.find(payee);
+    return it != mapMasternodesByPayee.end() ? it->second : NULL;
 }
 
 CMasternode* CMasternodeMan::Find(const CTxIn& vin)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.vin.prevout == vin.prevout)
-            return &mn;
-    }
-    return NULL;
+    std::map<COutPoint, CMasternode*>::iterator it = mapMasternodesByVin.find(vin.prevout);
+    return it != mapMasternodesByVin.end() ? it->second : NULL;
 }
 
 
@@ -466,11 +656,8 @@ CMasternode* CMasternodeMan::Find(const CPubKey& pubKeyMasternode)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.pubKeyMasternode == pubKeyMasternode)
-            return &mn;
-    }
-    return NULL;
+    std::multimap<CPubKey, CMasternode*>::iterator it = mapMasternodesByPubKey.find(pubKeyMasternode);
+    return it != mapMasternodesByPubKey.end() ? it->second : NULL;
 }
 
 //
@@ -488,7 +675,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     */
 
     int nMnCount = CountEnabled();
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (!mn.IsEnabled()) continue;
 
@@ -551,7 +738,7 @@ CMasternode* CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn>& vecToExclude
     LogPrint("masternode", "CMasternodeMan::FindRandomNotInVec - rand %d\n", rand);
     bool found;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         found = false;
         BOOST_FOREACH (CTxIn& usedVin, vecToExclude) {
@@ -575,7 +762,7 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
     CMasternode* winner = NULL;
 
     // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
 
@@ -593,24 +780,34 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
     return winner;
 }
 
-int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+CMasternodeMan::CRankTable* CMasternodeMan::GetRankTable(int64_t nBlockHeight, int minProtocol, bool fOnlyActive, bool fMinAge)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
-    int64_t nMasternode_Min_Age = MN_WINNER_MINIMUM_AGE;
-    int64_t nMasternode_Age = 0;
-
     //make sure we know about this block
     uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return -1;
+    if (!GetBlockHash(hash, nBlockHeight)) return NULL;
+
+    // Scores only change with the block, the list or the masternode states. States are
+    // re-evaluated every MASTERNODE_CHECK_SECONDS, so a table is only kept that long.
+    std::tuple<int64_t, int, bool, bool> key(nBlockHeight, minProtocol, fOnlyActive, fMinAge);
+    std::map<std::tuple<int64_t, int, bool, bool>, CRankTable>::iterator it = mapRankTables.find(key);
+    if (it != mapRankTables.end()) {
+        if (it->second.hashBlock == hash && GetTime() - it->second.nTimeCreated < MASTERNODE_CHECK_SECONDS)
+            return &it->second;
+        mapRankTables.erase(it);
+    }
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    int64_t nMasternode_Min_Age = MN_WINNER_MINIMUM_AGE;
+    int64_t nMasternode_Age = 0;
+
+    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    vecMasternodeScores.reserve(listMasternodes.size());
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         if (mn.protocolVersion < minProtocol) {
             LogPrint("masternode","Skipping Masternode with obsolete version %d\n", mn.protocolVersion);
             continue;                                                       // Skip obsolete versions
         }
 
-        if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
+        if (fMinAge && IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
             nMasternode_Age = GetAdjustedTime() - mn.sigTime;
             if ((nMasternode_Age) < nMasternode_Min_Age) {
                 if (fDebug) LogPrint("masternode","Skipping just activated Masternode. Age: %ld\n", nMasternode_Age);
@@ -627,17 +824,38 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
         vecMasternodeScores.push_back(make_pair(n2, mn.vin));
     }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
+    if (mapRankTables.size() >= MAX_RANK_TABLES)
+        mapRankTables.clear();
+    CRankTable& table = mapRankTables[key];
+    table.hashBlock = hash;
+    table.nTimeCreated = GetTime();
+    table.vecScores.swap(vecMasternodeScores);
+    return &table;
+}
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
-        rank++;
-        if (s.second.prevout == vin.prevout) {
-            return rank;
-        }
+int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+{
+    LOCK(cs);
+
+    CRankTable* ptable = GetRankTable(nBlockHeight, minProtocol, fOnlyActive, true);
+    if (!ptable) return -1;
+
+    const std::vector<pair<int64_t, CTxIn> >& vecScores = ptable->vecScores;
+    std::vector<pair<int64_t, CTxIn> >::const_iterator itEntry = vecScores.begin();
+    while (itEntry != vecScores.end() && itEntry->second.prevout != vin.prevout)
+        ++itEntry;
+    if (itEntry == vecScores.end())
+        return -1;
+
+    // the rank is one more than the number of masternodes scoring ahead, no need to sort
+    CompareScoreRank compare;
+    int rank = 1;
+    BOOST_FOREACH (const PAIRTYPE(int64_t, CTxIn) & s, vecScores) {
+        if (compare(s, *itEntry))
+            rank++;
     }
 
-    return -1;
+    return rank;
 }
 
 std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
@@ -650,7 +868,7 @@ std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t
     if (!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
 
     // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
 
         if (mn.protocolVersion < minProtocol) continue;
@@ -679,33 +897,17 @@ std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t
 
 CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
-
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.protocolVersion < minProtocol) continue;
-        if (fOnlyActive) {
-            mn.Check();
-            if (!mn.IsEnabled()) continue;
-        }
-
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
+    LOCK(cs);
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
+    // unlike GetMasternodeRank, masternodes younger than MN_WINNER_MINIMUM_AGE are ranked too
+    CRankTable* ptable = GetRankTable(nBlockHeight, minProtocol, fOnlyActive, false);
+    if (!ptable || nRank < 1 || nRank > (int)ptable->vecScores.size()) return NULL;
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
-        rank++;
-        if (rank == nRank) {
-            return Find(s.second);
-        }
-    }
+    // only the entry at nRank has to be in place
+    std::vector<pair<int64_t, CTxIn> >& vecScores = ptable->vecScores;
+    std::nth_element(vecScores.begin(), vecScores.begin() + (nRank - 1), vecScores.end(), CompareScoreRank());
 
-    return NULL;
+    return Find(vecScores[nRank - 1].second);
 }
 
 void CMasternodeMan::ProcessMasternodeConnections()
@@ -739,7 +941,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             masternodeSync.AddedMasternodeList(mnb.GetHash());
             return;
         }
-        mapSeenMasternodeBroadcast.insert(make_pair(mnb.GetHash(), mnb));
+        AddSeenBroadcast(mnb, false);
 
         int nDoS = 0;
         if (!mnb.CheckAndUpdate(nDoS)) {
@@ -757,6 +959,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             Misbehaving(pfrom->GetId(), 33);
             return;
         }
+        AddSeenBroadcast(mnb);
 
         // make sure it's still unspent
         //  - this is checked later by .check() in many places and by ThreadCheckObfuScationPool()
@@ -779,10 +982,13 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         LogPrint("masternode", "mnp - Masternode ping, vin: %s\n", mnp.vin.prevout.hash.ToString());
 
         if (mapSeenMasternodePing.count(mnp.GetHash())) return; //seen
-        mapSeenMasternodePing.insert(make_pair(mnp.GetHash(), mnp));
+        AddSeenPing(mnp, false);
 
         int nDoS = 0;
-        if (mnp.CheckAndUpdate(nDoS)) return;
+        if (mnp.CheckAndUpdate(nDoS)) {
+            AddSeenPing(mnp);
+            return;
+        }
 
         if (nDoS > 0) {
             // if anything significant failed, mark that node
@@ -803,6 +1009,18 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         CTxIn vin;
         vRecv >> vin;
 
+        // a list request may carry a filter of the broadcasts the peer already holds
+        CBloomFilter filter;
+        bool fFilter = false;
+        if (vin == CTxIn() && !vRecv.empty()) {
+            if (!ReadDsegFilter(vRecv, filter)) {
+                LogPrintf("CMasternodeMan::ProcessMessage() : dseg - filter too large\n");
+                Misbehaving(pfrom->GetId(), 100);
+                return;
+            }
+            fFilter = true;
+        }
+
         if (vin == CTxIn()) { //only should ask for this once
             //local network
             bool isLocal = (pfrom->addr.IsRFC1918() || pfrom->addr.IsLocal());
@@ -823,32 +1041,17 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         } //else, asking for a specific node which is ok
 
 
-        int nInvCount = 0;
-
-        BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-            if (mn.addr.IsRFC1918()) continue; //local network
-
-            if (mn.IsEnabled()) {
-                LogPrint("masternode", "dseg - Sending Masternode entry - %s \n", mn.vin.prevout.hash.ToString());
-                if (vin == CTxIn() || vin == mn.vin) {
-                    CMasternodeBroadcast mnb = CMasternodeBroadcast(mn);
-                    uint256 hash = mnb.GetHash();
-                    pfrom->PushInventory(CInv(MSG_MASTERNODE_ANNOUNCE, hash));
-                    nInvCount++;
-
-                    if (!mapSeenMasternodeBroadcast.count(hash)) mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb));
-
-                    if (vin == mn.vin) {
-                        LogPrint("masternode", "dseg - Sent 1 Masternode entry to peer %i\n", pfrom->GetId());
-                        return;
-                    }
-                }
-            }
-        }
+        std::vector<CInv> vInv;
+        int nCount = GetDsegInventory(vin, fFilter ? &filter : NULL, vInv);
+        BOOST_FOREACH (const CInv& inv, vInv)
+            pfrom->PushInventory(inv);
 
         if (vin == CTxIn()) {
-            pfrom->PushMessage("ssc", MASTERNODE_SYNC_LIST, nInvCount);
-            LogPrint("masternode", "dseg - Sent %d Masternode entries to peer %i\n", nInvCount, pfrom->GetId());
+            // the count covers the entries the peer already had, it is how far the peer's list is complete
+            pfrom->PushMessage("ssc", MASTERNODE_SYNC_LIST, nCount);
+            LogPrint("masternode", "dseg - Sent %d of %d Masternode entries to peer %i\n", vInv.size(), nCount, pfrom->GetId());
+        } else if (!vInv.empty()) {
+            LogPrint("masternode", "dseg - Sent 1 Masternode entry to peer %i\n", pfrom->GetId());
         }
     }
     /*
@@ -950,6 +1153,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                         pmn->addr = addr;
                         //fake ping
                         pmn->lastPing = CMasternodePing(vin);
+                        ReindexMasternode(pmn);
                     }
                     pmn->nLastDsee = sigTime;
                     pmn->Check();
@@ -1137,11 +1341,12 @@ void CMasternodeMan::Remove(CTxIn vin)
 {
     LOCK(cs);
 
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
+    std::list<CMasternode>::iterator it = listMasternodes.begin();
+    while (it != listMasternodes.end()) {
         if ((*it).vin == vin) {
             LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
-            vMasternodes.erase(it);
+            UnindexMasternode(*it);
+            listMasternodes.erase(it);
             break;
         }
         ++it;
@@ -1150,8 +1355,8 @@ void CMasternodeMan::Remove(CTxIn vin)
 
 void CMasternodeMan::UpdateMasternodeList(CMasternodeBroadcast mnb)
 {
-	mapSeenMasternodePing.insert(make_pair(mnb.lastPing.GetHash(), mnb.lastPing));
-	mapSeenMasternodeBroadcast.insert(make_pair(mnb.GetHash(), mnb));
+	AddSeenPing(mnb.lastPing);
+	AddSeenBroadcast(mnb);
 	masternodeSync.AddedMasternodeList(mnb.GetHash());
 
     LogPrint("masternode","CMasternodeMan::UpdateMasternodeList() -- masternode=%s\n", mnb.vin.prevout.ToString());
@@ -1160,8 +1365,8 @@ void CMasternodeMan::UpdateMasternodeList(CMasternodeBroadcast mnb)
     if (pmn == NULL) {
         CMasternode mn(mnb);
         Add(mn);
-    } else {
-    	pmn->UpdateFromNewBroadcast(mnb);
+    } else if (pmn->UpdateFromNewBroadcast(mnb)) {
+        ReindexMasternode(pmn);
     }
 }
 
@@ -1169,7 +1374,7 @@ std::string CMasternodeMan::ToString() const
 {
     std::ostringstream info;
 
-    info << "Masternodes: " << (int)vMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() << ", nDsqCount: " << (int)nDsqCount;
+    info << "Masternodes: " << (int)listMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() << ", nDsqCount: " << (int)nDsqCount;
 
     return info.str();
 }
@@ -9,6 +9,7 @@
 #define MASTERNODEMAN_H
 
 #include "base58.h"
+#include "bloom.h"
 #include "key.h"
 #include "main.h"
 #include "masternode.h"
@@ -16,16 +17,34 @@
 #include "sync.h"
 #include "util.h"
 
+#include <atomic>
+#include <set>
+#include <tuple>
+
 #define MASTERNODES_DUMP_SECONDS (15 * 60)
 #define MASTERNODES_DSEG_SECONDS (3 * 60 * 60)
+/** False positive rate of the filter of known broadcasts sent with a list request */
+#define MASTERNODES_DSEG_FILTER_FP_RATE 0.001
+#define MAX_RANK_TABLES 64
+#define MAX_SEEN_MASTERNODE_BROADCASTS 20000
+#define MAX_SEEN_MASTERNODE_PINGS 200000
 
 using namespace std;
 
 class CMasternodeMan;
+class CSectionFileReader;
+class CSectionFileWriter;
 
 extern CMasternodeMan mnodeman;
 void DumpMasternodes();
 
+/** Sections of mncache.dat */
+enum MasternodeCacheSection {
+    MNCACHE_SECTION_MASTERNODES = 1,
+    MNCACHE_SECTION_SEEN_BROADCASTS = 2,
+    MNCACHE_SECTION_SEEN_PINGS = 3
+};
+
 /** Access to the MN database (mncache.dat)
  */
 class CMasternodeDB
@@ -48,19 +67,261 @@ public:
     CMasternodeDB();
     bool Write(const CMasternodeMan& mnodemanToSave);
     ReadResult Read(CMasternodeMan& mnodemanToLoad, bool fDryRun = false);
+
+private:
+    ReadResult Loaded(CMasternodeMan& mnodemanToLoad, int64_t nStart, bool fDryRun);
 };
 
-class CMasternodeMan
+/** Time a seen message expires from */
+inline int64_t GetSeenTime(const CMasternodePing& mnp) { return mnp.sigTime; }
+inline int64_t GetSeenTime(const CMasternodeBroadcast& mnb) { return mnb.lastPing.sigTime; }
+
+/** STL-like map of seen masternode messages by hash, also ordered by the time
+ *  they expire from so that expiry only touches the expired entries, and by
+ *  masternode collateral so that a removed masternode's entries are found directly.
+ *
+ *  Entries can be inserted unchecked, to recognize a message once seen before
+ *  it passed its checks. Unchecked entries are evicted first when the map is
+ *  full and are not written to disk.
+ *
+ *  Entries read from mncache.dat can be left serialized until the map is first
+ *  used, see SetPending. */
+template <typename T>
+class CSeenMasternodeMap
 {
+public:
+    typedef std::pair<const uint256, T> value_type;
+    typedef typename std::map<uint256, T>::const_iterator const_iterator;
+    typedef typename std::map<uint256, T>::size_type size_type;
+
 private:
-    // critical section to protect the inner data structures
+    // mutable so that const accessors can read pending entries first
+    mutable std::map<uint256, T> map;
+    mutable std::set<std::pair<int64_t, uint256> > setByTime;
+    mutable std::set<std::pair<COutPoint, uint256> > setByOutpoint;
+    std::set<std::pair<int64_t, uint256> > setUnchecked;
+    size_type nMaxSize;
+
+    mutable CCriticalSection cs_pending;
+    mutable std::atomic<bool> fPending;
+    mutable std::vector<char> vchPending;
+    mutable int nPendingVersion;
+
+    void Reindex() const
+    {
+        setByTime.clear();
+        setByOutpoint.clear();
+        for (const_iterator it = map.begin(); it != map.end(); ++it)
+            setByTime.insert(std::make_pair(GetSeenTime(it->second), it->first));
+        // an older cache may hold more than we keep now
+        while (map.size() > nMaxSize) {
+            map.erase(setByTime.begin()->second);
+            setByTime.erase(setByTime.begin());
+        }
+        for (const_iterator it = map.begin(); it != map.end(); ++it)
+            setByOutpoint.insert(std::make_pair(it->second.vin.prevout, it->first));
+    }
+
+    void Load() const
+    {
+        if (!fPending)
+            return;
+        LOCK(cs_pending);
+        if (!fPending)
+            return;
+        CMemoryReader ss(vchPending.data(), vchPending.data() + vchPending.size(), SER_DISK, nPendingVersion);
+        try {
+            ss >> map;
+        } catch (std::exception& e) {
+            // the section checksum was verified when the file was read
+            LogPrintf("CSeenMasternodeMap::Load() : Deserialize error - %s\n", e.what());
+            map.clear();
+        }
+        Reindex();
+        std::vector<char>().swap(vchPending);
+        fPending = false;
+    }
+
+public:
+    CSeenMasternodeMap(size_type nMaxSizeIn) : nMaxSize(nMaxSizeIn), fPending(false), nPendingVersion(0) {}
+    const_iterator begin() const { Load(); return map.begin(); }
+    const_iterator end() const { Load(); return map.end(); }
+    size_type size() const { Load(); return map.size(); }
+    bool empty() const { Load(); return map.empty(); }
+    const_iterator find(const uint256& hash) const { Load(); return map.find(hash); }
+    size_type count(const uint256& hash) const { Load(); return map.count(hash); }
+    size_type max_size() const { return nMaxSize; }
+    bool full() const { Load(); return map.size() > nMaxSize; }
+    bool pending() const { return fPending; }
+
+    /** Returns false if the hash was already known. May leave the map over its
+     *  limit, the owner takes out entries with pop_unchecked and pop_oldest. */
+    bool insert(const value_type& x, bool fChecked = true)
+    {
+        Load();
+        if (!map.insert(x).second)
+            return false;
+        setByTime.insert(std::make_pair(GetSeenTime(x.second), x.first));
+        setByOutpoint.insert(std::make_pair(x.second.vin.prevout, x.first));
+        if (!fChecked)
+            setUnchecked.insert(std::make_pair(GetSeenTime(x.second), x.first));
+        return true;
+    }
+    bool erase(const uint256& hash)
+    {
+        Load();
+        typename std::map<uint256, T>::iterator it = map.find(hash);
+        if (it == map.end())
+            return false;
+        setByTime.erase(std::make_pair(GetSeenTime(it->second), hash));
+        setByOutpoint.erase(std::make_pair(it->second.vin.prevout, hash));
+        setUnchecked.erase(std::make_pair(GetSeenTime(it->second), hash));
+        map.erase(it);
+        return true;
+    }
+    void update(const_iterator itIn, const T& v)
+    {
+        typename std::map<uint256, T>::iterator it = map.find(itIn->first);
+        if (it == map.end())
+            return;
+        setByTime.erase(std::make_pair(GetSeenTime(it->second), it->first));
+        if (setUnchecked.erase(std::make_pair(GetSeenTime(it->second), it->first)))
+            setUnchecked.insert(std::make_pair(GetSeenTime(v), it->first));
+        setByOutpoint.erase(std::make_pair(it->second.vin.prevout, it->first));
+        it->second = v;
+        setByTime.insert(std::make_pair(GetSeenTime(v), it->first));
+        setByOutpoint.insert(std::make_pair(v.vin.prevout, it->first));
+    }
+    void clear()
+    {
+        LOCK(cs_pending);
+        map.clear();
+        setByTime.clear();
+        setByOutpoint.clear();
+        setUnchecked.clear();
+        std::vector<char>().swap(vchPending);
+        fPending = false;
+    }
+
+    /** Whether the entry passed its checks, false if it is unknown */
+    bool checked(const uint256& hash) const
+    {
+        const_iterator it = find(hash);
+        return it != map.end() && !setUnchecked.count(std::make_pair(GetSeenTime(it->second), hash));
+    }
+    /** Mark an entry as checked. Returns false if it is unknown or was checked already. */
+    bool check(const uint256& hash)
+    {
+        const_iterator it = find(hash);
+        return it != map.end() && setUnchecked.erase(std::make_pair(GetSeenTime(it->second), hash));
+    }
+    size_type unchecked_size() const { return setUnchecked.size(); }
+
+    /** Hashes of the entries of the masternode with collateral outpoint */
+    std::vector<uint256> find_by_outpoint(const COutPoint& outpoint) const
+    {
+        Load();
+        std::vector<uint256> vHashes;
+        std::set<std::pair<COutPoint, uint256> >::const_iterator it = setByOutpoint.lower_bound(std::make_pair(outpoint, uint256(0)));
+        for (; it != setByOutpoint.end() && it->first == outpoint; ++it)
+            vHashes.push_back(it->second);
+        return vHashes;
+    }
+
+    /** Take out the unchecked entry with the latest time, so that messages
+     *  dated into the future go first */
+    bool pop_unchecked(uint256& hashRet, T& msgRet)
+    {
+        if (setUnchecked.empty())
+            return false;
+        std::pair<int64_t, uint256> entry = *setUnchecked.rbegin();
+        hashRet = entry.second;
+        typename std::map<uint256, T>::iterator it = map.find(hashRet);
+        msgRet = it->second;
+        map.erase(it);
+        setByTime.erase(entry);
+        setByOutpoint.erase(std::make_pair(msgRet.vin.prevout, hashRet));
+        setUnchecked.erase(entry);
+        return true;
+    }
+
+    /** Take out the oldest entry if it expired before nTime. Pending entries
+     *  are not read for this, they expire once the map is used. */
+    bool pop_oldest(int64_t nTime, uint256& hashRet, T& msgRet)
+    {
+        if (fPending || setByTime.empty() || setByTime.begin()->first >= nTime)
+            return false;
+        hashRet = setByTime.begin()->second;
+        typename std::map<uint256, T>::iterator it = map.find(hashRet);
+        msgRet = it->second;
+        map.erase(it);
+        setByOutpoint.erase(std::make_pair(msgRet.vin.prevout, hashRet));
+        setUnchecked.erase(*setByTime.begin());
+        setByTime.erase(setByTime.begin());
+        return true;
+    }
+
+    /** Replace the contents with serialized entries, read on first use */
+    void SetPending(const CMemoryReader& ss)
+    {
+        clear();
+        LOCK(cs_pending);
+        vchPending.assign(ss.begin(), ss.end());
+        nPendingVersion = ss.GetVersion();
+        fPending = true;
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        if (ser_action.ForRead())
+            clear();
+        else
+            Load();
+        if (!ser_action.ForRead() && !setUnchecked.empty()) {
+            std::map<uint256, T> mapChecked;
+            for (const_iterator it = map.begin(); it != map.end(); ++it) {
+                if (!setUnchecked.count(std::make_pair(GetSeenTime(it->second), it->first)))
+                    mapChecked.insert(*it);
+            }
+            READWRITE(mapChecked);
+        } else {
+            READWRITE(map);
+        }
+        if (ser_action.ForRead())
+            Reindex();
+    }
+};
+
+class CMasternodeMan
+{
+public:
+    // critical section to protect the inner data structures, held by readers of the seen maps
     mutable CCriticalSection cs;
 
+private:
     // critical section to protect the inner data structures specifically on messaging
     mutable CCriticalSection cs_process_message;
 
-    // map to hold all MNs
-    std::vector<CMasternode> vMasternodes;
+    // list to hold all MNs, an entry keeps its address until it is removed
+    std::list<CMasternode> listMasternodes;
+    // indexes into listMasternodes
+    std::map<COutPoint, CMasternode*> mapMasternodesByVin;
+    std::multimap<CScript, CMasternode*> mapMasternodesByPayee;
+    std::multimap<CPubKey, CMasternode*> mapMasternodesByPubKey;
+    // payee and masternode key each entry is currently indexed under
+    std::map<const CMasternode*, std::pair<CScript, CPubKey> > mapIndexedKeys;
+
+    // masternode scores for one block, only ordered as far as a lookup needed
+    struct CRankTable {
+        uint256 hashBlock;
+        int64_t nTimeCreated;
+        std::vector<std::pair<int64_t, CTxIn> > vecScores;
+    };
+    // rank tables by (height, min protocol, only active, min age), dropped whenever the list changes
+    std::map<std::tuple<int64_t, int, bool, bool>, CRankTable> mapRankTables;
     // who's asked for the Masternode list and the last time
     std::map<CNetAddr, int64_t> mAskedUsForMasternodeList;
     // who we asked for the Masternode list and the last time
@@ -68,11 +329,16 @@ private:
     // which Masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
 
+    void IndexMasternode(CMasternode& mn);
+    void UnindexMasternode(CMasternode& mn);
+    void RebuildIndexes();
+    CRankTable* GetRankTable(int64_t nBlockHeight, int minProtocol, bool fOnlyActive, bool fMinAge);
+
 public:
-    // Keep track of all broadcasts I've seen
-    map<uint256, CMasternodeBroadcast> mapSeenMasternodeBroadcast;
-    // Keep track of all pings I've seen
-    map<uint256, CMasternodePing> mapSeenMasternodePing;
+    // Keep track of all broadcasts I've seen, change through AddSeenBroadcast/RemoveSeenBroadcast
+    CSeenMasternodeMap<CMasternodeBroadcast> mapSeenMasternodeBroadcast;
+    // Keep track of all pings I've seen, change through AddSeenPing
+    CSeenMasternodeMap<CMasternodePing> mapSeenMasternodePing;
 
     // keep track of dsq count to prevent masternodes from gaming obfuscation queue
     int64_t nDsqCount;
@@ -83,7 +349,14 @@ public:
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
     {
         LOCK(cs);
+        std::vector<CMasternode> vMasternodes;
+        if (!ser_action.ForRead())
+            vMasternodes.assign(listMasternodes.begin(), listMasternodes.end());
         READWRITE(vMasternodes);
+        if (ser_action.ForRead()) {
+            listMasternodes.assign(vMasternodes.begin(), vMasternodes.end());
+            RebuildIndexes();
+        }
         READWRITE(mAskedUsForMasternodeList);
         READWRITE(mWeAskedForMasternodeList);
         READWRITE(mWeAskedForMasternodeListEntry);
@@ -96,9 +369,24 @@ public:
     CMasternodeMan();
     CMasternodeMan(CMasternodeMan& other);
 
+    /// Store in / load from the sections of mncache.dat, the seen maps are only deserialized when first used
+    void WriteSections(CSectionFileWriter& fileout) const;
+    void ReadSections(const CSectionFileReader& filein);
+
     /// Add an entry
     bool Add(CMasternode& mn);
 
+    /// Remember a seen broadcast or ping, forgetting unchecked and then the oldest ones beyond the limit.
+    /// Unchecked ones are passed on to the witness manager once they are added again with fChecked set.
+    bool AddSeenBroadcast(const CMasternodeBroadcast& mnb, bool fChecked = true);
+    bool AddSeenPing(const CMasternodePing& mnp, bool fChecked = true);
+
+    /// Forget a seen broadcast, so it is checked again when it comes back
+    void RemoveSeenBroadcast(const uint256& hash);
+
+    /// Replace the last ping kept with a seen broadcast
+    void UpdateSeenBroadcastPing(const uint256& hash, const CMasternodePing& mnp);
+
     /// Ask (source) node for mnb
     void AskForMN(CNode* pnode, CTxIn& vin);
 
@@ -117,7 +405,16 @@ public:
 
     void DsegUpdate(CNode* pnode);
 
-    /// Find an entry
+    /// Bloom filter of the broadcasts we already hold, for peers answering our list request
+    CBloomFilter GetKnownBroadcastsFilter();
+    /// Read the filter of a dseg list request, returns false if it is too large
+    static bool ReadDsegFilter(CDataStream& vRecv, CBloomFilter& filter);
+
+    /// Inventory answering a dseg for vin (or all entries), leaving out what pfilter says the peer holds.
+    /// Returns the number of entries that matched the request, sent or not.
+    int GetDsegInventory(const CTxIn& vin, const CBloomFilter* pfilter, std::vector<CInv>& vInvRet);
+
+    /// Find an entry, the returned pointer stays valid until the entry is removed
     CMasternode* Find(const CScript& payee);
     CMasternode* Find(const CTxIn& vin);
     CMasternode* Find(const CPubKey& pubKeyMasternode);
@@ -134,7 +431,8 @@ public:
     std::vector<CMasternode> GetFullMasternodeVector()
     {
         Check();
-        return vMasternodes;
+        LOCK(cs);
+        return std::vector<CMasternode>(listMasternodes.begin(), listMasternodes.end());
     }
 
     std::vector<pair<int, CMasternode> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol = 0);
@@ -146,7 +444,7 @@ public:
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
     /// Return the number of (unique) Masternodes
-    int size() { return vMasternodes.size(); }
+    int size() { return listMasternodes.size(); }
 
     /// Return the number of Masternodes older than (default) 8000 seconds
     int stable_size ();
@@ -155,6 +453,9 @@ public:
 
     void Remove(CTxIn vin);
 
+    /// Update the lookup indexes after the keys of an entry changed
+    void ReindexMasternode(CMasternode* pmn);
+
     int GetEstimatedMasternodes(int nBlock);
 
     /// Update masternode list and maps using provided CMasternodeBroadcast
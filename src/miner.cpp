@@ -32,6 +32,7 @@
 #include "primitives/masternode_witness.h"
 
 
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 #include <boost/tuple/tuple.hpp>
 
@@ -237,7 +238,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
                 }
 
                 // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash)) {
+                if (!view.HaveCoin(txin.prevout)) {
                     // This should never happen; all transactions in the memory
                     // pool should connect to either transactions in the chain
                     // or other transactions in the memory pool.
@@ -269,13 +270,13 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
                     break;
                 }
 
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
+                const Coin& coin = view.AccessCoin(txin.prevout);
+                assert(!coin.IsSpent());
 
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
+                CAmount nValueIn = coin.out.nValue;
                 nTotalIn += nValueIn;
 
-                int nConf = nHeight - coins->nHeight;
+                int nConf = nHeight - (int)coin.nHeight;
 
                 // zBWI spends can have very large priority, use non-overflowing safe functions
                 dPriority = double_safe_addition(dPriority, ((double)nValueIn * nConf));
@@ -606,6 +607,98 @@ bool fGenerateBitcoins = false;
 bool fMintableCoins = false;
 int nMintableLastCheck = 0;
 
+namespace
+{
+/**
+ * Wakes the stake minter up when something that changes the outcome of a stake
+ * attempt happens: a new tip, a wallet transaction or the wallet being unlocked.
+ * Everything else the minter waits for is a deadline it can compute.
+ */
+class CStakeScheduler : public CValidationInterface
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    bool fEvent;
+    bool fWalletChanged;
+    const CBlockIndex* pindexNotified;
+    boost::signals2::scoped_connection connTransactionChanged;
+    boost::signals2::scoped_connection connStatusChanged;
+
+    void Notify(bool fWallet, const CBlockIndex* pindex = NULL)
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            fEvent = true;
+            fWalletChanged |= fWallet;
+            if (pindex)
+                pindexNotified = pindex;
+        }
+        cond.notify_all();
+    }
+
+    void NotifyTransactionChanged(CWallet* wallet, const uint256& hashTx, ChangeType status) { Notify(true); }
+    void NotifyStatusChanged(CCryptoKeyStore* wallet) { Notify(true); }
+
+    // whether the last notified tip replaces pindexTip, rather than being pindexTip or one of its ancestors
+    bool IsNewTip(const CBlockIndex* pindexTip) const
+    {
+        return pindexNotified && pindexTip->GetAncestor(pindexNotified->nHeight) != pindexNotified;
+    }
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex* pindex) { Notify(false, pindex); }
+
+public:
+    CStakeScheduler(CWallet* pwallet) : fEvent(false), fWalletChanged(true), pindexNotified(NULL)
+    {
+        connTransactionChanged = pwallet->NotifyTransactionChanged.connect(boost::bind(&CStakeScheduler::NotifyTransactionChanged, this, _1, _2, _3));
+        connStatusChanged = pwallet->NotifyStatusChanged.connect(boost::bind(&CStakeScheduler::NotifyStatusChanged, this, _1));
+        RegisterValidationInterface(this);
+    }
+
+    ~CStakeScheduler()
+    {
+        UnregisterValidationInterface(this);
+    }
+
+    /** Sleeps until an event arrives or nMilliseconds pass, returns whether an event arrived */
+    bool Wait(int64_t nMilliseconds)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (!fEvent && nMilliseconds > 0)
+            cond.timed_wait(lock, boost::posix_time::milliseconds(nMilliseconds));
+        boost::this_thread::interruption_point();
+        bool fRet = fEvent;
+        fEvent = false;
+        return fRet;
+    }
+
+    /** Sleeps until a tip replacing pindexTip arrives or nMilliseconds pass, returns whether
+     *  one arrived. Other events don't end the wait and stay pending for Wait. */
+    bool WaitForNewTip(const CBlockIndex* pindexTip, int64_t nMilliseconds)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(nMilliseconds);
+        while (!IsNewTip(pindexTip)) {
+            if (!cond.timed_wait(lock, deadline))
+                break;
+        }
+        boost::this_thread::interruption_point();
+        return IsNewTip(pindexTip);
+    }
+
+    /** Returns whether the wallet changed since the last call */
+    bool WalletChanged()
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        bool fRet = fWalletChanged;
+        fWalletChanged = false;
+        return fRet;
+    }
+};
+} // anon namespace
+
 // ***TODO*** that part changed in bitcoin, we are using a mix with old one here for now
 
 void BitcoinMiner(CWallet* pwallet, bool fProofOfStake)
@@ -618,44 +711,54 @@ void BitcoinMiner(CWallet* pwallet, bool fProofOfStake)
     CReserveKey reservekey(pwallet);
     unsigned int nExtraNonce = 0;
 
+    std::unique_ptr<CStakeScheduler> pscheduler;
+    if (fProofOfStake)
+        pscheduler.reset(new CStakeScheduler(pwallet));
+    const CBlockIndex* pindexDelayed = NULL;
+
     while (fGenerateBitcoins || fProofOfStake) {
         if (fProofOfStake) {
-            //control the amount of times the client will check for mintable coins
-            if ((GetTime() - nMintableLastCheck > 5 * 60)) // 5 minute check time
+            //control the amount of times the client will check for mintable coins, coins also
+            //become mintable just by aging so the wallet notifications alone are not enough
+            if (pscheduler->WalletChanged() || (GetTime() - nMintableLastCheck > 5 * 60)) // 5 minute check time
             {
                 nMintableLastCheck = GetTime();
                 fMintableCoins = pwallet->MintableCoins();
             }
 
             if (chainActive.Tip()->nHeight < Params().LAST_POW_BLOCK()) {
-                MilliSleep(5000);
+                pscheduler->Wait(5000);
                 continue;
             }
 
-            while (vNodes.empty() || pwallet->IsLocked() || !fMintableCoins || (pwallet->GetBalance() > 0 && nReserveBalance >= pwallet->GetBalance())
+            if (vNodes.empty() || pwallet->IsLocked() || !fMintableCoins || (pwallet->GetBalance() > 0 && nReserveBalance >= pwallet->GetBalance())
             || !masternodeSync.IsSynced()) {
                 nLastCoinStakeSearchInterval = 0;
                 // Do a separate 1 minute check here to ensure fMintableCoins is updated
-                if (!fMintableCoins) {
-                    if (GetTime() - nMintableLastCheck > 1 * 60) // 1 minute check time
-                    {
-                        nMintableLastCheck = GetTime();
-                        fMintableCoins = pwallet->MintableCoins();
-                    }
-                }
-                MilliSleep(5000);
-                if (!fGenerateBitcoins && !fProofOfStake)
-                    continue;
+                if (!fMintableCoins && GetTime() - nMintableLastCheck > 1 * 60) // 1 minute check time
+                    nMintableLastCheck = 0;
+                // peers and masternode sync don't notify, so keep checking them every few seconds
+                pscheduler->Wait(5000);
+                continue;
             }
 
-            if (mapHashedBlocks.count(chainActive.Tip()->nHeight)) //search our map of hashed blocks, see if bestblock has been hashed yet
+            CBlockIndex* pindexTip = chainActive.Tip();
+            if (mapHashedBlocks.count(pindexTip->nHeight)) //search our map of hashed blocks, see if bestblock has been hashed yet
             {
-                if (GetTime() - mapHashedBlocks[chainActive.Tip()->nHeight] < max(pwallet->nHashInterval, (unsigned int)1)) // wait half of the nHashDrift with max wait of 3 minutes
-                {
-                    MilliSleep(5000);
+                // sleep until the next set of kernel timestamps can be tried or a new tip arrives
+                int64_t nNextHash = mapHashedBlocks[pindexTip->nHeight] + max(pwallet->nHashInterval, (unsigned int)1);
+                if (GetTime() < nNextHash) {
+                    pscheduler->Wait((nNextHash - GetTime()) * 1000);
                     continue;
                 }
             }
+
+            // give a fresh tip a few seconds to settle before staking on top of it
+            if (pindexDelayed != pindexTip && GetAdjustedTime() - pindexTip->GetBlockTime() < 60) {
+                pindexDelayed = pindexTip;
+                if (pscheduler->WaitForNewTip(pindexTip, 10000))
+                    continue;
+            }
         }
 
         //
@@ -1554,6 +1554,7 @@ void ThreadMessageHandler()
             boost::this_thread::interruption_point();
         }
 
+        g_signals.MessagesProcessed();
 
         {
             LOCK(cs_vNodes);
@@ -91,6 +91,8 @@ struct CNodeSignals {
     boost::signals2::signal<bool(CNode*, bool)> SendMessages;
     boost::signals2::signal<void(NodeId, const CNode*)> InitializeNode;
     boost::signals2::signal<void(NodeId)> FinalizeNode;
+    // after each round of ProcessMessages and SendMessages over all nodes
+    boost::signals2::signal<void()> MessagesProcessed;
 };
 
 
@@ -7,6 +7,7 @@
 #include "coincontrol.h"
 #include "init.h"
 #include "main.h"
+#include "masternode-budget.h"
 #include "masternodeman.h"
 #include "script/sign.h"
 #include "swifttx.h"
@@ -2313,6 +2314,9 @@ void ThreadCheckObfuScationPool()
 
             //if(c % MASTERNODES_DUMP_SECONDS == 0) DumpMasternodes();
 
+            // verify budget votes left over from the last partial batch
+            budget.ProcessVoteQueue(true);
+
             obfuScationPool.CheckTimeout();
             obfuScationPool.CheckForCompleteQueue();
 
@@ -3,9 +3,55 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "masternode_witness.h"
+#include "../main.h"
+#include "../random.h"
 #include "../util.h"
 #include "../obfuscation.h"
 
+#include <boost/thread.hpp>
+
+namespace {
+
+/**
+ * Proofs whose signatures were already verified, to avoid repeating the
+ * ECDSA checks for every relayed witness carrying the same proofs
+ */
+class CMasterNodeProofCache
+{
+private:
+    static const unsigned int MAX_PROOF_CACHE_SIZE = 50000;
+
+    std::set<uint256> setValid;
+    boost::shared_mutex cs_proofcache;
+
+public:
+    bool Get(const ActiveMasterNodeProofs& proof)
+    {
+        uint256 hash = proof.GetVerificationHash();
+        boost::shared_lock<boost::shared_mutex> lock(cs_proofcache);
+        return setValid.count(hash) != 0;
+    }
+
+    void Set(const ActiveMasterNodeProofs& proof)
+    {
+        uint256 hash = proof.GetVerificationHash();
+        boost::unique_lock<boost::shared_mutex> lock(cs_proofcache);
+
+        while (setValid.size() >= MAX_PROOF_CACHE_SIZE) {
+            // Evict a random entry, same as the signature cache
+            std::set<uint256>::iterator it = setValid.lower_bound(GetRandHash());
+            if (it == setValid.end())
+                it = setValid.begin();
+            setValid.erase(it);
+        }
+        setValid.insert(hash);
+    }
+};
+
+CMasterNodeProofCache proofCache;
+
+}
+
 std::string CMasterNodeWitness::ToString() const
 {
     std::stringstream s;
@@ -33,12 +79,12 @@ bool CMasterNodeWitness::Sign(CKey &keyWitness)
     return true;
 }
 
-bool CMasterNodeWitness::IsValid(int64_t atTime) const
+bool CMasterNodeWitness::IsValid(int64_t atTime, std::vector<CMasterNodeProofCheck>* pvChecks) const
 {
-    std::vector<CTxIn> checkedOut;
+    std::set<COutPoint> checkedOut;
     for (unsigned i = 0; i < nProofs.size(); i++) {
-        CMasternodePing ping = nProofs[i].nPing;
-        CMasternodeBroadcast broadcast = nProofs[i].nBroadcast;
+        const CMasternodePing &ping = nProofs[i].nPing;
+        const CMasternodeBroadcast &broadcast = nProofs[i].nBroadcast;
 
         if (ping.sigTime<(atTime - MASTERNODE_REMOVAL_SECONDS) || ping.sigTime>(atTime + MASTERNODE_PING_SECONDS)) {
             return false;
@@ -48,45 +94,45 @@ bool CMasterNodeWitness::IsValid(int64_t atTime) const
             return false;
         }
 
-        if (!broadcast.VerifySignature()) {
+        if (!checkedOut.insert(ping.vin.prevout).second) {
             return false;
         }
 
-        int nDos = 0;
-        if (!ping.VerifySignature(broadcast.pubKeyMasternode, nDos) || nDos != 0) {
-            return false;
-        }
-
-        uint256 hashBlock = 0;
-        CTransaction tx2;
-        GetTransaction(ping.vin.prevout.hash, tx2, hashBlock, true);
-        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
-        if (mi != mapBlockIndex.end() && (*mi).second) {
-            CBlockIndex *pMNIndex = (*mi).second;
-            CBlockIndex *pConfIndex = chainActive[pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1];
-            if (pConfIndex && pConfIndex->GetBlockTime() > atTime) {
-                return false;
+        {
+            // the coin lookup must not be skipped when cs_main is busy, a witness would pass unchecked
+            LOCK(cs_main);
+
+            // collateral must have been confirmed before atTime
+            const Coin& coin = pcoinsTip->AccessCoin(ping.vin.prevout);
+            if (!coin.IsSpent() && coin.nHeight > 0) {
+                CBlockIndex *pConfIndex = chainActive[coin.nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1];
+                if (pConfIndex && pConfIndex->GetBlockTime() > atTime) {
+                    return false;
+                }
             }
-        }
 
-        // check that Master node vin\vout is not spent
-        {
+            // check that Master node vin\vout is not spent
             CValidationState state;
             CMutableTransaction dummyTx = CMutableTransaction();
             CTxOut vout = CTxOut(2999.99 * COIN, obfuScationPool.collateralPubKey);
             dummyTx.vin.push_back(ping.vin);
             dummyTx.vout.push_back(vout);
 
-            TRY_LOCK(cs_main, lockMain);
-            if (lockMain && !AcceptableInputs(mempool, state, CTransaction(dummyTx), false, NULL)) {
+            if (!AcceptableInputs(mempool, state, CTransaction(dummyTx), false, NULL)) {
                 return false;
             }
         }
 
-        if (std::find(checkedOut.begin(), checkedOut.end(), ping.vin) != checkedOut.end()) {
+        if (proofCache.Get(nProofs[i]))
+            continue;
+
+        CMasterNodeProofCheck check(nProofs[i]);
+        if (pvChecks) {
+            pvChecks->push_back(CMasterNodeProofCheck());
+            check.swap(pvChecks->back());
+        } else if (!check()) {
             return false;
         }
-        checkedOut.push_back(ping.vin);
     }
     return true;
 }
@@ -109,4 +155,18 @@ std::string ActiveMasterNodeProofs::ToString() const
     s << "\tBroadcast " << nBroadcast.addr.ToString() << " " << nBroadcast.vin.ToString()
       << EpochTimeToHumanReadableFormat(nBroadcast.sigTime).c_str() << "\n";
     return s.str();
-}
\ No newline at end of file
+}
+bool CMasterNodeProofCheck::operator()()
+{
+    if (!proof.nBroadcast.VerifySignature()) {
+        return false;
+    }
+
+    int nDos = 0;
+    if (!proof.nPing.VerifySignature(proof.nBroadcast.pubKeyMasternode, nDos) || nDos != 0) {
+        return false;
+    }
+
+    proofCache.Set(proof);
+    return true;
+}
@@ -8,6 +8,7 @@
 #include "../masternode.h"
 
 class ActiveMasterNodeProofs;
+class CMasterNodeProofCheck;
 bool operator==(const ActiveMasterNodeProofs& a, const ActiveMasterNodeProofs& b);
 bool operator!=(const ActiveMasterNodeProofs& a, const ActiveMasterNodeProofs& b);
 
@@ -102,7 +103,9 @@ public:
 
     std::string ToString() const;
     bool Sign(CKey &keyWitness);
-    bool IsValid(int64_t atTime) const;
+    /** When pvChecks is not NULL, proof signature checks not found in the proof cache
+     *  are appended to it for the caller to run, otherwise they are run inline. */
+    bool IsValid(int64_t atTime, std::vector<CMasterNodeProofCheck>* pvChecks = NULL) const;
     bool SignatureValid() const;
 };
 
@@ -168,5 +171,118 @@ public:
         return !(a == b);
     }
 
+    /** Commits to everything the proof signatures cover, including the signatures */
+    uint256 GetVerificationHash() const
+    {
+        CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+        ss << nPing;
+        ss << nBroadcast.vin;
+        ss << nBroadcast.addr;
+        ss << nBroadcast.pubKeyCollateralAddress;
+        ss << nBroadcast.pubKeyMasternode;
+        ss << nBroadcast.sig;
+        ss << nBroadcast.sigTime;
+        ss << nBroadcast.protocolVersion;
+        return ss.GetHash();
+    }
+
     std::string ToString() const;
-};
\ No newline at end of file
+};
+
+/**
+ * Closure representing the signature checks of one masternode proof
+ */
+class CMasterNodeProofCheck
+{
+private:
+    ActiveMasterNodeProofs proof;
+
+public:
+    CMasterNodeProofCheck() {}
+    CMasterNodeProofCheck(const ActiveMasterNodeProofs& proofIn) : proof(proofIn) {}
+
+    bool operator()();
+
+    void swap(CMasterNodeProofCheck& check)
+    {
+        std::swap(proof, check.proof);
+    }
+};
+/** Reference to a proof whose ping and broadcast the receiving peer has already seen.
+ *  Carries what is needed to rebuild the broadcast exactly as it was in the witness.
+ */
+class CMasterNodeProofRef
+{
+public:
+    uint256 hashPing;
+    uint256 hashBroadcast;
+    uint256 hashLastPing; // 0 when the broadcast has no last ping
+    int64_t nLastDsq;
+
+    CMasterNodeProofRef() : hashPing(0), hashBroadcast(0), hashLastPing(0), nLastDsq(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template<typename Stream, typename Operation>
+    inline void SerializationOp(Stream &s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(hashPing);
+        READWRITE(hashBroadcast);
+        READWRITE(hashLastPing);
+        READWRITE(nLastDsq);
+    }
+};
+
+/** One entry of a compact witness, either a reference or the full proof
+ */
+class CCompactMasterNodeProof
+{
+public:
+    bool fFull;
+    CMasterNodeProofRef ref;
+    ActiveMasterNodeProofs proof;
+
+    CCompactMasterNodeProof() : fFull(false) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template<typename Stream, typename Operation>
+    inline void SerializationOp(Stream &s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(fFull);
+        if (fFull)
+            READWRITE(proof);
+        else
+            READWRITE(ref);
+    }
+};
+
+/** CMasterNodeWitness as relayed with a block to peers from COMPACT_WITNESS_VERSION on.
+ *  The receiver rebuilds the full witness from its masternode manager and asks
+ *  for the proofs it could not rebuild.
+ */
+class CCompactMasterNodeWitness
+{
+public:
+    CAmount nVersion;
+    uint32_t nTime;
+    uint256 nTargetBlockHash;
+    std::vector<CCompactMasterNodeProof> vProofs;
+    std::vector<unsigned char> vchSig;
+    CPubKey pubKeyWitness;
+
+    CCompactMasterNodeWitness() : nVersion(-1), nTime(0), nTargetBlockHash(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template<typename Stream, typename Operation>
+    inline void SerializationOp(Stream &s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(this->nVersion);
+        READWRITE(nTime);
+        READWRITE(vProofs);
+        READWRITE(nTargetBlockHash);
+        READWRITE(pubKeyWitness);
+        READWRITE(vchSig);
+    }
+};
@@ -81,8 +81,7 @@ QString ClientModel::getMasternodeCountString() const
     int ipv4 = 0, ipv6 = 0, onion = 0;
     //mnodeman.CountNetworks(ActiveProtocol(), ipv4, ipv6, onion);
 
-    CMasterNodeWitness witness = pMNWitness->CreateMasterNodeWitnessSnapshot();
-    const int totalProofs = witness.nProofs.size();
+    const int totalProofs = pMNWitness->GetMasterNodeWitnessSnapshotSize();
     //int nUnknown = totalProofs - ipv4 - ipv6 - onion;
     //if(nUnknown < 0) nUnknown = 0;
     return tr("Total: %1 (IPv4: %2 / IPv6: %3 / Tor: %4 / Unknown: %5)").arg(QString::number((int)totalProofs)).arg(QString::number((int)ipv4)).arg(QString::number((int)ipv6)).arg(QString::number((int)onion)).arg(QString::number((int)totalProofs));
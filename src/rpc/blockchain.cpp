@@ -8,6 +8,7 @@
 #include "base58.h"
 #include "checkpoints.h"
 #include "clientversion.h"
+#include "coinsprefetch.h"
 #include "main.h"
 #include "rpc/server.h"
 #include "sync.h"
@@ -467,6 +468,55 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
     return ret;
 }
 
+UniValue getcoinscacheinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getcoinscacheinfo\n"
+            "\nReturns the state of the in-memory coin cache and how often the blocks connected since startup found their inputs in it.\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"entries\": n,           (numeric) The number of cached transaction outputs\n"
+            "  \"usage\": n,             (numeric) The memory used by the cache, in bytes\n"
+            "  \"limit\": n,             (numeric) The memory the cache may use before it is written and trimmed, in bytes\n"
+            "  \"inputs\": n,            (numeric) Inputs of connected blocks spending outputs of earlier blocks\n"
+            "  \"cachehits\": n,         (numeric) How many of them were cached when their block was connected\n"
+            "  \"hitrate\": x.xxx,       (numeric) cachehits / inputs\n"
+            "  \"prefetch\": {           (json object) Coins read ahead while blocks were checked and stored\n"
+            "    \"blocks\": n,          (numeric) Blocks whose inputs were prefetched\n"
+            "    \"requested\": n,       (numeric) Outputs looked up in the coin database\n"
+            "    \"loaded\": n,          (numeric) Outputs found there\n"
+            "    \"warmed\": n,          (numeric) Outputs added to the cache\n"
+            "    \"discarded\": n,       (numeric) Outputs dropped as the coin database was written meanwhile\n"
+            "    \"waittime\": x.xxx     (numeric) Seconds spent waiting for prefetches to complete\n"
+            "  }\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getcoinscacheinfo", "") + HelpExampleRpc("getcoinscacheinfo", ""));
+
+    LOCK(cs_main);
+
+    CCoinsPrefetchStats stats = GetCoinsPrefetchStats();
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("entries", (int64_t)pcoinsTip->GetCacheSize()));
+    ret.push_back(Pair("usage", (int64_t)pcoinsTip->DynamicMemoryUsage()));
+    ret.push_back(Pair("limit", (int64_t)nCoinCacheUsage));
+    ret.push_back(Pair("inputs", (int64_t)stats.nInputs));
+    ret.push_back(Pair("cachehits", (int64_t)stats.nHits));
+    ret.push_back(Pair("hitrate", stats.nInputs ? (double)stats.nHits / stats.nInputs : 0.0));
+    UniValue prefetch(UniValue::VOBJ);
+    prefetch.push_back(Pair("blocks", (int64_t)stats.nBlocks));
+    prefetch.push_back(Pair("requested", (int64_t)stats.nRequested));
+    prefetch.push_back(Pair("loaded", (int64_t)stats.nLoaded));
+    prefetch.push_back(Pair("warmed", (int64_t)stats.nWarmed));
+    prefetch.push_back(Pair("discarded", (int64_t)stats.nDiscarded));
+    prefetch.push_back(Pair("waittime", stats.nWaitTime * 0.000001));
+    ret.push_back(Pair("prefetch", prefetch));
+    return ret;
+}
+
 UniValue gettxout(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -494,7 +544,6 @@ UniValue gettxout(const UniValue& params, bool fHelp)
             "        ,...\n"
             "     ]\n"
             "  },\n"
-            "  \"version\" : n,            (numeric) The version\n"
             "  \"coinbase\" : true|false   (boolean) Coinbase or not\n"
             "}\n"
 
@@ -517,33 +566,33 @@ UniValue gettxout(const UniValue& params, bool fHelp)
     if (params.size() > 2)
         fMempool = params[2].get_bool();
 
-    CCoins coins;
+    if (n < 0)
+        return NullUniValue;
+    COutPoint out(hash, n);
+
+    Coin coin;
     if (fMempool) {
         LOCK(mempool.cs);
         CCoinsViewMemPool view(pcoinsTip, mempool);
-        if (!view.GetCoins(hash, coins))
+        if (!view.GetCoin(out, coin) || mempool.isSpent(out)) // TODO: filtering spent coins should be done by the CCoinsViewMemPool
             return NullUniValue;
-        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
     } else {
-        if (!pcoinsTip->GetCoins(hash, coins))
+        if (!pcoinsTip->GetCoin(out, coin))
             return NullUniValue;
     }
-    if (n < 0 || (unsigned int)n >= coins.vout.size() || coins.vout[n].IsNull())
-        return NullUniValue;
 
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     CBlockIndex* pindex = it->second;
     ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
-    if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
+    if (coin.nHeight == MEMPOOL_HEIGHT)
         ret.push_back(Pair("confirmations", 0));
     else
-        ret.push_back(Pair("confirmations", pindex->nHeight - coins.nHeight + 1));
-    ret.push_back(Pair("value", ValueFromAmount(coins.vout[n].nValue)));
+        ret.push_back(Pair("confirmations", pindex->nHeight - (int)coin.nHeight + 1));
+    ret.push_back(Pair("value", ValueFromAmount(coin.out.nValue)));
     UniValue o(UniValue::VOBJ);
-    ScriptPubKeyToJSON(coins.vout[n].scriptPubKey, o, true);
+    ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
     ret.push_back(Pair("scriptPubKey", o));
-    ret.push_back(Pair("version", coins.nVersion));
-    ret.push_back(Pair("coinbase", coins.fCoinBase));
+    ret.push_back(Pair("coinbase", coin.fCoinBase));
 
     return ret;
 }
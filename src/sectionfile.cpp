@@ -0,0 +1,163 @@
+// Copyright (c) 2019-2020 The BITWIN24 developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "sectionfile.h"
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "hash.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+
+/** First bytes of a sectioned file, older files start with the length of their magic message instead */
+static const unsigned char pchSectionFileMagic[4] = {0xf9, 'M', 'N', 'S'};
+
+static const uint64_t SECTION_ALIGNMENT = 8;
+
+CDataStream& CSectionFileWriter::AddSection(uint32_t nId)
+{
+    return mapSections.insert(std::make_pair(nId, CDataStream(SER_DISK, CLIENT_VERSION))).first->second;
+}
+
+bool CSectionFileWriter::Write(const boost::filesystem::path& path) const
+{
+    std::vector<CSectionInfo> vSections;
+    for (std::map<uint32_t, CDataStream>::const_iterator it = mapSections.begin(); it != mapSections.end(); ++it) {
+        CSectionInfo info;
+        info.nId = it->first;
+        info.nSize = it->second.size();
+        info.hash = Hash(it->second.begin(), it->second.end());
+        vSections.push_back(info);
+    }
+
+    // the section table has a fixed size, so the offsets can be filled in afterwards
+    CDataStream ssHeader(SER_DISK, CLIENT_VERSION);
+    ssHeader << FLATDATA(pchSectionFileMagic) << SECTION_FILE_VERSION << CLIENT_VERSION;
+    ssHeader << FLATDATA(Params().MessageStart()) << strMagicMessage;
+    uint64_t nOffset = ssHeader.size() + ::GetSerializeSize(vSections, SER_DISK, CLIENT_VERSION) + sizeof(uint256);
+    for (unsigned int i = 0; i < vSections.size(); i++) {
+        nOffset = (nOffset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+        vSections[i].nOffset = nOffset;
+        nOffset += vSections[i].nSize;
+    }
+    ssHeader << vSections;
+    ssHeader << Hash(ssHeader.begin(), ssHeader.end());
+
+    boost::filesystem::path pathTmp = path;
+    pathTmp += ".new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("%s : Failed to open file %s", __func__, pathTmp.string());
+
+    try {
+        fileout.write(&ssHeader[0], ssHeader.size());
+        uint64_t nPos = ssHeader.size();
+        std::map<uint32_t, CDataStream>::const_iterator it = mapSections.begin();
+        for (unsigned int i = 0; i < vSections.size(); i++, ++it) {
+            static const char pchPadding[SECTION_ALIGNMENT] = {};
+            fileout.write(pchPadding, vSections[i].nOffset - nPos);
+            if (!it->second.empty())
+                fileout.write(&it->second[0], it->second.size());
+            nPos = vSections[i].nOffset + vSections[i].nSize;
+        }
+    } catch (std::exception& e) {
+        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+    }
+    FileCommit(fileout.Get());
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, path))
+        return error("%s : Failed to rename %s", __func__, pathTmp.string());
+    return true;
+}
+
+CSectionFileReader::Result CSectionFileReader::Open(const boost::filesystem::path& path, const std::string& strMagicMessage)
+{
+    mapSections.clear();
+    nVersion = 0;
+
+    boost::system::error_code ec;
+    uintmax_t nFileSize = boost::filesystem::file_size(path, ec);
+    if (ec) {
+        error("%s : Failed to open file %s", __func__, path.string());
+        return FileError;
+    }
+    if (nFileSize < sizeof(pchSectionFileMagic))
+        return Legacy;
+
+    try {
+        boost::interprocess::file_mapping mapping(path.string().c_str(), boost::interprocess::read_only);
+        boost::interprocess::mapped_region regionNew(mapping, boost::interprocess::read_only);
+        region.swap(regionNew);
+    } catch (std::exception& e) {
+        error("%s : Failed to map file %s - %s", __func__, path.string(), e.what());
+        return FileError;
+    }
+
+    const char* pbegin = static_cast<const char*>(region.get_address());
+    const char* pend = pbegin + region.get_size();
+    if (memcmp(pbegin, pchSectionFileMagic, sizeof(pchSectionFileMagic)))
+        return Legacy;
+
+    CMemoryReader ss(pbegin, pend, SER_DISK, CLIENT_VERSION);
+    uint32_t nFormatVersion;
+    unsigned char pchMsgTmp[4];
+    std::string strMagicMessageTmp;
+    std::vector<CSectionInfo> vSections;
+    uint256 hashIn;
+    try {
+        ss >> FLATDATA(pchMsgTmp) >> nFormatVersion >> nVersion;
+        if (nFormatVersion > SECTION_FILE_VERSION) {
+            error("%s : Unknown file version %u", __func__, nFormatVersion);
+            return IncorrectFormat;
+        }
+        ss >> FLATDATA(pchMsgTmp) >> strMagicMessageTmp >> vSections;
+        const char* pendHeader = ss.begin();
+        ss >> hashIn;
+        if (hashIn != Hash(pbegin, pendHeader)) {
+            error("%s : Header checksum mismatch, data corrupted", __func__);
+            return IncorrectHash;
+        }
+    } catch (std::exception& e) {
+        error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        return IncorrectFormat;
+    }
+
+    if (strMagicMessage != strMagicMessageTmp) {
+        error("%s : Invalid magic message", __func__);
+        return IncorrectMagicMessage;
+    }
+    if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
+        error("%s : Invalid network magic number", __func__);
+        return IncorrectMagicNumber;
+    }
+
+    for (unsigned int i = 0; i < vSections.size(); i++) {
+        const CSectionInfo& info = vSections[i];
+        if (info.nOffset > (uint64_t)(pend - pbegin) || info.nSize > (uint64_t)(pend - pbegin) - info.nOffset) {
+            error("%s : Section %u is out of bounds", __func__, info.nId);
+            return IncorrectFormat;
+        }
+        const char* pbeginSection = pbegin + info.nOffset;
+        const char* pendSection = pbeginSection + info.nSize;
+        if (info.hash != Hash(pbeginSection, pendSection)) {
+            error("%s : Section %u checksum mismatch, data corrupted", __func__, info.nId);
+            return IncorrectHash;
+        }
+        mapSections[info.nId] = std::make_pair(pbeginSection, pendSection);
+    }
+
+    return Ok;
+}
+
+CMemoryReader CSectionFileReader::GetSection(uint32_t nId) const
+{
+    std::map<uint32_t, std::pair<const char*, const char*> >::const_iterator it = mapSections.find(nId);
+    if (it == mapSections.end())
+        throw std::ios_base::failure(strprintf("CSectionFileReader::GetSection() : missing section %u", nId));
+    return CMemoryReader(it->second.first, it->second.second, SER_DISK, nVersion);
+}
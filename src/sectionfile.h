@@ -0,0 +1,128 @@
+// Copyright (c) 2019-2020 The BITWIN24 developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITWIN24_SECTIONFILE_H
+#define BITWIN24_SECTIONFILE_H
+
+#include "serialize.h"
+#include "streams.h"
+#include "uint256.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+/** Version of the sectioned cache file layout written by this code */
+static const uint32_t SECTION_FILE_VERSION = 1;
+
+/** Location and checksum of one section of a sectioned cache file */
+class CSectionInfo
+{
+public:
+    uint32_t nId;
+    uint64_t nOffset;
+    uint64_t nSize;
+    uint256 hash;
+
+    CSectionInfo() : nId(0), nOffset(0), nSize(0), hash(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(nId);
+        READWRITE(nOffset);
+        READWRITE(nSize);
+        READWRITE(hash);
+    }
+};
+
+/** Cache file (mncache.dat, mnpayments.dat, budget.dat) made of independently
+ *  checksummed sections.
+ *
+ * Layout:
+ *   header:   file magic, layout version, client version, network magic,
+ *             file specific magic message and the section table
+ *   checksum: hash of the header
+ *   sections: serialized data, each starting at an 8 byte aligned offset
+ *
+ * The file is read through a read-only mapping, so a reader only copies and
+ * deserializes the sections it actually uses. Files in the older layout (magic
+ * message, network magic, data, hash of all of it) are recognized by their
+ * first bytes and left to the caller to import.
+ */
+class CSectionFileWriter
+{
+private:
+    std::string strMagicMessage;
+    std::map<uint32_t, CDataStream> mapSections;
+
+public:
+    CSectionFileWriter(const std::string& strMagicMessageIn) : strMagicMessage(strMagicMessageIn) {}
+
+    /// Stream to serialize a section into, sections are written in id order
+    CDataStream& AddSection(uint32_t nId);
+
+    /// Write all sections to path, replacing the old file once complete
+    bool Write(const boost::filesystem::path& path) const;
+};
+
+class CSectionFileReader
+{
+public:
+    enum Result {
+        Ok,
+        FileError,
+        Legacy,
+        IncorrectHash,
+        IncorrectMagicMessage,
+        IncorrectMagicNumber,
+        IncorrectFormat
+    };
+
+private:
+    boost::interprocess::mapped_region region;
+    std::map<uint32_t, std::pair<const char*, const char*> > mapSections;
+    int nVersion;
+
+public:
+    CSectionFileReader() : nVersion(0) {}
+
+    /// Map the file and verify its header and the checksums of all sections
+    Result Open(const boost::filesystem::path& path, const std::string& strMagicMessage);
+
+    /// Client version the sections were serialized with
+    int GetVersion() const { return nVersion; }
+
+    bool HasSection(uint32_t nId) const { return mapSections.count(nId); }
+
+    /// Stream over a section's data, valid while the reader is open. Throws if the file has no such section.
+    CMemoryReader GetSection(uint32_t nId) const;
+};
+
+/** The matching ReadResult of a cache DB class (CMasternodeDB, CMasternodePaymentDB, CBudgetDB) */
+template <typename DB>
+typename DB::ReadResult SectionFileReadResult(CSectionFileReader::Result result)
+{
+    switch (result) {
+    case CSectionFileReader::Ok:
+        return DB::Ok;
+    case CSectionFileReader::FileError:
+        return DB::FileError;
+    case CSectionFileReader::IncorrectHash:
+        return DB::IncorrectHash;
+    case CSectionFileReader::IncorrectMagicMessage:
+        return DB::IncorrectMagicMessage;
+    case CSectionFileReader::IncorrectMagicNumber:
+        return DB::IncorrectMagicNumber;
+    default:
+        return DB::IncorrectFormat;
+    }
+}
+
+#endif // BITWIN24_SECTIONFILE_H
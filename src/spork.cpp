@@ -13,6 +13,9 @@
 #include "sync.h"
 #include "sporkdb.h"
 #include "util.h"
+
+#include <atomic>
+
 #include <boost/lexical_cast.hpp>
 
 using namespace std;
@@ -26,6 +29,21 @@ CSporkManager sporkManager;
 std::map<uint256, CSporkMessage> mapSporks;
 std::map<int, CSporkMessage> mapSporksActive;
 
+/** Current value of every spork, indexed by ID - SPORK_START, -1 for unused IDs.
+ *  Republished whenever mapSporksActive changes, so readers never touch the map. */
+static std::atomic<int64_t> nSporkValues[SPORK_END - SPORK_START + 1];
+
+static void PublishSporkValues()
+{
+    for (int i = SPORK_START; i <= SPORK_END; ++i)
+        nSporkValues[i - SPORK_START].store(GetSporkValueUncached(i), std::memory_order_relaxed);
+}
+
+// the defaults are in place before anything reads a spork
+static struct CSporkValuesInit {
+    CSporkValuesInit() { PublishSporkValues(); }
+} sporkValuesInit;
+
 // BITWIN24: on startup load spork values from previous session if they exist in the sporkDB
 void LoadSporksFromDB()
 {
@@ -44,6 +62,7 @@ void LoadSporksFromDB()
         // add spork to memory
         mapSporks[spork.GetHash()] = spork;
         mapSporksActive[spork.nSporkID] = spork;
+        PublishSporkValues();
         std::time_t result = spork.nValue;
         // If SPORK Value is greater than 1,000,000 assume it's actually a Date and then convert to a more readable format
         if (spork.nValue > 1000000) {
@@ -101,6 +120,7 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 
         mapSporks[hash] = spork;
         mapSporksActive[spork.nSporkID] = spork;
+        PublishSporkValues();
         sporkManager.Relay(spork);
 
         // BITWIN24: add to spork database.
@@ -119,6 +139,16 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 
 // grab the value of the spork on the network, or the default
 int64_t GetSporkValue(int nSporkID)
+{
+    int64_t r = -1;
+    if (nSporkID >= SPORK_START && nSporkID <= SPORK_END)
+        r = nSporkValues[nSporkID - SPORK_START].load(std::memory_order_relaxed);
+
+    if (r == -1) LogPrintf("%s : Unknown Spork %d\n", __func__, nSporkID);
+    return r;
+}
+
+int64_t GetSporkValueUncached(int nSporkID)
 {
     int64_t r = -1;
 
@@ -136,8 +166,6 @@ int64_t GetSporkValue(int nSporkID)
         if (nSporkID == SPORK_14_NEW_PROTOCOL_ENFORCEMENT) r = SPORK_14_NEW_PROTOCOL_ENFORCEMENT_DEFAULT;
         if (nSporkID == SPORK_15_NEW_PROTOCOL_ENFORCEMENT_2) r = SPORK_15_NEW_PROTOCOL_ENFORCEMENT_2_DEFAULT;
         if (nSporkID == SPORK_16_ZEROCOIN_MAINTENANCE_MODE) r = SPORK_16_ZEROCOIN_MAINTENANCE_MODE_DEFAULT;
-
-        if (r == -1) LogPrintf("%s : Unknown Spork %d\n", __func__, nSporkID);
     }
 
     return r;
@@ -241,6 +269,7 @@ bool CSporkManager::UpdateSpork(int nSporkID, int64_t nValue)
         Relay(msg);
         mapSporks[msg.GetHash()] = msg;
         mapSporksActive[nSporkID] = msg;
+        PublishSporkValues();
         return true;
     }
 
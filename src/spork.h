@@ -66,6 +66,8 @@ extern CSporkManager sporkManager;
 void LoadSporksFromDB();
 void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 int64_t GetSporkValue(int nSporkID);
+// the value from mapSporksActive or the default, as published for GetSporkValue
+int64_t GetSporkValueUncached(int nSporkID);
 bool IsSporkActive(int nSporkID);
 void ReprocessBlocks(int nBlocks);
 
@@ -7,6 +7,7 @@
 
 #include "activemasternode.h"
 #include "base58.h"
+#include "checkqueue.h"
 #include "key.h"
 #include "masternodeman.h"
 #include "net.h"
@@ -26,10 +27,53 @@ std::map<uint256, CTransaction> mapTxLockReq;
 std::map<uint256, CTransaction> mapTxLockReqRejected;
 std::map<uint256, CConsensusVote> mapTxLockVote;
 std::map<uint256, CTransactionLock> mapTxLocks;
-std::map<COutPoint, uint256> mapLockedInputs;
+LockedInputMap mapLockedInputs;
 std::map<uint256, int64_t> mapUnknownVotes; //track votes with no tx for DOS
+int64_t nUnknownVotesTotal = 0; //sum of mapUnknownVotes, for GetAverageVoteTime
 int nCompleteTXLocks;
 
+// (expiration, tx hash) of the transaction locks, entries go stale when a lock expires earlier
+std::set<std::pair<int64_t, uint256> > setTxLockExpiry;
+
+/** A received consensus vote waiting for its rank and signature checks */
+struct CQueuedConsensusVote {
+    CConsensusVote vote;
+    CNode* pfrom;
+    int nRank;
+    bool fValid;
+};
+
+CCriticalSection cs_consensusVoteQueue;
+std::vector<CQueuedConsensusVote> vecConsensusVoteQueue;
+
+static CCheckQueue<CConsensusVoteCheck> consensusvotecheckqueue(8);
+
+void ThreadConsensusVoteCheck()
+{
+    RenameThread("bitwin24-txlvotech");
+    consensusvotecheckqueue.Thread();
+}
+
+CLockedInputHasher::CLockedInputHasher() : salt(GetRandHash()) {}
+
+static void SetLockExpiration(CTransactionLock& lock, int64_t nExpiration)
+{
+    lock.nExpiration = nExpiration;
+    setTxLockExpiry.insert(make_pair(nExpiration, lock.txHash));
+}
+
+static void SetUnknownVoteTime(const uint256& hash, int64_t nTime)
+{
+    std::map<uint256, int64_t>::iterator it = mapUnknownVotes.find(hash);
+    if (it == mapUnknownVotes.end()) {
+        mapUnknownVotes.insert(make_pair(hash, nTime));
+    } else {
+        nUnknownVotesTotal -= it->second;
+        it->second = nTime;
+    }
+    nUnknownVotesTotal += nTime;
+}
+
 //txlock - Locks transaction
 //
 //step 1.) Broadcast intention to lock transaction inputs, "txlreg", CTransaction
@@ -106,11 +150,8 @@ void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& v
                 pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
                 tx.GetHash().ToString().c_str());
 
-            BOOST_FOREACH (const CTxIn& in, tx.vin) {
-                if (!mapLockedInputs.count(in.prevout)) {
-                    mapLockedInputs.insert(make_pair(in.prevout, tx.GetHash()));
-                }
-            }
+            BOOST_FOREACH (const CTxIn& in, tx.vin)
+                mapLockedInputs.insert(make_pair(in.prevout, tx.GetHash()));
 
             // resolve conflicts
             std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(tx.GetHash());
@@ -143,36 +184,80 @@ void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& v
 
         mapTxLockVote.insert(make_pair(ctx.GetHash(), ctx));
 
-        if (ProcessConsensusVote(pfrom, ctx)) {
-            //Spam/Dos protection
-            /*
-                Masternodes will sometimes propagate votes before the transaction is known to the client.
-                This tracks those messages and allows it at the same rate of the rest of the network, if
-                a peer violates it, it will simply be ignored
-            */
-            if (!mapTxLockReq.count(ctx.txHash) && !mapTxLockReqRejected.count(ctx.txHash)) {
-                if (!mapUnknownVotes.count(ctx.vinMasternode.prevout.hash)) {
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime() + (60 * 10);
-                }
+        // checked together with the other votes received in this round, see ProcessConsensusVoteQueue
+        CQueuedConsensusVote entry;
+        entry.vote = ctx;
+        entry.pfrom = pfrom->AddRef();
+        entry.nRank = -1;
+        entry.fValid = false;
+        LOCK(cs_consensusVoteQueue);
+        vecConsensusVoteQueue.push_back(entry);
+        return;
+    }
+}
 
-                if (mapUnknownVotes[ctx.vinMasternode.prevout.hash] > GetTime() &&
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] - GetAverageVoteTime() > 60 * 10) {
-                    LogPrintf("ProcessMessageSwiftTX::ix - masternode is spamming transaction votes: %s %s\n",
-                        ctx.vinMasternode.ToString().c_str(),
-                        ctx.txHash.ToString().c_str());
-                    return;
-                } else {
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime() + (60 * 10);
-                }
+static void ProcessConsensusVoteMessage(CNode* pfrom, CConsensusVote& ctx, int nRank, bool fSignatureValid)
+{
+    CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
+
+    if (ProcessConsensusVote(pfrom, ctx, nRank, fSignatureValid)) {
+        //Spam/Dos protection
+        /*
+            Masternodes will sometimes propagate votes before the transaction is known to the client.
+            This tracks those messages and allows it at the same rate of the rest of the network, if
+            a peer violates it, it will simply be ignored
+        */
+        if (!mapTxLockReq.count(ctx.txHash) && !mapTxLockReqRejected.count(ctx.txHash)) {
+            if (!mapUnknownVotes.count(ctx.vinMasternode.prevout.hash)) {
+                SetUnknownVoteTime(ctx.vinMasternode.prevout.hash, GetTime() + (60 * 10));
             }
-            RelayInv(inv);
-        }
 
-        if (mapTxLockReq.count(ctx.txHash) && GetTransactionLockSignatures(ctx.txHash) == SWIFTTX_SIGNATURES_REQUIRED) {
-            GetMainSignals().NotifyTransactionLock(mapTxLockReq[ctx.txHash]);
+            if (mapUnknownVotes[ctx.vinMasternode.prevout.hash] > GetTime() &&
+                mapUnknownVotes[ctx.vinMasternode.prevout.hash] - GetAverageVoteTime() > 60 * 10) {
+                LogPrintf("ProcessMessageSwiftTX::ix - masternode is spamming transaction votes: %s %s\n",
+                    ctx.vinMasternode.ToString().c_str(),
+                    ctx.txHash.ToString().c_str());
+                return;
+            } else {
+                SetUnknownVoteTime(ctx.vinMasternode.prevout.hash, GetTime() + (60 * 10));
+            }
         }
+        RelayInv(inv);
+    }
 
-        return;
+    if (mapTxLockReq.count(ctx.txHash) && GetTransactionLockSignatures(ctx.txHash) == SWIFTTX_SIGNATURES_REQUIRED) {
+        GetMainSignals().NotifyTransactionLock(mapTxLockReq[ctx.txHash]);
+    }
+}
+
+void ProcessConsensusVoteQueue()
+{
+    std::vector<CQueuedConsensusVote> vecVotes;
+    {
+        LOCK(cs_consensusVoteQueue);
+        if (vecConsensusVoteQueue.empty()) return;
+        vecVotes.swap(vecConsensusVoteQueue);
+    }
+
+    // masternode ranks and signatures are checked in parallel
+    std::vector<CConsensusVoteCheck> vChecks;
+    vChecks.reserve(vecVotes.size());
+    for (unsigned int i = 0; i < vecVotes.size(); i++)
+        vChecks.push_back(CConsensusVoteCheck(vecVotes[i].vote, &vecVotes[i].nRank, &vecVotes[i].fValid));
+    if (nScriptCheckThreads && vChecks.size() > 1) {
+        CCheckQueueControl<CConsensusVoteCheck> control(&consensusvotecheckqueue);
+        control.Add(vChecks);
+        control.Wait();
+    } else {
+        for (unsigned int i = 0; i < vChecks.size(); i++)
+            vChecks[i]();
+    }
+
+    // and the votes processed in the order they arrived
+    for (unsigned int i = 0; i < vecVotes.size(); i++) {
+        CQueuedConsensusVote& entry = vecVotes[i];
+        ProcessConsensusVoteMessage(entry.pfrom, entry.vote, entry.nRank, entry.fValid);
+        entry.pfrom->Release();
     }
 }
 
@@ -247,10 +332,10 @@ int64_t CreateNewLock(CTransaction tx)
 
         CTransactionLock newLock;
         newLock.nBlockHeight = nBlockHeight;
-        newLock.nExpiration = GetTime() + (60 * 60); //locks expire after 60 minutes (24 confirmations)
         newLock.nTimeout = GetTime() + (60 * 5);
         newLock.txHash = tx.GetHash();
-        mapTxLocks.insert(make_pair(tx.GetHash(), newLock));
+        //locks expire after 60 minutes (24 confirmations)
+        SetLockExpiration(mapTxLocks.insert(make_pair(tx.GetHash(), newLock)).first->second, GetTime() + (60 * 60));
     } else {
         mapTxLocks[tx.GetHash()].nBlockHeight = nBlockHeight;
         LogPrint("swiftx", "CreateNewLock - Transaction Lock Exists %s !\n", tx.GetHash().ToString().c_str());
@@ -301,10 +386,19 @@ void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight)
     RelayInv(inv);
 }
 
+bool CConsensusVoteCheck::operator()()
+{
+    *pnRank = mnodeman.GetMasternodeRank(vote.vinMasternode, vote.nBlockHeight, MIN_SWIFTTX_PROTO_VERSION);
+    // only votes of the top masternodes need their signature checked
+    *pfValid = *pnRank != -1 && *pnRank <= SWIFTTX_SIGNATURES_TOTAL && vote.SignatureValid();
+    // a bad vote is handled on its own, not as a failure of the batch
+    return true;
+}
+
 //received a consensus vote
-bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
+bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx, int nRank, bool fSignatureValid)
 {
-    int n = mnodeman.GetMasternodeRank(ctx.vinMasternode, ctx.nBlockHeight, MIN_SWIFTTX_PROTO_VERSION);
+    int n = nRank;
 
     CMasternode* pmn = mnodeman.Find(ctx.vinMasternode);
     if (pmn != NULL)
@@ -322,7 +416,7 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
         return false;
     }
 
-    if (!ctx.SignatureValid()) {
+    if (!fSignatureValid) {
         LogPrintf("SwiftX::ProcessConsensusVote - Signature invalid\n");
         // don't ban, it could just be a non-synced masternode
         mnodeman.AskForMN(pnode, ctx.vinMasternode);
@@ -334,17 +428,16 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
 
         CTransactionLock newLock;
         newLock.nBlockHeight = 0;
-        newLock.nExpiration = GetTime() + (60 * 60);
         newLock.nTimeout = GetTime() + (60 * 5);
         newLock.txHash = ctx.txHash;
-        mapTxLocks.insert(make_pair(ctx.txHash, newLock));
+        SetLockExpiration(mapTxLocks.insert(make_pair(ctx.txHash, newLock)).first->second, GetTime() + (60 * 60));
     } else
         LogPrint("swiftx", "SwiftX::ProcessConsensusVote - Transaction Lock Exists %s !\n", ctx.txHash.ToString().c_str());
 
     //compile consessus vote
     std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(ctx.txHash);
     if (i != mapTxLocks.end()) {
-        (*i).second.AddSignature(ctx);
+        (*i).second.AddSignature(ctx, n);
 
 #ifdef ENABLE_WALLET
         if (pwalletMain) {
@@ -370,11 +463,8 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
 #endif
 
                 if (mapTxLockReq.count(ctx.txHash)) {
-                    BOOST_FOREACH (const CTxIn& in, tx.vin) {
-                        if (!mapLockedInputs.count(in.prevout)) {
-                            mapLockedInputs.insert(make_pair(in.prevout, ctx.txHash));
-                        }
-                    }
+                    BOOST_FOREACH (const CTxIn& in, tx.vin)
+                        mapLockedInputs.insert(make_pair(in.prevout, ctx.txHash));
                 }
 
                 // resolve conflicts
@@ -402,14 +492,16 @@ bool CheckForConflictingLocks(CTransaction& tx)
         Blocks could have been rejected during this time, which is OK. After they cancel out, the client will
         rescan the blocks and find they're acceptable and then take the chain with the most work.
     */
+    uint256 hash = tx.GetHash();
     BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                LogPrintf("SwiftX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), mapLockedInputs[in.prevout].ToString().c_str());
-                if (mapTxLocks.count(tx.GetHash())) mapTxLocks[tx.GetHash()].nExpiration = GetTime();
-                if (mapTxLocks.count(mapLockedInputs[in.prevout])) mapTxLocks[mapLockedInputs[in.prevout]].nExpiration = GetTime();
-                return true;
-            }
+        LockedInputMap::const_iterator itLocked = mapLockedInputs.find(in.prevout);
+        if (itLocked != mapLockedInputs.end() && itLocked->second != hash) {
+            LogPrintf("SwiftX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", hash.ToString().c_str(), itLocked->second.ToString().c_str());
+            std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(hash);
+            if (it != mapTxLocks.end()) SetLockExpiration(it->second, GetTime());
+            it = mapTxLocks.find(itLocked->second);
+            if (it != mapTxLocks.end()) SetLockExpiration(it->second, GetTime());
+            return true;
         }
     }
 
@@ -418,46 +510,39 @@ bool CheckForConflictingLocks(CTransaction& tx)
 
 int64_t GetAverageVoteTime()
 {
-    std::map<uint256, int64_t>::iterator it = mapUnknownVotes.begin();
-    int64_t total = 0;
-    int64_t count = 0;
-
-    while (it != mapUnknownVotes.end()) {
-        total += it->second;
-        count++;
-        it++;
-    }
-
-    return total / count;
+    if (mapUnknownVotes.empty()) return 0;
+    return nUnknownVotesTotal / (int64_t)mapUnknownVotes.size();
 }
 
 void CleanTransactionLocksList()
 {
     if (chainActive.Tip() == NULL) return;
 
-    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.begin();
+    int64_t nNow = GetTime();
+    while (!setTxLockExpiry.empty() && setTxLockExpiry.begin()->first < nNow) { //keep them for an hour
+        uint256 txHash = setTxLockExpiry.begin()->second;
+        setTxLockExpiry.erase(setTxLockExpiry.begin());
 
-    while (it != mapTxLocks.end()) {
-        if (GetTime() > it->second.nExpiration) { //keep them for an hour
-            LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
+        std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+        // already removed through an earlier expiration
+        if (it == mapTxLocks.end() || nNow <= it->second.nExpiration) continue;
 
-            if (mapTxLockReq.count(it->second.txHash)) {
-                CTransaction& tx = mapTxLockReq[it->second.txHash];
+        LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
 
-                BOOST_FOREACH (const CTxIn& in, tx.vin)
-                    mapLockedInputs.erase(in.prevout);
+        if (mapTxLockReq.count(it->second.txHash)) {
+            CTransaction& tx = mapTxLockReq[it->second.txHash];
 
-                mapTxLockReq.erase(it->second.txHash);
-                mapTxLockReqRejected.erase(it->second.txHash);
+            BOOST_FOREACH (const CTxIn& in, tx.vin)
+                mapLockedInputs.erase(in.prevout);
 
-                BOOST_FOREACH (CConsensusVote& v, it->second.vecConsensusVotes)
-                    mapTxLockVote.erase(v.GetHash());
-            }
+            mapTxLockReq.erase(it->second.txHash);
+            mapTxLockReqRejected.erase(it->second.txHash);
 
-            mapTxLocks.erase(it++);
-        } else {
-            it++;
+            BOOST_FOREACH (CConsensusVote& v, it->second.vecConsensusVotes)
+                mapTxLockVote.erase(v.GetHash());
         }
+
+        mapTxLocks.erase(it);
     }
 }
 
@@ -530,7 +615,7 @@ bool CConsensusVote::Sign()
 
 bool CTransactionLock::SignaturesValid()
 {
-    BOOST_FOREACH (CConsensusVote vote, vecConsensusVotes) {
+    BOOST_FOREACH (CConsensusVote& vote, vecConsensusVotes) {
         int n = mnodeman.GetMasternodeRank(vote.vinMasternode, vote.nBlockHeight, MIN_SWIFTTX_PROTO_VERSION);
 
         if (n == -1) {
@@ -552,12 +637,14 @@ bool CTransactionLock::SignaturesValid()
     return true;
 }
 
-void CTransactionLock::AddSignature(CConsensusVote& cv)
+void CTransactionLock::AddSignature(const CConsensusVote& cv, int nRank)
 {
     vecConsensusVotes.push_back(cv);
+    if (nRank >= 1 && nRank <= SWIFTTX_SIGNATURES_TOTAL)
+        mapSignedRanks[cv.nBlockHeight].set(nRank - 1);
 }
 
-int CTransactionLock::CountSignatures()
+int CTransactionLock::CountSignatures() const
 {
     /*
         Only count signatures where the BlockHeight matches the transaction's blockheight.
@@ -566,11 +653,7 @@ int CTransactionLock::CountSignatures()
 
     if (nBlockHeight == 0) return -1;
 
-    int n = 0;
-    BOOST_FOREACH (CConsensusVote v, vecConsensusVotes) {
-        if (v.nBlockHeight == nBlockHeight) {
-            n++;
-        }
-    }
-    return n;
+    std::map<int, std::bitset<SWIFTTX_SIGNATURES_TOTAL> >::const_iterator it = mapSignedRanks.find(nBlockHeight);
+    if (it == mapSignedRanks.end()) return 0;
+    return it->second.count();
 }
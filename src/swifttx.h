@@ -14,6 +14,10 @@
 #include "sync.h"
 #include "util.h"
 
+#include <bitset>
+
+#include <boost/unordered_map.hpp>
+
 /*
     At 15 signatures, 1/2 of the masternode network can be owned by
     one party without comprimising the security of SwiftX
@@ -35,11 +39,29 @@ class CTransactionLock;
 
 static const int MIN_SWIFTTX_PROTO_VERSION = 70103;
 
+/** Salted hasher for the index of locked inputs */
+class CLockedInputHasher
+{
+private:
+    uint256 salt;
+
+public:
+    CLockedInputHasher();
+
+    size_t operator()(const COutPoint& outpoint) const
+    {
+        return outpoint.hash.GetHash(salt) ^ outpoint.n;
+    }
+};
+
+typedef boost::unordered_map<COutPoint, uint256, CLockedInputHasher> LockedInputMap;
+
 extern map<uint256, CTransaction> mapTxLockReq;
 extern map<uint256, CTransaction> mapTxLockReqRejected;
 extern map<uint256, CConsensusVote> mapTxLockVote;
 extern map<uint256, CTransactionLock> mapTxLocks;
-extern std::map<COutPoint, uint256> mapLockedInputs;
+// locked input -> hash of the transaction holding the lock
+extern LockedInputMap mapLockedInputs;
 extern int nCompleteTXLocks;
 
 
@@ -55,8 +77,13 @@ void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& v
 //check if we need to vote on this transaction
 void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight);
 
-//process consensus vote message
-bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx);
+//process consensus vote message, once its rank and signature have been checked
+bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx, int nRank, bool fSignatureValid);
+
+// check the consensus votes received since the last call and process them
+void ProcessConsensusVoteQueue();
+
+void ThreadConsensusVoteCheck();
 
 // keep transaction locks in memory for an hour
 void CleanTransactionLocksList();
@@ -91,8 +118,36 @@ public:
     }
 };
 
+/** Rank and signature check of a received consensus vote, run on the
+ *  consensus vote check threads. The outcome is stored per vote.
+ */
+class CConsensusVoteCheck
+{
+private:
+    CConsensusVote vote;
+    int* pnRank;
+    bool* pfValid;
+
+public:
+    CConsensusVoteCheck() : pnRank(NULL), pfValid(NULL) {}
+    CConsensusVoteCheck(const CConsensusVote& voteIn, int* pnRankIn, bool* pfValidIn) : vote(voteIn), pnRank(pnRankIn), pfValid(pfValidIn) {}
+
+    bool operator()();
+
+    void swap(CConsensusVoteCheck& check)
+    {
+        std::swap(vote, check.vote);
+        std::swap(pnRank, check.pnRank);
+        std::swap(pfValid, check.pfValid);
+    }
+};
+
 class CTransactionLock
 {
+private:
+    // ranks of the masternodes that signed, by the block height they voted for
+    std::map<int, std::bitset<SWIFTTX_SIGNATURES_TOTAL> > mapSignedRanks;
+
 public:
     int nBlockHeight;
     uint256 txHash;
@@ -101,8 +156,8 @@ public:
     int nTimeout;
 
     bool SignaturesValid();
-    int CountSignatures();
-    void AddSignature(CConsensusVote& cv);
+    int CountSignatures() const;
+    void AddSignature(const CConsensusVote& cv, int nRank);
 
     uint256 GetHash()
     {
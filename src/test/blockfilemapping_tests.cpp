@@ -0,0 +1,102 @@
+// Copyright (c) 2019-2020 The BITWIN24 developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilemapping.h"
+#include "clientversion.h"
+#include "main.h"
+#include "script/script.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockfilemapping_tests)
+
+static CBlock MakeBlock(uint32_t n)
+{
+    CBlock block;
+    block.nTime = n;
+    block.nBits = 0x207fffff;
+    for (uint32_t i = 0; i < 3; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].scriptSig = CScript() << n << i;
+        tx.vout.resize(i + 1);
+        tx.vout[0].nValue = n;
+        block.vtx.push_back(CTransaction(tx));
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+/** Append blocks to block file nFile, which ends at nPos */
+static void AppendBlocks(int nFile, unsigned int& nPos, uint32_t nFirst, uint32_t nCount, std::vector<CBlock>& vBlocks, std::vector<CDiskBlockPos>& vPos)
+{
+    for (uint32_t n = nFirst; n < nFirst + nCount; n++) {
+        CBlock block = MakeBlock(n);
+        CDiskBlockPos pos(nFile, nPos);
+        BOOST_REQUIRE(WriteBlockToDisk(block, pos));
+        nPos = pos.nPos + ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+        vBlocks.push_back(block);
+        vPos.push_back(pos);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(blockfilemapping_read)
+{
+    CBlockFileMappings mappings(2);
+    std::vector<CBlock> vBlocks;
+    std::vector<CDiskBlockPos> vPos;
+    unsigned int nPos[3] = {0, 0, 0};
+    for (int nFile = 0; nFile < 3; nFile++)
+        AppendBlocks(100 + nFile, nPos[nFile], 10 * nFile, 10, vBlocks, vPos);
+
+    // reading the files in turn keeps remapping them, as only two stay mapped
+    for (unsigned int i = 0; i < 10; i++) {
+        for (unsigned int j = i; j < vBlocks.size(); j += 10) {
+            CBlock block;
+            BOOST_CHECK(mappings.ReadBlock(vPos[j], block));
+            BOOST_CHECK(block.GetHash() == vBlocks[j].GetHash());
+            BOOST_CHECK_EQUAL(block.vtx.size(), 3);
+        }
+    }
+
+    // transactions are found by their offset behind the block header, as in the transaction index
+    for (unsigned int i = 0; i < vBlocks.size(); i += 7) {
+        unsigned int nTxOffset = GetSizeOfCompactSize(vBlocks[i].vtx.size());
+        for (const CTransaction& txExpected : vBlocks[i].vtx) {
+            CBlockHeader header;
+            CTransaction tx;
+            BOOST_CHECK(mappings.ReadTransaction(vPos[i], nTxOffset, header, tx));
+            BOOST_CHECK(header.GetHash() == vBlocks[i].GetHash());
+            BOOST_CHECK(tx.GetHash() == txExpected.GetHash());
+            nTxOffset += ::GetSerializeSize(txExpected, SER_DISK, CLIENT_VERSION);
+        }
+    }
+
+    // blocks appended to a mapped file are read after mapping it again
+    AppendBlocks(100, nPos[0], 1000, 5, vBlocks, vPos);
+    for (unsigned int i = vBlocks.size() - 5; i < vBlocks.size(); i++) {
+        CBlock block;
+        BOOST_CHECK(mappings.ReadBlock(vPos[i], block));
+        BOOST_CHECK(block.GetHash() == vBlocks[i].GetHash());
+    }
+
+    // positions without a block behind them are left to the caller
+    CBlock block;
+    BOOST_CHECK(!mappings.ReadBlock(CDiskBlockPos(), block));
+    BOOST_CHECK(!mappings.ReadBlock(CDiskBlockPos(100, 0), block));
+    BOOST_CHECK(!mappings.ReadBlock(CDiskBlockPos(100, nPos[0] + 100), block));
+    BOOST_CHECK(!mappings.ReadBlock(CDiskBlockPos(200, 8), block));
+
+    // and an invalidated mapping is replaced on the next read
+    mappings.Invalidate(101);
+    BOOST_CHECK(mappings.ReadBlock(vPos[15], block));
+    BOOST_CHECK(block.GetHash() == vBlocks[15].GetHash());
+    mappings.Clear();
+    BOOST_CHECK(mappings.ReadBlock(vPos[25], block));
+    BOOST_CHECK(block.GetHash() == vBlocks[25].GetHash());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
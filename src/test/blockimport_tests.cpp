@@ -0,0 +1,115 @@
+// Copyright (c) 2019-2020 The BITWIN24 developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockimport.h"
+#include "chainparams.h"
+#include "clientversion.h"
+#include "script/script.h"
+#include "streams.h"
+
+#include <stdio.h>
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockimport_tests)
+
+static CBlock MakeBlock(uint32_t n, const uint256& hashPrevBlock)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << n << OP_0;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = n;
+
+    CBlock block;
+    block.hashPrevBlock = hashPrevBlock;
+    block.nTime = n;
+    block.nBits = 0x207fffff;
+    block.vtx.push_back(CTransaction(tx));
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+/** Append a block in the format of the block files, and return the position of its data */
+static unsigned int WriteBlock(CDataStream& ss, const CBlock& block)
+{
+    ss << FLATDATA(Params().MessageStart()) << (unsigned int)::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+    unsigned int nPos = ss.size();
+    ss << block;
+    return nPos;
+}
+
+static FILE* WriteFile(const CDataStream& ss)
+{
+    FILE* file = tmpfile();
+    BOOST_REQUIRE(file);
+    BOOST_REQUIRE_EQUAL(fwrite(&ss[0], 1, ss.size(), file), ss.size());
+    rewind(file);
+    return file;
+}
+
+BOOST_AUTO_TEST_CASE(blockimport_read)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    std::vector<CBlock> vBlocks;
+    std::vector<unsigned int> vPos;
+    uint256 hashPrev;
+    for (uint32_t n = 0; n < 3 * IMPORT_HASH_BATCH + 5; n++) {
+        // garbage and headers with impossible sizes between the blocks are skipped
+        if (n % 7 == 0)
+            ss << (uint32_t)0xffffffff;
+        if (n % 11 == 0)
+            ss << FLATDATA(Params().MessageStart()) << (unsigned int)10;
+        vBlocks.push_back(MakeBlock(n, hashPrev));
+        vPos.push_back(WriteBlock(ss, vBlocks.back()));
+        hashPrev = vBlocks.back().GetHash();
+    }
+    // a block cut off at the end of the file is dropped
+    CDataStream ssLast(SER_DISK, CLIENT_VERSION);
+    WriteBlock(ssLast, MakeBlock(1000, hashPrev));
+    ss.write(&ssLast[0], ssLast.size() - 1);
+
+    CBlockFileReader reader(WriteFile(ss), 7);
+    CImportedBlock imported;
+    for (unsigned int i = 0; i < vBlocks.size(); i++) {
+        BOOST_REQUIRE(reader.Next(imported));
+        BOOST_CHECK(imported.hash == vBlocks[i].GetHash());
+        BOOST_CHECK(imported.block.GetHash() == imported.hash);
+        BOOST_CHECK(imported.block.vtx[0].GetHash() == vBlocks[i].vtx[0].GetHash());
+        BOOST_CHECK_EQUAL(imported.pos.nFile, 7);
+        BOOST_CHECK_EQUAL(imported.pos.nPos, vPos[i]);
+    }
+    BOOST_CHECK(!reader.Next(imported));
+    BOOST_CHECK(!reader.Next(imported));
+}
+
+BOOST_AUTO_TEST_CASE(blockimport_stop)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    uint256 hashPrev;
+    for (uint32_t n = 0; n < 10 * IMPORT_HASH_BATCH; n++) {
+        CBlock block = MakeBlock(n, hashPrev);
+        WriteBlock(ss, block);
+        hashPrev = block.GetHash();
+    }
+
+    // the reader thread stops when the blocks are not wanted anymore
+    {
+        CBlockFileReader reader(WriteFile(ss), 0);
+        CImportedBlock imported;
+        BOOST_CHECK(reader.Next(imported));
+        BOOST_CHECK(imported.block.hashPrevBlock.IsNull());
+    }
+
+    // and an empty file has no blocks
+    CDataStream ssEmpty(SER_DISK, CLIENT_VERSION);
+    ssEmpty << (uint32_t)0;
+    CBlockFileReader reader(WriteFile(ssEmpty), 0);
+    CImportedBlock imported;
+    BOOST_CHECK(!reader.Next(imported));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,88 @@
+// Copyright (c) 2019-2020 The BITWIN24 developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain.h"
+#include "chainparams.h"
+#include "main.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockvalue_tests)
+
+namespace
+{
+/** Fake active chain reaching past START_HEIGHT_REWARD_BASED_ON_MN_COUNT. */
+struct FakeChain
+{
+    std::vector<uint256> vHashes;
+    std::vector<CBlockIndex> vBlocks;
+    CBlockIndex* pindexOldTip;
+
+    FakeChain(int nBlocks) : vHashes(nBlocks), vBlocks(nBlocks)
+    {
+        pindexOldTip = chainActive.Tip();
+        for (int i = 0; i < nBlocks; i++) {
+            vHashes[i] = uint256(i + 1) << 64;
+            vBlocks[i].phashBlock = &vHashes[i];
+            vBlocks[i].pprev = i ? &vBlocks[i - 1] : NULL;
+            vBlocks[i].nHeight = i;
+            // vary the reward so every block maps to a different masternode count
+            vBlocks[i].nMoneySupply = i ? vBlocks[i - 1].nMoneySupply + (100 + i % 37) * COIN : 0;
+        }
+        InvalidateBlockRewardCache(0);
+        chainActive.SetTip(&vBlocks.back());
+    }
+
+    ~FakeChain()
+    {
+        chainActive.SetTip(pindexOldTip);
+        InvalidateBlockRewardCache(0);
+    }
+};
+
+/** Mirrors the reward checks ConnectBlock performs for the block at nHeight. */
+int CheckReward(int nHeight, bool fCold)
+{
+    if (fCold)
+        InvalidateBlockRewardCache(0);
+    CAmount nExpectedMint = GetBlockValue(nHeight);
+    int errorCode;
+    if (fCold)
+        InvalidateBlockRewardCache(0);
+    int nCount = GetMasterNodeCountBasedOnBlockReward(nHeight, nExpectedMint, errorCode);
+    // the signature check paths query the same values once more
+    if (fCold)
+        InvalidateBlockRewardCache(0);
+    BOOST_CHECK_EQUAL(GetBlockValue(nHeight), nExpectedMint);
+    return nCount;
+}
+} // anon namespace
+
+BOOST_AUTO_TEST_CASE(blockvalue_cache_consistency)
+{
+    FakeChain chain(START_HEIGHT_REWARD_BASED_ON_MN_COUNT + 200);
+    int nTip = chainActive.Height();
+
+    for (int nHeight = START_HEIGHT_REWARD_BASED_ON_MN_COUNT; nHeight <= nTip; nHeight++) {
+        CAmount nExpected = chainActive[nHeight]->nMoneySupply - chainActive[nHeight - 1]->nMoneySupply;
+        BOOST_CHECK_EQUAL(GetBlockValue(nHeight), nExpected);
+        BOOST_CHECK_EQUAL(GetBlockValue(nHeight), nExpected);
+        BOOST_CHECK_EQUAL(CheckReward(nHeight, false), CheckReward(nHeight, true));
+    }
+
+    // Disconnecting the tip must drop its cached value
+    CBlockIndex* pindexTip = chainActive.Tip();
+    CAmount nOldValue = GetBlockValue(nTip);
+    chainActive.SetTip(pindexTip->pprev);
+    InvalidateBlockRewardCache(nTip);
+    pindexTip->nMoneySupply += 1000 * COIN;
+    chainActive.SetTip(pindexTip);
+    BOOST_CHECK_EQUAL(GetBlockValue(nTip), nOldValue + 1000 * COIN);
+
+    // Values above the tip follow the tip and the requested masternode count
+    BOOST_CHECK(GetBlockValue(nTip + 1, 100) != GetBlockValue(nTip + 1, 200));
+    BOOST_CHECK_EQUAL(GetBlockValue(nTip + 1, 100), GetBlockValue(nTip + 1, 100));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
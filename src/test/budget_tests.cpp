@@ -2,7 +2,9 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "clientversion.h"
 #include "masternode-budget.h"
+#include "streams.h"
 #include "tinyformat.h"
 #include "utilmoneystr.h"
 
@@ -29,4 +31,75 @@ BOOST_AUTO_TEST_CASE(budget_value)
     CheckBudgetValue(nHeightTest, "mainnet", 43200*COIN);
 }
 
+BOOST_AUTO_TEST_CASE(budget_vote_check)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+
+    CBudgetVote vote(CTxIn(COutPoint(uint256(1), 0)), uint256(2), VOTE_YES);
+    CPubKey pubKey = key.GetPubKey();
+    BOOST_REQUIRE(vote.Sign(key, pubKey));
+    CFinalizedBudgetVote finalizedVote(CTxIn(COutPoint(uint256(3), 1)), uint256(4));
+    BOOST_REQUIRE(finalizedVote.Sign(key, pubKey));
+
+    // a bad vote fails on its own, the batch as a whole always passes
+    bool fValid[4] = {false, false, true, true};
+    std::vector<CBudgetVoteCheck> vChecks;
+    vChecks.push_back(CBudgetVoteCheck(pubKey, vote.GetSignatureMessage(), vote.vchSig, &fValid[0]));
+    vChecks.push_back(CBudgetVoteCheck(pubKey, finalizedVote.GetSignatureMessage(), finalizedVote.vchSig, &fValid[1]));
+    vChecks.push_back(CBudgetVoteCheck(keyOther.GetPubKey(), vote.GetSignatureMessage(), vote.vchSig, &fValid[2]));
+    vote.nVote = VOTE_NO;
+    vChecks.push_back(CBudgetVoteCheck(pubKey, vote.GetSignatureMessage(), vote.vchSig, &fValid[3]));
+    for (unsigned int i = 0; i < vChecks.size(); i++)
+        BOOST_CHECK(vChecks[i]());
+
+    BOOST_CHECK(fValid[0]);
+    BOOST_CHECK(fValid[1]);
+    BOOST_CHECK(!fValid[2]);
+    BOOST_CHECK(!fValid[3]);
+}
+
+BOOST_AUTO_TEST_CASE(budget_orphan_votes)
+{
+    CBudgetOrphanVotes<CBudgetVote> orphans(5);
+    std::vector<CBudgetVote> vVotes;
+    for (uint32_t n = 0; n < 6; n++) {
+        CBudgetVote vote(CTxIn(COutPoint(uint256(100 + n), 0)), uint256(n % 2 + 1), VOTE_YES);
+        vVotes.push_back(vote);
+        BOOST_CHECK(orphans.insert(vote, 1000 + n));
+    }
+    BOOST_CHECK(!orphans.insert(vVotes[5], 2000));
+
+    // the longest waiting vote made room
+    BOOST_CHECK_EQUAL(orphans.size(), 5);
+    BOOST_CHECK_EQUAL(orphans.count(uint256(1)), 2);
+    BOOST_CHECK_EQUAL(orphans.count(uint256(2)), 3);
+
+    // older files keyed the votes by parent, both read back the same way
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << orphans;
+    CBudgetOrphanVotes<CBudgetVote> orphansRead(5);
+    ss >> orphansRead;
+    BOOST_CHECK_EQUAL(orphansRead.size(), 5);
+    std::map<uint256, CBudgetVote> mapLegacy;
+    mapLegacy[vVotes[0].nProposalHash] = vVotes[0];
+    ss << mapLegacy;
+    ss >> orphansRead;
+    BOOST_CHECK_EQUAL(orphansRead.count(uint256(1)), 1);
+
+    // a parent only takes its own votes, in arrival order
+    std::vector<CBudgetVote> vTaken = orphans.take(uint256(2));
+    BOOST_REQUIRE_EQUAL(vTaken.size(), 3);
+    BOOST_CHECK(vTaken[0].GetHash() == vVotes[1].GetHash());
+    BOOST_CHECK(vTaken[2].GetHash() == vVotes[5].GetHash());
+    BOOST_CHECK(orphans.take(uint256(2)).empty());
+    BOOST_CHECK_EQUAL(orphans.size(), 2);
+
+    BOOST_CHECK_EQUAL(orphans.expire(1003), 1);
+    BOOST_CHECK_EQUAL(orphans.count(uint256(1)), 1);
+    BOOST_CHECK_EQUAL(orphans.expire(1003), 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
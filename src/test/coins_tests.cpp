@@ -3,8 +3,12 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "coins.h"
+#include "coinsprefetch.h"
+#include "main.h"
 #include "random.h"
+#include "txdb.h"
 #include "uint256.h"
+#include "undo.h"
 
 #include <vector>
 #include <map>
@@ -16,48 +20,119 @@ namespace
 class CCoinsViewTest : public CCoinsView
 {
     uint256 hashBestBlock_;
-    std::map<uint256, CCoins> map_;
+    std::map<COutPoint, Coin> map_;
 
 public:
-    bool GetCoins(const uint256& txid, CCoins& coins) const
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const
     {
-        std::map<uint256, CCoins>::const_iterator it = map_.find(txid);
+        std::map<COutPoint, Coin>::const_iterator it = map_.find(outpoint);
         if (it == map_.end()) {
             return false;
         }
-        coins = it->second;
-        if (coins.IsPruned() && insecure_rand() % 2 == 0) {
+        coin = it->second;
+        if (coin.IsSpent() && insecure_rand() % 2 == 0) {
             // Randomly return false in case of an empty entry.
             return false;
         }
         return true;
     }
 
-    bool HaveCoins(const uint256& txid) const
+    bool HaveCoin(const COutPoint& outpoint) const
     {
-        CCoins coins;
-        return GetCoins(txid, coins);
+        Coin coin;
+        return GetCoin(outpoint, coin) && !coin.IsSpent();
     }
 
     uint256 GetBestBlock() const { return hashBestBlock_; }
 
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, bool fErase)
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
-            map_[it->first] = it->second.coins;
-            if (it->second.coins.IsPruned() && insecure_rand() % 3 == 0) {
-                // Randomly delete empty entries on write.
-                map_.erase(it->first);
+            if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+                // Same optimization used in CCoinsViewDB is to only write dirty entries.
+                map_[it->first] = it->second.coin;
+                if (it->second.coin.IsSpent() && insecure_rand() % 3 == 0) {
+                    // Randomly delete empty entries on write.
+                    map_.erase(it->first);
+                }
             }
-            mapCoins.erase(it++);
+            if (fErase)
+                mapCoins.erase(it++);
+            else
+                ++it;
         }
-        mapCoins.clear();
+        if (fErase)
+            mapCoins.clear();
         hashBestBlock_ = hashBlock;
         return true;
     }
 
     bool GetStats(CCoinsStats& stats) const { return false; }
 };
+
+class CCoinsViewCacheTest : public CCoinsViewCache
+{
+public:
+    CCoinsViewCacheTest(CCoinsView* base) : CCoinsViewCache(base) {}
+
+    void SelfTest() const
+    {
+        // Manually recompute the dynamic usage of the whole data, and compare it.
+        size_t ret = memusage::DynamicUsage(cacheCoins);
+        size_t count = 0;
+        for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+            ret += it->second.coin.DynamicMemoryUsage();
+            ++count;
+        }
+        BOOST_CHECK_EQUAL(GetCacheSize(), count);
+        BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
+    }
+
+    bool IsDirty(const COutPoint& outpoint) const
+    {
+        CCoinsMap::const_iterator it = cacheCoins.find(outpoint);
+        return it != cacheCoins.end() && (it->second.flags & CCoinsCacheEntry::DIRTY);
+    }
+};
+
+/** Coin database that also writes records in the per-transaction format of older versions */
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBTest() : CCoinsViewDB(1 << 20, true, true) {}
+
+    template <typename V>
+    void WriteLegacy(const uint256& txid, const V& value)
+    {
+        BOOST_CHECK(db.Write(std::make_pair('c', txid), value));
+    }
+};
+
+/** Serializes as the CCoins record of a coinstake with vout[1] spent */
+struct LegacyCoinStake {
+    std::vector<CTxOut> vout;
+    int nHeight;
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return ::GetSerializeSize(VARINT(1), nType, nVersion) + ::GetSerializeSize(VARINT(2 + 4 + 16), nType, nVersion) + 1 +
+               ::GetSerializeSize(CTxOutCompressor(REF(vout[0])), nType, nVersion) +
+               ::GetSerializeSize(CTxOutCompressor(REF(vout[2])), nType, nVersion) +
+               ::GetSerializeSize(VARINT(nHeight), nType, nVersion);
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        // version, then coinstake, vout[0] unspent and one non-zero mask byte
+        ::Serialize(s, VARINT(1), nType, nVersion);
+        ::Serialize(s, VARINT(2 + 4 + 16), nType, nVersion);
+        ::Serialize(s, (unsigned char)1, nType, nVersion);
+        ::Serialize(s, CTxOutCompressor(REF(vout[0])), nType, nVersion);
+        ::Serialize(s, CTxOutCompressor(REF(vout[2])), nType, nVersion);
+        ::Serialize(s, VARINT(nHeight), nType, nVersion);
+    }
+};
 }
 
 BOOST_AUTO_TEST_SUITE(coins_tests)
@@ -67,8 +142,8 @@ static const unsigned int NUM_SIMULATION_ITERATIONS = 40000;
 // This is a large randomized insert/remove simulation test on a variable-size
 // stack of caches on top of CCoinsViewTest.
 //
-// It will randomly create/update/delete CCoins entries to a tip of caches, with
-// txids picked from a limited list of random 256-bit hashes. Occasionally, a
+// It will randomly create/update/delete Coin entries to a tip of caches, with
+// outpoints picked from a limited list of random 256-bit hashes. Occasionally, a
 // new tip is added to the stack of caches, or the tip is flushed and removed.
 //
 // During the process, booleans are kept to make sure that the randomized
@@ -83,14 +158,16 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
+    bool uncached_an_entry = false;
+    bool synced_a_cache = false;
 
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
-    std::vector<CCoinsViewCache*> stack; // A stack of CCoinsViewCaches on top.
-    stack.push_back(new CCoinsViewCache(&base)); // Start with one cache.
+    std::vector<CCoinsViewCacheTest*> stack; // A stack of CCoinsViewCaches on top.
+    stack.push_back(new CCoinsViewCacheTest(&base)); // Start with one cache.
 
     // Use a limited set of random transaction ids, so we do test overwriting entries.
     std::vector<uint256> txids;
@@ -102,56 +179,86 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     for (unsigned int i = 0; i < NUM_SIMULATION_ITERATIONS; i++) {
         // Do a random modification.
         {
-            uint256 txid = txids[insecure_rand() % txids.size()]; // txid we're going to modify in this iteration.
-            CCoins& coins = result[txid];
-            CCoinsModifier entry = stack.back()->ModifyCoins(txid);
-            BOOST_CHECK(coins == *entry);
-            if (insecure_rand() % 5 == 0 || coins.IsPruned()) {
-                if (coins.IsPruned()) {
+            COutPoint outpoint(txids[insecure_rand() % txids.size()], insecure_rand() % 2); // outpoint we're going to modify in this iteration.
+            Coin& coin = result[outpoint];
+            const Coin& entry = stack.back()->AccessCoin(outpoint);
+            BOOST_CHECK(coin == entry);
+
+            if (insecure_rand() % 5 == 0 || coin.IsSpent()) {
+                Coin newcoin;
+                newcoin.out.nValue = insecure_rand();
+                newcoin.out.scriptPubKey.assign(insecure_rand() & 0x3F, 0);
+                newcoin.nHeight = 1;
+                if (coin.IsSpent()) {
                     added_an_entry = true;
                 } else {
                     updated_an_entry = true;
                 }
-                coins.nVersion = insecure_rand();
-                coins.vout.resize(1);
-                coins.vout[0].nValue = insecure_rand();
-                *entry = coins;
+                coin = newcoin;
+                stack.back()->AddCoin(outpoint, std::move(newcoin), !coin.IsSpent() || insecure_rand() & 1);
             } else {
-                coins.Clear();
-                entry->Clear();
                 removed_an_entry = true;
+                coin.Clear();
+                stack.back()->SpendCoin(outpoint);
             }
         }
 
+        // One every 10 iterations, remove a random entry from the cache
+        if (insecure_rand() % 10 == 0) {
+            COutPoint outpoint(txids[insecure_rand() % txids.size()], 0);
+            int cacheid = insecure_rand() % stack.size();
+            stack[cacheid]->Uncache(outpoint);
+            uncached_an_entry |= !stack[cacheid]->HaveCoinInCache(outpoint);
+        }
+
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                    found_an_entry = true;
-                } else {
-                    BOOST_CHECK(it->second.IsPruned());
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
+                if (coin.IsSpent()) {
                     missed_an_entry = true;
+                } else {
+                    BOOST_CHECK(stack.back()->HaveCoinInCache(it->first));
+                    found_an_entry = true;
                 }
             }
+            BOOST_FOREACH (const CCoinsViewCacheTest* test, stack) {
+                test->SelfTest();
+            }
         }
 
+        if (insecure_rand() % 100 == 0) {
+            // Every 100 iterations, flush or sync an intermediate cache
+            if (stack.size() > 1 && insecure_rand() % 2 == 0) {
+                unsigned int flushIndex = insecure_rand() % (stack.size() - 1);
+                if (insecure_rand() % 2 == 0) {
+                    stack[flushIndex]->Flush();
+                } else {
+                    stack[flushIndex]->Sync();
+                    synced_a_cache = true;
+                }
+            }
+        }
         if (insecure_rand() % 100 == 0) {
             // Every 100 iterations, change the cache stack.
             if (stack.size() > 0 && insecure_rand() % 2 == 0) {
+                //Remove the top cache
                 stack.back()->Flush();
                 delete stack.back();
                 stack.pop_back();
             }
             if (stack.size() == 0 || (stack.size() < 4 && insecure_rand() % 2)) {
+                //Add a new cache
                 CCoinsView* tip = &base;
                 if (stack.size() > 0) {
                     tip = stack.back();
                 } else {
                     removed_all_caches = true;
                 }
-                stack.push_back(new CCoinsViewCache(tip));
+                stack.push_back(new CCoinsViewCacheTest(tip));
                 if (stack.size() == 4) {
                     reached_4_caches = true;
                 }
@@ -173,6 +280,228 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
     BOOST_CHECK(missed_an_entry);
+    BOOST_CHECK(uncached_an_entry);
+    BOOST_CHECK(synced_a_cache);
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_sync_and_trim)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+    std::vector<COutPoint> vOutpoints;
+    for (unsigned int i = 0; i < 100; i++) {
+        Coin coin;
+        coin.out.nValue = 1000;
+        coin.out.scriptPubKey.assign(25 + i, 0);
+        coin.nHeight = 1;
+        vOutpoints.push_back(COutPoint(GetRandHash(), 0));
+        cache.AddCoin(vOutpoints.back(), std::move(coin), false);
+    }
+    cache.SelfTest();
+    size_t nUsage = cache.DynamicMemoryUsage();
+
+    // modified entries are never dropped
+    cache.Trim(0);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 100);
+
+    // syncing writes the modifications but keeps the coins cached
+    BOOST_CHECK(cache.SpendCoin(vOutpoints[0]));
+    BOOST_CHECK(cache.Sync());
+    cache.SelfTest();
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 99);
+    BOOST_CHECK(!base.HaveCoin(vOutpoints[0]));
+    for (unsigned int i = 1; i < vOutpoints.size(); i++) {
+        BOOST_CHECK(base.HaveCoin(vOutpoints[i]));
+        BOOST_CHECK(cache.HaveCoinInCache(vOutpoints[i]));
+        BOOST_CHECK(!cache.IsDirty(vOutpoints[i]));
+    }
+
+    // once written, entries are dropped until the cache fits its target
+    BOOST_CHECK(cache.SpendCoin(vOutpoints[1]));
+    cache.Trim(nUsage / 2);
+    cache.SelfTest();
+    BOOST_CHECK(cache.DynamicMemoryUsage() <= nUsage / 2);
+    BOOST_CHECK(cache.GetCacheSize() > 1);
+    BOOST_CHECK(cache.IsDirty(vOutpoints[1]));
+    for (unsigned int i = 2; i < vOutpoints.size(); i++)
+        BOOST_CHECK(cache.AccessCoin(vOutpoints[i]).out.nValue == 1000);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!base.HaveCoin(vOutpoints[1]));
+    cache.SelfTest();
+}
+
+BOOST_AUTO_TEST_CASE(coins_prefetch)
+{
+    // outputs of an earlier block, written to the coin database only
+    CMutableTransaction txPrev;
+    txPrev.vin.resize(1);
+    txPrev.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txPrev.vout.resize(4);
+    for (unsigned int i = 0; i < txPrev.vout.size(); i++) {
+        txPrev.vout[i].nValue = 1000;
+        txPrev.vout[i].scriptPubKey = CScript() << OP_TRUE;
+    }
+    uint256 txidPrev = CTransaction(txPrev).GetHash();
+    {
+        LOCK(cs_main);
+        AddCoins(*pcoinsTip, txPrev, 1);
+        BOOST_CHECK(pcoinsTip->Sync());
+        pcoinsTip->Trim(0);
+        BOOST_CHECK(!pcoinsTip->HaveCoinInCache(COutPoint(txidPrev, 0)));
+    }
+
+    CBlock block;
+    block.hashPrevBlock = chainActive.Tip()->GetBlockHash();
+    block.vtx.resize(3);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].prevout.SetNull();
+    CMutableTransaction tx;
+    tx.vin.resize(3);
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+        tx.vin[i].prevout = COutPoint(txidPrev, i);
+    tx.vout = txPrev.vout;
+    block.vtx[1] = tx;
+    // spending an output of the block itself needs nothing from the database
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(block.vtx[1].GetHash(), 0);
+    block.vtx[2] = txChild;
+
+    std::vector<COutPoint> vPrevouts;
+    GetBlockPrevouts(block, vPrevouts);
+    BOOST_CHECK_EQUAL(vPrevouts.size(), 3);
+
+    CCoinsPrefetchStats statsBefore;
+    {
+        LOCK(cs_main);
+        statsBefore = GetCoinsPrefetchStats();
+    }
+    {
+        CCoinsPrefetcher prefetcher;
+        prefetcher.Start(block);
+        LOCK(cs_main);
+        prefetcher.Finish();
+        for (unsigned int i = 0; i < 3; i++)
+            BOOST_CHECK(pcoinsTip->HaveCoinInCache(COutPoint(txidPrev, i)));
+        BOOST_CHECK(!pcoinsTip->HaveCoinInCache(COutPoint(txidPrev, 3)));
+        RecordCoinsCacheHits(block);
+        CCoinsPrefetchStats stats = GetCoinsPrefetchStats();
+        BOOST_CHECK_EQUAL(stats.nBlocks, statsBefore.nBlocks + 1);
+        BOOST_CHECK_EQUAL(stats.nWarmed, statsBefore.nWarmed + 3);
+        BOOST_CHECK_EQUAL(stats.nInputs, statsBefore.nInputs + 3);
+        BOOST_CHECK_EQUAL(stats.nHits, statsBefore.nHits + 3);
+        pcoinsTip->Trim(0);
+    }
+
+    // coins read while the database is written to are not used
+    {
+        CCoinsPrefetcher prefetcher;
+        prefetcher.Start(block);
+        LOCK(cs_main);
+        BOOST_CHECK(pcoinsTip->SpendCoin(COutPoint(txidPrev, 0)));
+        BOOST_CHECK(pcoinsTip->Sync());
+        prefetcher.Finish();
+        BOOST_CHECK(!pcoinsTip->HaveCoin(COutPoint(txidPrev, 0)));
+        BOOST_CHECK(!pcoinsTip->HaveCoinInCache(COutPoint(txidPrev, 1)));
+        BOOST_CHECK_EQUAL(GetCoinsPrefetchStats().nWarmed, statsBefore.nWarmed + 3);
+    }
+
+    // blocks not building on the tip are left alone
+    block.hashPrevBlock = GetRandHash();
+    {
+        CCoinsPrefetcher prefetcher;
+        prefetcher.Start(block);
+        LOCK(cs_main);
+        prefetcher.Finish();
+        BOOST_CHECK(!pcoinsTip->HaveCoinInCache(COutPoint(txidPrev, 1)));
+        for (unsigned int i = 1; i < txPrev.vout.size(); i++)
+            BOOST_CHECK(pcoinsTip->SpendCoin(COutPoint(txidPrev, i)));
+        BOOST_CHECK(pcoinsTip->Sync());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(coins_spend_and_undo)
+{
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(3);
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        tx.vout[i].nValue = (i + 1) * 1000;
+        tx.vout[i].scriptPubKey = CScript() << OP_TRUE;
+    }
+    tx.vout[2].scriptPubKey = CScript() << OP_RETURN;
+    AddCoins(view, tx, 100);
+    uint256 txid = CTransaction(tx).GetHash();
+
+    // unspendable outputs never enter the set
+    BOOST_CHECK(view.HaveCoin(COutPoint(txid, 0)));
+    BOOST_CHECK(view.HaveCoin(COutPoint(txid, 1)));
+    BOOST_CHECK(!view.HaveCoin(COutPoint(txid, 2)));
+    BOOST_CHECK_EQUAL(view.GetCacheSize(), 2);
+
+    // spending one output leaves its sibling and hands out the spent coin for undo data
+    CTxUndo txundo;
+    txundo.vprevout.emplace_back();
+    BOOST_CHECK(view.SpendCoin(COutPoint(txid, 0), &txundo.vprevout.back()));
+    BOOST_CHECK(!view.HaveCoin(COutPoint(txid, 0)));
+    BOOST_CHECK(!view.SpendCoin(COutPoint(txid, 0)));
+    BOOST_CHECK_EQUAL(AccessByTxid(view, txid).out.nValue, 2000);
+    BOOST_CHECK_EQUAL(txundo.vprevout[0].nHeight, 100);
+    BOOST_CHECK_EQUAL(txundo.vprevout[0].out.nValue, 1000);
+
+    // undo records keep their metadata with every spent output
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << txundo;
+    BOOST_CHECK_EQUAL(ss.size(), ::GetSerializeSize(txundo, SER_DISK, CLIENT_VERSION));
+    CTxUndo txundoRead;
+    ss >> txundoRead;
+    BOOST_CHECK(txundoRead.vprevout[0] == txundo.vprevout[0]);
+
+    view.AddCoin(COutPoint(txid, 0), std::move(txundoRead.vprevout[0]), false);
+    BOOST_CHECK_EQUAL(view.AccessCoin(COutPoint(txid, 0)).out.nValue, 1000);
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_upgrade)
+{
+    CCoinsViewDBTest db;
+
+    LegacyCoinStake legacy;
+    legacy.vout.resize(3);
+    for (unsigned int i = 0; i < legacy.vout.size(); i++) {
+        legacy.vout[i].nValue = (i + 1) * 1000;
+        legacy.vout[i].scriptPubKey = CScript() << OP_TRUE;
+    }
+    legacy.nHeight = 500;
+    uint256 txid = GetRandHash();
+    db.WriteLegacy(txid, legacy);
+    BOOST_CHECK(!db.HaveCoin(COutPoint(txid, 0)));
+
+    // each unspent output of the old record becomes a record of its own
+    BOOST_CHECK(db.Upgrade());
+    Coin coin;
+    BOOST_CHECK(db.GetCoin(COutPoint(txid, 0), coin));
+    BOOST_CHECK_EQUAL(coin.out.nValue, 1000);
+    BOOST_CHECK_EQUAL(coin.nHeight, 500);
+    BOOST_CHECK(coin.IsCoinStake() && !coin.IsCoinBase());
+    BOOST_CHECK(!db.HaveCoin(COutPoint(txid, 1)));
+    BOOST_CHECK(db.GetCoin(COutPoint(txid, 2), coin));
+    BOOST_CHECK_EQUAL(coin.out.nValue, 3000);
+
+    // spending one output only rewrites that output's record
+    CCoinsViewCache cache(&db);
+    BOOST_CHECK(cache.SpendCoin(COutPoint(txid, 0)));
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 1);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!db.HaveCoin(COutPoint(txid, 0)));
+    BOOST_CHECK(db.HaveCoin(COutPoint(txid, 2)));
+
+    // an upgraded database is left alone
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK(db.HaveCoin(COutPoint(txid, 2)));
 }
 
 BOOST_AUTO_TEST_SUITE_END()
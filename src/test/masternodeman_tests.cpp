@@ -0,0 +1,286 @@
+// Copyright (c) 2019-2020 The BITWIN24 developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "clientversion.h"
+#include "key.h"
+#include "masternodeman.h"
+#include "script/standard.h"
+#include "streams.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(masternodeman_tests)
+
+static CMasternode MakeMasternode(uint32_t n, const CPubKey& pubKeyCollateral, const CPubKey& pubKeyMasternode)
+{
+    CMasternode mn;
+    mn.vin = CTxIn(COutPoint(uint256(1000 + n), n));
+    mn.pubKeyCollateralAddress = pubKeyCollateral;
+    mn.pubKeyMasternode = pubKeyMasternode;
+    return mn;
+}
+
+BOOST_AUTO_TEST_CASE(masternodeman_index)
+{
+    CMasternodeMan man;
+    std::vector<CPubKey> vKeys;
+    for (int i = 0; i < 4; i++) {
+        CKey key;
+        key.MakeNewKey(true);
+        vKeys.push_back(key.GetPubKey());
+    }
+
+    // two masternodes paying to the same collateral address
+    CMasternode mn1 = MakeMasternode(1, vKeys[0], vKeys[1]);
+    CMasternode mn2 = MakeMasternode(2, vKeys[0], vKeys[2]);
+    BOOST_CHECK(man.Add(mn1));
+    BOOST_CHECK(man.Add(mn2));
+    BOOST_CHECK(!man.Add(mn1));
+    BOOST_CHECK_EQUAL(man.size(), 2);
+
+    CMasternode* pmn1 = man.Find(mn1.vin);
+    CMasternode* pmn2 = man.Find(mn2.vin);
+    BOOST_REQUIRE(pmn1 && pmn2);
+    BOOST_CHECK(pmn1->vin == mn1.vin);
+    BOOST_CHECK(man.Find(vKeys[1]) == pmn1);
+    BOOST_CHECK(man.Find(vKeys[2]) == pmn2);
+    BOOST_CHECK(man.Find(GetScriptForDestination(vKeys[0].GetID())) == pmn1);
+    BOOST_CHECK(man.Find(vKeys[3]) == NULL);
+
+    // entries keep their address while others come and go
+    CMasternode mn3 = MakeMasternode(3, vKeys[3], vKeys[3]);
+    BOOST_CHECK(man.Add(mn3));
+    man.Remove(mn1.vin);
+    BOOST_CHECK(man.Find(mn1.vin) == NULL);
+    BOOST_CHECK(man.Find(vKeys[1]) == NULL);
+    BOOST_CHECK(man.Find(mn2.vin) == pmn2);
+    BOOST_CHECK(man.Find(GetScriptForDestination(vKeys[0].GetID())) == pmn2);
+
+    // a changed masternode key is found after reindexing
+    pmn2->pubKeyMasternode = vKeys[1];
+    man.ReindexMasternode(pmn2);
+    BOOST_CHECK(man.Find(vKeys[1]) == pmn2);
+    BOOST_CHECK(man.Find(vKeys[2]) == NULL);
+
+    man.Clear();
+    BOOST_CHECK_EQUAL(man.size(), 0);
+    BOOST_CHECK(man.Find(mn2.vin) == NULL);
+    BOOST_CHECK(man.Find(vKeys[3]) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(masternodeman_rank)
+{
+    CMasternodeMan man;
+    CKey key;
+    key.MakeNewKey(true);
+    for (uint32_t n = 0; n < 20; n++) {
+        CMasternode mn = MakeMasternode(n, key.GetPubKey(), key.GetPubKey());
+        mn.sigTime = 0;
+        BOOST_CHECK(man.Add(mn));
+    }
+
+    // ranks by position and by vin agree, whatever order the lookups come in
+    for (int nRank = 20; nRank >= 1; nRank -= 3) {
+        CMasternode* pmn = man.GetMasternodeByRank(nRank, 0, 0, false);
+        BOOST_REQUIRE(pmn);
+        BOOST_CHECK_EQUAL(man.GetMasternodeRank(pmn->vin, 0, 0, false), nRank);
+    }
+    BOOST_CHECK(man.GetMasternodeByRank(21, 0, 0, false) == NULL);
+    BOOST_CHECK_EQUAL(man.GetMasternodeRank(CTxIn(COutPoint(uint256(1), 0)), 0, 0, false), -1);
+
+    // unknown blocks have no ranks
+    BOOST_CHECK_EQUAL(man.GetMasternodeRank(man.GetMasternodeByRank(1, 0, 0, false)->vin, 1000000, 0, false), -1);
+    BOOST_CHECK(man.GetMasternodeByRank(1, 1000000, 0, false) == NULL);
+
+    // removing the first ranked masternode moves everybody up
+    CTxIn vinFirst = man.GetMasternodeByRank(1, 0, 0, false)->vin;
+    CTxIn vinSecond = man.GetMasternodeByRank(2, 0, 0, false)->vin;
+    man.Remove(vinFirst);
+    BOOST_CHECK_EQUAL(man.GetMasternodeRank(vinSecond, 0, 0, false), 1);
+    BOOST_CHECK_EQUAL(man.GetMasternodeRank(vinFirst, 0, 0, false), -1);
+}
+
+BOOST_AUTO_TEST_CASE(masternodeman_seen_expiry)
+{
+    CMasternodeMan man;
+    int64_t nNow = GetTime();
+    std::vector<CMasternodePing> vPings;
+    for (uint32_t n = 0; n < 10; n++) {
+        CMasternodePing mnp;
+        mnp.vin = CTxIn(COutPoint(uint256(1000 + n), n));
+        mnp.sigTime = nNow - (9 - n) * MASTERNODE_REMOVAL_SECONDS + 60;
+        vPings.push_back(mnp);
+        BOOST_CHECK(man.AddSeenPing(mnp));
+    }
+    BOOST_CHECK(!man.AddSeenPing(vPings[0]));
+    BOOST_CHECK_EQUAL(man.mapSeenMasternodePing.size(), 10);
+
+    // a broadcast expires with its last ping, which may be renewed
+    CMasternodeBroadcast mnb;
+    mnb.vin = vPings[0].vin;
+    mnb.lastPing = vPings[0];
+    BOOST_CHECK(man.AddSeenBroadcast(mnb));
+    man.UpdateSeenBroadcastPing(mnb.GetHash(), vPings[9]);
+    BOOST_CHECK(man.mapSeenMasternodeBroadcast.find(mnb.GetHash())->second.lastPing == vPings[9]);
+
+    // only pings older than twice the removal time are gone
+    man.CheckAndRemove();
+    BOOST_CHECK_EQUAL(man.mapSeenMasternodePing.size(), 3);
+    for (uint32_t n = 0; n < 10; n++)
+        BOOST_CHECK_EQUAL(man.mapSeenMasternodePing.count(vPings[n].GetHash()), n >= 7 ? 1 : 0);
+    BOOST_CHECK_EQUAL(man.mapSeenMasternodeBroadcast.count(mnb.GetHash()), 1);
+
+    // entries are found by the masternode's collateral
+    std::vector<uint256> vHashes = man.mapSeenMasternodeBroadcast.find_by_outpoint(mnb.vin.prevout);
+    BOOST_CHECK(vHashes.size() == 1 && vHashes[0] == mnb.GetHash());
+    BOOST_CHECK(man.mapSeenMasternodePing.find_by_outpoint(vPings[0].vin.prevout).empty());
+    BOOST_CHECK_EQUAL(man.mapSeenMasternodePing.find_by_outpoint(vPings[8].vin.prevout).size(), 1);
+
+    man.RemoveSeenBroadcast(mnb.GetHash());
+    BOOST_CHECK(man.mapSeenMasternodeBroadcast.empty());
+    BOOST_CHECK(man.mapSeenMasternodeBroadcast.find_by_outpoint(mnb.vin.prevout).empty());
+}
+
+BOOST_AUTO_TEST_CASE(masternodeman_seen_limit)
+{
+    CSeenMasternodeMap<CMasternodePing> mapSeen(5);
+    for (uint32_t n = 0; n < 8; n++) {
+        CMasternodePing mnp;
+        mnp.vin = CTxIn(COutPoint(uint256(1000 + n), n));
+        mnp.sigTime = 1000 - n;
+        BOOST_CHECK(mapSeen.insert(std::make_pair(mnp.GetHash(), mnp)));
+    }
+    BOOST_CHECK(mapSeen.full());
+
+    // entries come out oldest first, whatever order they went in
+    uint256 hash;
+    CMasternodePing mnp;
+    int64_t nLastTime = 0;
+    while (mapSeen.full() && mapSeen.pop_oldest(std::numeric_limits<int64_t>::max(), hash, mnp)) {
+        BOOST_CHECK(mnp.sigTime > nLastTime);
+        BOOST_CHECK(mnp.GetHash() == hash);
+        nLastTime = mnp.sigTime;
+    }
+    BOOST_CHECK_EQUAL(mapSeen.size(), 5);
+    BOOST_CHECK_EQUAL(nLastTime, 995);
+
+    // a serialized map keeps its order and its limit when read back
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << mapSeen;
+    CSeenMasternodeMap<CMasternodePing> mapRead(3);
+    ss >> mapRead;
+    BOOST_CHECK_EQUAL(mapRead.size(), 3);
+    BOOST_CHECK(!mapRead.pop_oldest(998, hash, mnp));
+    BOOST_CHECK(mapRead.pop_oldest(999, hash, mnp));
+    BOOST_CHECK_EQUAL(mnp.sigTime, 998);
+}
+
+BOOST_AUTO_TEST_CASE(masternodeman_seen_unchecked)
+{
+    CSeenMasternodeMap<CMasternodePing> mapSeen(5);
+    std::vector<CMasternodePing> vPings;
+    for (uint32_t n = 0; n < 20; n++) {
+        CMasternodePing mnp;
+        mnp.vin = CTxIn(COutPoint(uint256(1000 + n), n));
+        mnp.sigTime = 1000 + n;
+        vPings.push_back(mnp);
+    }
+    for (uint32_t n = 0; n < 4; n++)
+        BOOST_CHECK(mapSeen.insert(std::make_pair(vPings[n].GetHash(), vPings[n])));
+
+    // a flood of unchecked entries, dated up to far into the future, only pushes out unchecked ones
+    uint256 hash;
+    CMasternodePing mnp;
+    for (uint32_t n = 4; n < 20; n++) {
+        if (n % 2)
+            vPings[n].sigTime += 1000000;
+        BOOST_CHECK(mapSeen.insert(std::make_pair(vPings[n].GetHash(), vPings[n]), false));
+        while (mapSeen.full() && mapSeen.pop_unchecked(hash, mnp))
+            BOOST_CHECK(mnp.GetHash() == hash);
+    }
+    BOOST_CHECK_EQUAL(mapSeen.size(), 5);
+    BOOST_CHECK_EQUAL(mapSeen.unchecked_size(), 1);
+    for (uint32_t n = 0; n < 4; n++)
+        BOOST_CHECK(mapSeen.checked(vPings[n].GetHash()));
+    BOOST_CHECK(mapSeen.count(vPings[4].GetHash()));
+    BOOST_CHECK(!mapSeen.checked(vPings[4].GetHash()));
+
+    // future dated entries are the first to go
+    BOOST_CHECK(mapSeen.insert(std::make_pair(vPings[19].GetHash(), vPings[19]), false));
+    BOOST_CHECK(mapSeen.pop_unchecked(hash, mnp));
+    BOOST_CHECK(hash == vPings[19].GetHash());
+
+    // once checked, an entry is evicted by age like the others, and only checked entries are written
+    BOOST_CHECK(mapSeen.check(vPings[4].GetHash()));
+    BOOST_CHECK(!mapSeen.check(vPings[4].GetHash()));
+    BOOST_CHECK(mapSeen.insert(std::make_pair(vPings[19].GetHash(), vPings[19]), false));
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << mapSeen;
+    CSeenMasternodeMap<CMasternodePing> mapRead(5);
+    ss >> mapRead;
+    BOOST_CHECK_EQUAL(mapRead.size(), 5);
+    BOOST_CHECK(mapRead.checked(vPings[4].GetHash()));
+    BOOST_CHECK(!mapRead.count(vPings[19].GetHash()));
+    BOOST_CHECK(mapSeen.pop_unchecked(hash, mnp));
+    BOOST_CHECK(hash == vPings[19].GetHash());
+    BOOST_CHECK(mapSeen.pop_oldest(std::numeric_limits<int64_t>::max(), hash, mnp));
+    BOOST_CHECK(hash == vPings[0].GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(masternodeman_dseg_filter)
+{
+    // a peer answering the list request, and a restarted node holding most of the list
+    CMasternodeMan manPeer;
+    CMasternodeMan manLocal;
+    CKey key;
+    key.MakeNewKey(true);
+    const int nMasternodes = 2000;
+    const int nMissing = 50;
+    std::set<uint256> setMissing;
+    for (uint32_t n = 0; n < nMasternodes; n++) {
+        CMasternode mn = MakeMasternode(n, key.GetPubKey(), key.GetPubKey());
+        mn.sigTime = n;
+        BOOST_CHECK(manPeer.Add(mn));
+        CMasternodeBroadcast mnb(mn);
+        if (n % (nMasternodes / nMissing) == 0)
+            setMissing.insert(mnb.GetHash());
+        else
+            manLocal.AddSeenBroadcast(mnb);
+    }
+
+    std::vector<CInv> vInvFull;
+    BOOST_CHECK_EQUAL(manPeer.GetDsegInventory(CTxIn(), NULL, vInvFull), nMasternodes);
+    BOOST_CHECK_EQUAL(vInvFull.size(), nMasternodes);
+
+    // the filter as the peer reads it from the dseg message
+    CDataStream ssFilter(SER_NETWORK, PROTOCOL_VERSION);
+    ssFilter << manLocal.GetKnownBroadcastsFilter();
+    CBloomFilter filter;
+    BOOST_CHECK(CMasternodeMan::ReadDsegFilter(ssFilter, filter));
+    std::vector<CInv> vInvFiltered;
+    BOOST_CHECK_EQUAL(manPeer.GetDsegInventory(CTxIn(), &filter, vInvFiltered), nMasternodes);
+
+    // only missing entries are announced, all of them but the filter's false positives
+    BOOST_FOREACH (const CInv& inv, vInvFiltered)
+        BOOST_CHECK(setMissing.count(inv.hash));
+    std::set<uint256> setAnnounced;
+    BOOST_FOREACH (const CInv& inv, vInvFiltered)
+        setAnnounced.insert(inv.hash);
+    BOOST_FOREACH (const uint256& hash, setMissing)
+        BOOST_CHECK(setAnnounced.count(hash) || filter.contains(hash));
+    BOOST_CHECK(vInvFiltered.size() > nMissing - 5);
+
+    // a request for a single entry is not filtered
+    std::vector<CInv> vInvSingle;
+    BOOST_CHECK_EQUAL(manPeer.GetDsegInventory(manPeer.GetMasternodeByRank(1, 0, 0, false)->vin, &filter, vInvSingle), 1);
+
+    unsigned int nBytesFull = ::GetSerializeSize(CTxIn(), SER_NETWORK, PROTOCOL_VERSION) + ::GetSerializeSize(vInvFull, SER_NETWORK, PROTOCOL_VERSION);
+    unsigned int nBytesFiltered = ::GetSerializeSize(CTxIn(), SER_NETWORK, PROTOCOL_VERSION) + ::GetSerializeSize(filter, SER_NETWORK, PROTOCOL_VERSION) +
+                                  ::GetSerializeSize(vInvFiltered, SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(nBytesFiltered < nBytesFull);
+    BOOST_TEST_MESSAGE(strprintf("list sync of %d masternodes, %d missing: full %u bytes, filtered %u bytes",
+        nMasternodes, nMissing, nBytesFull, nBytesFiltered));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,109 @@
+// Copyright (c) 2019-2020 The BITWIN24 developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "hash.h"
+#include "masternodeman.h"
+#include "sectionfile.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(sectionfile_tests)
+
+BOOST_AUTO_TEST_CASE(sectionfile_roundtrip)
+{
+    boost::filesystem::path path = GetDataDir() / "sectionfile_test.dat";
+    std::vector<int> vData(1000, 7);
+    std::string strData = "second section";
+
+    CSectionFileWriter fileout("SectionTest");
+    fileout.AddSection(2) << strData;
+    fileout.AddSection(1) << vData;
+    fileout.AddSection(3);
+    BOOST_CHECK(fileout.Write(path));
+
+    {
+        CSectionFileReader filein;
+        BOOST_CHECK_EQUAL(filein.Open(path, "SectionTest"), CSectionFileReader::Ok);
+        BOOST_CHECK_EQUAL(filein.GetVersion(), CLIENT_VERSION);
+        std::vector<int> vRead;
+        std::string strRead;
+        filein.GetSection(1) >> vRead;
+        filein.GetSection(2) >> strRead;
+        BOOST_CHECK(vRead == vData);
+        BOOST_CHECK_EQUAL(strRead, strData);
+        BOOST_CHECK(filein.HasSection(3) && filein.GetSection(3).empty());
+        BOOST_CHECK(!filein.HasSection(4));
+        BOOST_CHECK_THROW(filein.GetSection(4), std::ios_base::failure);
+
+        CSectionFileReader fileOther;
+        BOOST_CHECK_EQUAL(fileOther.Open(path, "OtherTest"), CSectionFileReader::IncorrectMagicMessage);
+    }
+
+    // flip a byte inside the first section
+    FILE* file = fopen(path.string().c_str(), "r+b");
+    BOOST_REQUIRE(file);
+    fseek(file, 2000, SEEK_SET);
+    fputc(0x55, file);
+    fclose(file);
+    CSectionFileReader fileCorrupt;
+    BOOST_CHECK_EQUAL(fileCorrupt.Open(path, "SectionTest"), CSectionFileReader::IncorrectHash);
+
+    CSectionFileReader fileMissing;
+    BOOST_CHECK_EQUAL(fileMissing.Open(GetDataDir() / "missing.dat", "SectionTest"), CSectionFileReader::FileError);
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(sectionfile_mncache)
+{
+    CMasternodeMan man;
+    std::vector<CMasternodePing> vPings;
+    for (uint32_t n = 0; n < 10; n++) {
+        CMasternodePing mnp;
+        mnp.vin = CTxIn(COutPoint(uint256(1000 + n), n));
+        mnp.sigTime = GetTime() + n;
+        vPings.push_back(mnp);
+        man.AddSeenPing(mnp);
+    }
+
+    // older files are still imported
+    CDataStream ssLegacy(SER_DISK, CLIENT_VERSION);
+    ssLegacy << std::string("MasternodeCache") << FLATDATA(Params().MessageStart()) << man;
+    ssLegacy << Hash(ssLegacy.begin(), ssLegacy.end());
+    FILE* file = fopen((GetDataDir() / "mncache.dat").string().c_str(), "wb");
+    BOOST_REQUIRE(file);
+    fwrite(&ssLegacy[0], 1, ssLegacy.size(), file);
+    fclose(file);
+
+    CMasternodeDB mndb;
+    CMasternodeMan manLegacy;
+    BOOST_CHECK_EQUAL(mndb.Read(manLegacy, true), CMasternodeDB::Ok);
+    BOOST_CHECK(!manLegacy.mapSeenMasternodePing.pending());
+    BOOST_CHECK_EQUAL(manLegacy.mapSeenMasternodePing.size(), vPings.size());
+
+    // the sectioned format leaves the seen maps serialized until they are used
+    BOOST_CHECK(mndb.Write(man));
+    CMasternodeMan manRead;
+    BOOST_CHECK_EQUAL(mndb.Read(manRead, true), CMasternodeDB::Ok);
+    BOOST_CHECK(manRead.mapSeenMasternodePing.pending());
+    BOOST_CHECK(manRead.mapSeenMasternodeBroadcast.pending());
+    BOOST_CHECK_EQUAL(manRead.mapSeenMasternodePing.count(vPings[3].GetHash()), 1);
+    BOOST_CHECK(!manRead.mapSeenMasternodePing.pending());
+    BOOST_CHECK_EQUAL(manRead.mapSeenMasternodePing.size(), vPings.size());
+    BOOST_CHECK(manRead.mapSeenMasternodeBroadcast.empty());
+
+    // and writes them back even if nothing used them
+    CMasternodeMan manPending;
+    BOOST_CHECK_EQUAL(mndb.Read(manPending, true), CMasternodeDB::Ok);
+    BOOST_CHECK(mndb.Write(manPending));
+    CMasternodeMan manReread;
+    BOOST_CHECK_EQUAL(mndb.Read(manReread, true), CMasternodeDB::Ok);
+    BOOST_CHECK_EQUAL(manReread.mapSeenMasternodePing.size(), vPings.size());
+    boost::filesystem::remove(GetDataDir() / "mncache.dat");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,22 @@
+// Copyright (c) 2019-2020 The BITWIN24 developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "spork.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(spork_tests)
+
+BOOST_AUTO_TEST_CASE(spork_values)
+{
+    for (int nSporkID = SPORK_START; nSporkID <= SPORK_END; nSporkID++)
+        BOOST_CHECK_EQUAL(GetSporkValue(nSporkID), GetSporkValueUncached(nSporkID));
+    BOOST_CHECK_EQUAL(GetSporkValue(SPORK_5_MAX_VALUE), SPORK_5_MAX_VALUE_DEFAULT);
+    BOOST_CHECK_EQUAL(GetSporkValue(SPORK_END + 1), -1);
+    BOOST_CHECK_EQUAL(GetSporkValue(10010), -1);
+    BOOST_CHECK(IsSporkActive(SPORK_2_SWIFTTX));
+    BOOST_CHECK(!IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
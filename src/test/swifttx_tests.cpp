@@ -0,0 +1,61 @@
+// Copyright (c) 2019-2020 The BITWIN24 developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "swifttx.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(swifttx_tests)
+
+static CConsensusVote MakeVote(uint32_t n, int nBlockHeight)
+{
+    CConsensusVote vote;
+    vote.vinMasternode = CTxIn(COutPoint(uint256(1000 + n), n));
+    vote.txHash = uint256(1);
+    vote.nBlockHeight = nBlockHeight;
+    return vote;
+}
+
+BOOST_AUTO_TEST_CASE(swifttx_lock_signatures)
+{
+    CTransactionLock lock;
+    lock.txHash = uint256(1);
+    lock.nBlockHeight = 0;
+    BOOST_CHECK_EQUAL(lock.CountSignatures(), -1);
+
+    lock.nBlockHeight = 100;
+    BOOST_CHECK_EQUAL(lock.CountSignatures(), 0);
+
+    // only votes for the lock height count, once per rank
+    for (int nRank = 1; nRank <= 5; nRank++)
+        lock.AddSignature(MakeVote(nRank, 100), nRank);
+    lock.AddSignature(MakeVote(6, 100), 3);
+    lock.AddSignature(MakeVote(7, 101), 6);
+    lock.AddSignature(MakeVote(8, 100), SWIFTTX_SIGNATURES_TOTAL + 1);
+    BOOST_CHECK_EQUAL(lock.CountSignatures(), 5);
+
+    lock.nBlockHeight = 101;
+    BOOST_CHECK_EQUAL(lock.CountSignatures(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(swifttx_conflicting_locks)
+{
+    CMutableTransaction txLocked;
+    txLocked.vin.push_back(CTxIn(COutPoint(uint256(10), 0)));
+    CMutableTransaction txOther;
+    txOther.vin.push_back(CTxIn(COutPoint(uint256(10), 1)));
+    CTransaction tx1(txLocked), tx2(txOther);
+
+    mapLockedInputs.insert(std::make_pair(tx1.vin[0].prevout, tx1.GetHash()));
+    BOOST_CHECK(!CheckForConflictingLocks(tx1));
+    BOOST_CHECK(!CheckForConflictingLocks(tx2));
+
+    // spending the locked input elsewhere conflicts
+    txOther.vin.push_back(tx1.vin[0]);
+    CTransaction tx3(txOther);
+    BOOST_CHECK(CheckForConflictingLocks(tx3));
+    mapLockedInputs.clear();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
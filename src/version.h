@@ -11,7 +11,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 70916;
+static const int PROTOCOL_VERSION = 70918;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -26,6 +26,12 @@ static const int MIN_PEER_PROTO_VERSION_AFTER_ENFORCEMENT = 70916;
 //! masternodes older than this proto version use old strMessage format for mnannounce
 static const int MIN_PEER_MNANNOUNCE = 70913;
 
+//! blocks are relayed with a compact masternode witness, "getmnwproofs" and "mnwproofs" are available
+static const int COMPACT_WITNESS_VERSION = 70917;
+
+//! "dseg" list requests can carry a bloom filter of the masternode broadcasts the requester holds
+static const int MNLIST_FILTER_VERSION = 70918;
+
 //! nTime field added to CAddress, starting with this version;
 //! if possible, avoid requesting addresses nodes older than this
 static const int CADDR_TIME_VERSION = 31402;
@@ -32,6 +32,7 @@
 #include "libzerocoin/Denominations.h"
 #include "zbwiwallet.h"
 #include "primitives/deterministicmint.h"
+#include <algorithm>
 #include <assert.h>
 
 #include <boost/algorithm/string/replace.hpp>
@@ -457,6 +458,82 @@ void CWallet::AddToSpends(const uint256& wtxid)
         AddToSpends(txin.prevout, wtxid);
 }
 
+void CWallet::EraseStakeableCoins(const uint256& hash)
+{
+    std::map<uint256, int>::iterator mi = mapStakeableTxHeight.find(hash);
+    if (mi == mapStakeableTxHeight.end())
+        return;
+
+    std::set<COutPoint>& setCoins = mapStakeableCoins[mi->second];
+    std::set<COutPoint>::iterator it = setCoins.lower_bound(COutPoint(hash, 0));
+    while (it != setCoins.end() && it->hash == hash)
+        setCoins.erase(it++);
+    if (setCoins.empty())
+        mapStakeableCoins.erase(mi->second);
+    mapStakeableTxHeight.erase(mi);
+}
+
+void CWallet::IndexStakeableCoins(const CWalletTx& wtx)
+{
+    uint256 hash = wtx.GetHash();
+    EraseStakeableCoins(hash);
+
+    // Only outputs confirmed in the active chain are indexed, they are
+    // re-bucketed when the transaction is synced from another block.
+    BlockMap::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+    if (wtx.hashBlock == 0 || mi == mapBlockIndex.end() || !chainActive.Contains(mi->second))
+        return;
+    int nMatureHeight = mi->second->nHeight;
+    if (wtx.IsCoinBase() || wtx.IsCoinStake())
+        nMatureHeight += Params().COINBASE_MATURITY();
+
+    // Outputs with a spender stay indexed, the spender may be conflicted or
+    // orphaned. AvailableStakeCoins() leaves out the ones actually spent.
+    std::set<COutPoint> setCoins;
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        const CTxOut& out = wtx.vout[i];
+        if (out.nValue <= 0 || out.IsZerocoinMint() || IsMine(out) == ISMINE_NO)
+            continue;
+        setCoins.insert(COutPoint(hash, i));
+    }
+    if (setCoins.empty())
+        return;
+
+    mapStakeableCoins[nMatureHeight].insert(setCoins.begin(), setCoins.end());
+    mapStakeableTxHeight[hash] = nMatureHeight;
+}
+
+void CWallet::UpdateStakeableCoins(const CWalletTx& wtx, bool fErased)
+{
+    AssertLockHeld(cs_wallet);
+
+    // Outputs spent by this transaction in the active chain can't be staked
+    // anymore. Once it is disconnected, conflicted or erased they can again.
+    if (!wtx.IsCoinBase() && !wtx.IsZerocoinSpend()) {
+        BlockMap::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+        bool fInActiveChain = !fErased && wtx.hashBlock != 0 && mi != mapBlockIndex.end() && chainActive.Contains(mi->second);
+        for (const CTxIn& txin : wtx.vin) {
+            std::map<uint256, int>::iterator mih = mapStakeableTxHeight.find(txin.prevout.hash);
+            if (fInActiveChain) {
+                if (mih == mapStakeableTxHeight.end())
+                    continue;
+                std::map<int, std::set<COutPoint> >::iterator bucket = mapStakeableCoins.find(mih->second);
+                if (bucket != mapStakeableCoins.end())
+                    bucket->second.erase(txin.prevout);
+            } else {
+                std::map<uint256, CWalletTx>::const_iterator mip = mapWallet.find(txin.prevout.hash);
+                if (mip != mapWallet.end())
+                    IndexStakeableCoins(mip->second);
+            }
+        }
+    }
+
+    if (fErased)
+        EraseStakeableCoins(wtx.GetHash());
+    else
+        IndexStakeableCoins(wtx);
+}
+
 bool CWallet::GetMasternodeVinAndKeys(CTxIn& txinRet, CPubKey& pubKeyRet, CKey& keyRet, std::string strTxHash, std::string strOutputIndex)
 {
     // wait for reindex and/or import to finish
@@ -641,6 +718,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         wtx.BindWallet(this);
         wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
         AddToSpends(hash);
+        UpdateStakeableCoins(wtx);
     } else {
         LOCK(cs_wallet);
         // Inserts only if not already there, returns tx inserted or tx found
@@ -686,6 +764,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         // Break debit/credit balance caches:
         wtx.MarkDirty();
 
+        UpdateStakeableCoins(wtx);
+
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
 
@@ -743,6 +823,9 @@ void CWallet::EraseFromWallet(const uint256& hash)
         return;
     {
         LOCK(cs_wallet);
+        std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+            UpdateStakeableCoins(mi->second, true);
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
     }
@@ -2144,6 +2227,40 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
     }
 }
 
+void CWallet::AvailableStakeCoins(vector<COutput>& vCoins) const
+{
+    vCoins.clear();
+
+    LOCK2(cs_main, cs_wallet);
+    int nHeight = chainActive.Height();
+    for (std::map<int, std::set<COutPoint> >::const_iterator it = mapStakeableCoins.begin(); it != mapStakeableCoins.end() && it->first <= nHeight; ++it) {
+        for (const COutPoint& outpoint : it->second) {
+            const CWalletTx* pcoin = GetWalletTx(outpoint.hash);
+            if (!pcoin)
+                continue;
+
+            // the index only knows where the coin was confirmed, the chain may have moved since
+            if (!pcoin->IsTrusted())
+                continue;
+            if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
+                continue;
+
+            const CTxOut& out = pcoin->vout[outpoint.n];
+            CTxDestination txAddress;
+            if (ExtractDestination(out.scriptPubKey, txAddress) && !IsStakingEnabled(CBitcoinAddress(txAddress)))
+                continue;
+
+            isminetype mine = IsMine(out);
+            if (mine == ISMINE_NO || mine == ISMINE_WATCH_ONLY)
+                continue;
+            if (IsSpent(outpoint.hash, outpoint.n) || IsLockedCoin(outpoint.hash, outpoint.n))
+                continue;
+
+            vCoins.emplace_back(COutput(pcoin, outpoint.n, pcoin->GetDepthInMainChain(false), true));
+        }
+    }
+}
+
 map<CBitcoinAddress, vector<COutput> > CWallet::AvailableCoinsByAddress(bool fConfirmed, CAmount maxCoinValue)
 {
     vector<COutput> vCoins;
@@ -2226,7 +2343,7 @@ bool CWallet::SelectStakeCoins(std::list<std::unique_ptr<CStakeInput> >& listInp
     LOCK(cs_main);
     //Add BITWIN24
     vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, NULL, false, STAKABLE_COINS);
+    AvailableStakeCoins(vCoins);
     CAmount nAmountSelected = 0;
 
     if (GetBoolArg("-bitwin24stake", true)) {
@@ -2309,7 +2426,7 @@ bool CWallet::MintableCoins()
             return false;
 
         vector<COutput> vCoins;
-        AvailableCoins(vCoins, true, NULL, false, STAKABLE_COINS);
+        AvailableStakeCoins(vCoins);
 
         for (const COutput& out : vCoins) {
             int64_t nTxTime = out.tx->GetTxTime();
@@ -3108,88 +3225,87 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (listInputs.empty())
         return false;
 
-    if (GetAdjustedTime() - chainActive.Tip()->GetBlockTime() < 60)
-        MilliSleep(10000);
+    std::vector<CStakeInput*> vInputs;
+    for (std::unique_ptr<CStakeInput>& stakeInput : listInputs)
+        vInputs.push_back(stakeInput.get());
 
     CAmount nCredit;
     CScript scriptPubKeyKernel;
     bool fKernelFound = false;
-    for (std::unique_ptr<CStakeInput>& stakeInput : listInputs) {
+    while (!vInputs.empty()) {
         nCredit = 0;
         // Make sure the wallet is unlocked and shutdown hasn't been requested
         if (IsLocked() || ShutdownRequested())
             return false;
 
-        //make sure that enough time has elapsed between
-        CBlockIndex* pindex = stakeInput->GetIndexFrom();
-        if (!pindex || pindex->nHeight < 1) {
-            LogPrintf("*** no pindexfrom\n");
-            continue;
-        }
-
-        // Read block header
-        CBlockHeader block = pindex->GetBlockHeader();
+        CStakeInput* stakeInput = NULL;
         uint256 hashProofOfStake = 0;
         nTxNewTime = GetAdjustedTime();
 
-        //iterates each utxo inside of CheckStakeKernelHash()
-        if (Stake(stakeInput.get(), nBits, block.GetBlockTime(), nTxNewTime, hashProofOfStake)) {
+        int nHeight;
+        {
             LOCK(cs_main);
-            //Double check that this will pass time requirements
-            if (nTxNewTime <= chainActive.Tip()->GetMedianTimePast()) {
-                LogPrintf("CreateCoinStake() : kernel found, but it is too far in the past \n");
-                continue;
-            }
+            nHeight = chainActive.Height();
+        }
 
-            // Found a kernel
-            LogPrintf("CreateCoinStake : kernel found\n");
-            nCredit += stakeInput->GetValue();
-
-            // Calculate reward
-            CAmount nReward;
-            CMasterNodeWitness witness = pMNWitness->CreateMasterNodeWitnessSnapshot();
-            nReward = GetBlockValue(chainActive.Height() + 1, witness.nProofs.size());
-            nCredit += nReward;
-
-            // Create the output transaction(s)
-            CAmount nMinFee = 0;
-            vector<CTxOut> vout;
-            if (!stakeInput->CreateTxOuts(this, vout, nCredit - nMinFee)) {
-                LogPrintf("%s : failed to get scriptPubKey\n", __func__);
-                continue;
-            }
-            txNew.vout.insert(txNew.vout.end(), vout.begin(), vout.end());
+        //iterates all utxos inside of FindStakeKernel()
+        if (!FindStakeKernel(vInputs, nBits, nHeight, nTxNewTime, hashProofOfStake, stakeInput))
+            break;
+        // an input whose kernel can't be used below is not searched again
+        vInputs.erase(std::find(vInputs.begin(), vInputs.end(), stakeInput));
 
-            // Limit size
-            unsigned int nBytes = ::GetSerializeSize(txNew, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBytes >= DEFAULT_BLOCK_MAX_SIZE / 5)
-                return error("CreateCoinStake : exceeded coinstake size limit");
+        LOCK(cs_main);
+        //Double check that this will pass time requirements
+        if (nTxNewTime <= chainActive.Tip()->GetMedianTimePast()) {
+            LogPrintf("CreateCoinStake() : kernel found, but it is too far in the past \n");
+            continue;
+        }
 
-            //Masternode payment
-            FillBlockPayee(txNew, nMinFee, true, stakeInput->IsZBWI());
+        // Found a kernel
+        LogPrintf("CreateCoinStake : kernel found\n");
+        nCredit += stakeInput->GetValue();
 
-            uint256 hashTxOut = txNew.GetHash();
-            CTxIn in;
-            if (!stakeInput->CreateTxIn(this, in, hashTxOut)) {
-                LogPrintf("%s : failed to create TxIn\n", __func__);
-                txNew.vin.clear();
-                txNew.vout.clear();
-                continue;
-            }
-            txNew.vin.emplace_back(in);
+        // Calculate reward
+        CAmount nReward;
+        nReward = GetBlockValue(chainActive.Height() + 1, pMNWitness->GetMasterNodeWitnessSnapshotSize());
+        nCredit += nReward;
 
-            //Mark mints as spent
-            if (stakeInput->IsZBWI()) {
-                CZBWIStake* z = (CZBWIStake*)stakeInput.get();
-                if (!z->MarkSpent(this, txNew.GetHash()))
-                    return error("%s: failed to mark mint as used\n", __func__);
-            }
+        // Create the output transaction(s)
+        CAmount nMinFee = 0;
+        vector<CTxOut> vout;
+        if (!stakeInput->CreateTxOuts(this, vout, nCredit - nMinFee)) {
+            LogPrintf("%s : failed to get scriptPubKey\n", __func__);
+            continue;
+        }
+        txNew.vout.insert(txNew.vout.end(), vout.begin(), vout.end());
 
-            fKernelFound = true;
-            break;
+        // Limit size
+        unsigned int nBytes = ::GetSerializeSize(txNew, SER_NETWORK, PROTOCOL_VERSION);
+        if (nBytes >= DEFAULT_BLOCK_MAX_SIZE / 5)
+            return error("CreateCoinStake : exceeded coinstake size limit");
+
+        //Masternode payment
+        FillBlockPayee(txNew, nMinFee, true, stakeInput->IsZBWI());
+
+        uint256 hashTxOut = txNew.GetHash();
+        CTxIn in;
+        if (!stakeInput->CreateTxIn(this, in, hashTxOut)) {
+            LogPrintf("%s : failed to create TxIn\n", __func__);
+            txNew.vin.clear();
+            txNew.vout.clear();
+            continue;
+        }
+        txNew.vin.emplace_back(in);
+
+        //Mark mints as spent
+        if (stakeInput->IsZBWI()) {
+            CZBWIStake* z = (CZBWIStake*)stakeInput;
+            if (!z->MarkSpent(this, txNew.GetHash()))
+                return error("%s: failed to mark mint as used\n", __func__);
         }
-        if (fKernelFound)
-            break; // if kernel is found stop searching
+
+        fKernelFound = true;
+        break; // if kernel is found stop searching
     }
     if (!fKernelFound)
         return false;
@@ -193,6 +193,16 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Confirmed wallet outputs that may be staked, bucketed by the height at which
+     * they become mature. Lets stake selection skip the scan over mapWallet.
+     */
+    std::map<int, std::set<COutPoint> > mapStakeableCoins;
+    std::map<uint256, int> mapStakeableTxHeight;
+    void UpdateStakeableCoins(const CWalletTx& wtx, bool fErased = false);
+    void IndexStakeableCoins(const CWalletTx& wtx);
+    void EraseStakeableCoins(const uint256& hash);
+
 public:
     bool MintableCoins();
     bool SelectStakeCoins(std::list<std::unique_ptr<CStakeInput> >& listInputs, CAmount nTargetAmount);
@@ -387,6 +397,8 @@ public:
     }
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed = true, const CCoinControl* coinControl = NULL, bool fIncludeZeroValue = false, AvailableCoinsType nCoinType = ALL_COINS, bool fUseIX = false, int nWatchonlyConfig = 1, bool includeImmature = false) const;
+    //! same as AvailableCoins(vCoins, true, NULL, false, STAKABLE_COINS) except for unconfirmed coins
+    void AvailableStakeCoins(std::vector<COutput>& vCoins) const;
     std::map<CBitcoinAddress, std::vector<COutput> > AvailableCoinsByAddress(bool fConfirmed = true, CAmount maxCoinValue = 0);
     bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
 